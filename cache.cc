@@ -0,0 +1,305 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "portable.h"
+
+#include "cache.h"
+#include "file.h"
+#include "data.h"
+#include "lib/endianrw.h"
+
+#include <iostream>
+
+using namespace std;
+
+/**
+ * Signature and version of the cache file.
+ * Any change of the format requires a different version.
+ */
+#define CACHE_MAGIC "AdvanceSCAN zip cache 1\n"
+#define CACHE_MAGIC_SIZE (sizeof(CACHE_MAGIC) - 1)
+
+// Offsets in the record header
+#define CACHE_RO_path_length 0x00
+#define CACHE_RO_size 0x04
+#define CACHE_RO_mtime_low 0x08
+#define CACHE_RO_mtime_high 0x0C
+#define CACHE_RO_inode_low 0x10
+#define CACHE_RO_inode_high 0x14
+#define CACHE_RO_data_length 0x18
+#define CACHE_RO_FIXED 0x1C // size of fixed data structure
+
+zipcache::zipcache() : modified(false)
+{
+}
+
+zipcache::~zipcache()
+{
+}
+
+/**
+ * Load the cache.
+ * A missing or damaged cache file is like an empty cache.
+ * \param Apath File of the cache.
+ * \param Arefresh If the content of the file has to be ignored, and written again.
+ */
+void zipcache::load(const string& Apath, bool Arefresh)
+{
+	path = Apath;
+	data.clear();
+	used.clear();
+	dirs.clear();
+	modified = false;
+
+	if (Arefresh) {
+		// the file is written again, even if no zip is read
+		modified = true;
+		return;
+	}
+
+	if (access(path.c_str(), F_OK) != 0)
+		return;
+
+	unsigned size;
+	unsigned char* buf;
+	try {
+		size = file_size(path);
+		buf = data_alloc(size);
+		try {
+			file_read(path, reinterpret_cast<char*>(buf), size);
+		} catch (...) {
+			data_free(buf);
+			throw;
+		}
+	} catch (error& e) {
+		cerr << "warning: " << e << "\n";
+		cerr << "warning: ignoring the cache " << path << "\n";
+		modified = true;
+		return;
+	}
+
+	const unsigned char* p = buf;
+	const unsigned char* end = buf + size;
+
+	bool valid = static_cast<unsigned>(end - p) >= CACHE_MAGIC_SIZE && memcmp(p, CACHE_MAGIC, CACHE_MAGIC_SIZE) == 0;
+	if (valid)
+		p += CACHE_MAGIC_SIZE;
+
+	while (valid && p != end) {
+		if (static_cast<unsigned>(end - p) < CACHE_RO_FIXED) {
+			valid = false;
+			break;
+		}
+
+		unsigned path_length = le_uint32_read(p + CACHE_RO_path_length);
+		unsigned data_length = le_uint32_read(p + CACHE_RO_data_length);
+
+		zip_cent cent;
+		cent.size = le_uint32_read(p + CACHE_RO_size);
+		cent.mtime = static_cast<time_t>(le_uint32_read(p + CACHE_RO_mtime_low) | static_cast<unsigned long long>(le_uint32_read(p + CACHE_RO_mtime_high)) << 32);
+		cent.inode = le_uint32_read(p + CACHE_RO_inode_low) | static_cast<unsigned long long>(le_uint32_read(p + CACHE_RO_inode_high)) << 32;
+		p += CACHE_RO_FIXED;
+
+		if (static_cast<unsigned>(end - p) < path_length || static_cast<unsigned>(end - p) - path_length < data_length) {
+			valid = false;
+			break;
+		}
+
+		string zip(reinterpret_cast<const char*>(p), path_length);
+		p += path_length;
+
+		cent.data.assign(reinterpret_cast<const char*>(p), data_length);
+		p += data_length;
+
+		data[zip] = cent;
+	}
+
+	data_free(buf);
+
+	if (!valid) {
+		cerr << "warning: damaged cache " << path << "\n";
+		cerr << "warning: ignoring it and resuming\n";
+		data.clear();
+		modified = true;
+	}
+}
+
+/**
+ * Save the cache, if modified.
+ * Errors are only reported, as the cache is not required.
+ */
+void zipcache::save()
+{
+	if (!path.length() || !modified)
+		return;
+
+	string save_path = file_temp(path);
+
+	FILE* f = fopen(save_path.c_str(), "wb");
+	if (!f) {
+		cerr << "warning: failed open for writing of the cache " << save_path << "\n";
+		return;
+	}
+
+	bool valid = fwrite(CACHE_MAGIC, CACHE_MAGIC_SIZE, 1, f) == 1;
+
+	for(zipcache_map::const_iterator i=data.begin();valid && i!=data.end();++i) {
+		unsigned long long mtime = static_cast<unsigned long long>(i->second.mtime);
+		unsigned char buf[CACHE_RO_FIXED];
+
+		le_uint32_write(buf + CACHE_RO_path_length, i->first.length());
+		le_uint32_write(buf + CACHE_RO_size, i->second.size);
+		le_uint32_write(buf + CACHE_RO_mtime_low, mtime & 0xFFFFFFFF);
+		le_uint32_write(buf + CACHE_RO_mtime_high, mtime >> 32);
+		le_uint32_write(buf + CACHE_RO_inode_low, i->second.inode & 0xFFFFFFFF);
+		le_uint32_write(buf + CACHE_RO_inode_high, i->second.inode >> 32);
+		le_uint32_write(buf + CACHE_RO_data_length, i->second.data.length());
+
+		if (fwrite(buf, CACHE_RO_FIXED, 1, f) != 1
+			|| fwrite(i->first.data(), i->first.length(), 1, f) != 1
+			|| fwrite(i->second.data.data(), i->second.data.length(), 1, f) != 1)
+			valid = false;
+	}
+
+	if (fclose(f) != 0)
+		valid = false;
+
+	if (valid) {
+		// delete the file if exists
+		if (access(path.c_str(), F_OK) == 0 && remove(path.c_str()) != 0)
+			valid = false;
+		else if (::rename(save_path.c_str(), path.c_str()) != 0)
+			valid = false;
+	}
+
+	if (!valid) {
+		remove(save_path.c_str());
+		cerr << "warning: failed write of the cache " << path << "\n";
+		return;
+	}
+
+	modified = false;
+}
+
+/**
+ * Update the cache of the zips used, and changed after the use.
+ * The zips of the directories read, and not used, are removed.
+ * It must be called after saving the zips.
+ */
+void zipcache::refresh()
+{
+	for(std::set<string>::const_iterator i=used.begin();i!=used.end();++i) {
+		zipcache_map::iterator j = data.find(*i);
+		if (j == data.end())
+			continue;
+
+		struct stat st;
+		if (stat(i->c_str(), &st) != 0) {
+			// removed or moved
+			data.erase(j);
+			modified = true;
+			continue;
+		}
+
+		if (j->second.size == static_cast<unsigned>(st.st_size)
+			&& j->second.mtime == st.st_mtime
+			&& j->second.inode == static_cast<unsigned long long>(st.st_ino))
+			continue;
+
+		modified = true;
+
+		try {
+			zip z(*i);
+			z.open(j->second);
+		} catch (error&) {
+			// a damaged zip is not cached
+			j->second.data.clear();
+		}
+
+		if (j->second.data.empty())
+			data.erase(j);
+	}
+
+	for(zipcache_map::iterator i=data.begin();i!=data.end();) {
+		zipcache_map::iterator j = i;
+		++i;
+
+		// no longer present in its directory
+		if (dirs.find(file_dir(j->first)) != dirs.end() && used.find(j->first) == used.end()) {
+			data.erase(j);
+			modified = true;
+		}
+	}
+}
+
+/**
+ * Get the central directory of a zip.
+ * If not present, an empty one is returned.
+ */
+void zipcache::get(const string& zip, zip_cent& cent)
+{
+	used.insert(zip);
+
+	zipcache_map::const_iterator i = data.find(zip);
+	if (i != data.end()) {
+		cent = i->second;
+	} else {
+		cent.size = 0;
+		cent.mtime = 0;
+		cent.inode = 0;
+		cent.data.clear();
+	}
+}
+
+/**
+ * Set the central directory of a zip.
+ * An empty one removes the zip from the cache.
+ */
+void zipcache::set(const string& zip, const zip_cent& cent)
+{
+	used.insert(zip);
+
+	if (cent.data.empty()) {
+		erase(zip);
+		return;
+	}
+
+	data[zip] = cent;
+	modified = true;
+}
+
+/**
+ * Remove a zip from the cache.
+ */
+void zipcache::erase(const string& zip)
+{
+	if (data.erase(zip) != 0)
+		modified = true;
+}
+
+/**
+ * Mark a directory as read completely.
+ * All its zips must be used with get() in the same run.
+ */
+void zipcache::dir_read(const string& dir)
+{
+	dirs.insert(file_dir(dir + "/"));
+}
+
@@ -0,0 +1,61 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include "zip.h"
+
+#include <map>
+#include <set>
+#include <string>
+
+typedef std::map<std::string, zip_cent> zipcache_map;
+
+/**
+ * Cache of the central directories of the zips.
+ * It's saved in a file, and it's used to avoid reading again the zips
+ * not changed since the last run.
+ */
+class zipcache {
+	std::string path; // file of the cache, empty if disabled
+	zipcache_map data; // central directories by zip path
+	std::set<std::string> used; // zips used in this run
+	std::set<std::string> dirs; // directories read completely in this run
+	bool modified; // if the cache has to be saved
+
+	zipcache(const zipcache&);
+	zipcache& operator=(const zipcache&);
+public:
+	zipcache();
+	~zipcache();
+
+	void load(const std::string& Apath, bool Arefresh);
+	void save();
+	void refresh();
+
+	void get(const std::string& zip, zip_cent& cent);
+	void set(const std::string& zip, const zip_cent& cent);
+	void erase(const std::string& zip);
+	void dir_read(const std::string& dir);
+};
+
+#endif
+
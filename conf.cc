@@ -153,6 +153,12 @@ config::config(const string& file, bool need_rom, bool need_sample, bool need_di
 			if (arg.find(DIR_SEP) != string::npos)
 				throw error() << "Multiple path specification in option `rom_new' in file " << cfg;
 			romnewpath.file_set(file_adjust(arg));
+		} else if (tag == "cache") {
+			if (cachepath.file_get().length())
+				throw error() << "Double specification of option `cache' in file " << cfg;
+			if (arg.length() == 0)
+				throw error() << "Empty specification of option `cache' in file " << cfg;
+			cachepath.file_set(file_adjust(arg));
 		} else {
 			throw error() << "Unknown option `" << tag << "' in file " << cfg;
 		}
@@ -160,6 +166,10 @@ config::config(const string& file, bool need_rom, bool need_sample, bool need_di
 
 	is.close();
 
+	// by default the cache is next to the configuration file
+	if (!cachepath.file_get().length())
+		cachepath.file_set(file_dir(cfg) + "advscan.cache");
+
 	if (need_rom) {
 		if (rompath.empty())
 			throw error() << "Missing option `rom' option in file " << cfg;
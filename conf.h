@@ -32,6 +32,7 @@ class config {
 	filepath sampleunknownpath;
 	filepath diskunknownpath;
 	filepath romnewpath;
+	filepath cachepath;
 public:
 	config(const std::string& file, bool need_rom, bool need_sample, bool need_disk, bool need_change);
 	~config();
@@ -46,6 +47,8 @@ public:
 	const filepath_container& diskpath_get() const { return diskpath; }
 	const filepath& diskunknownpath_get() const { return diskunknownpath; }
 
+	const filepath& cachepath_get() const { return cachepath; }
+
 };
 
 #endif
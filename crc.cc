@@ -0,0 +1,263 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "portable.h"
+
+#include "crc.h"
+
+#include <zlib.h>
+
+// The PCLMULQDQ kernel needs the target attribute and the cpu detection of the compiler
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_CRC_PCLMUL 1
+#include <immintrin.h>
+#else
+#define USE_CRC_PCLMUL 0
+#endif
+
+// The ARMv8 kernel is used only if the compiler targets the CRC extension
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define USE_CRC_ARMV8 1
+#include <arm_acle.h>
+#else
+#define USE_CRC_ARMV8 0
+#endif
+
+typedef crc_t crc_kernel_t(crc_t crc, const unsigned char* data, unsigned len);
+
+static crc_t crc_zlib(crc_t crc, const unsigned char* data, unsigned len)
+{
+	return crc32(crc, data, len);
+}
+
+#if USE_CRC_PCLMUL
+/**
+ * Fold the data with carry-less multiplications, and reduce it to 32 bits.
+ * It's the algorithm of the Intel paper "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction", with the constants of the
+ * reflected crc32 polynomial.
+ * \param crc Crc in the not inverted form.
+ * \param len Size of the data, at least 64 and multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static crc_t crc_pclmul_fold(crc_t crc, const unsigned char* data, unsigned len)
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+	x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+	x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+	x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+
+	// k1 and k2, to fold by 4 blocks of 128 bits
+	x0 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+
+	data += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+		y6 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+		y7 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+		y8 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+		data += 64;
+		len -= 64;
+	}
+
+	// k3 and k4, to fold by 1 block of 128 bits
+	x0 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i*)data);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		data += 16;
+		len -= 16;
+	}
+
+	// fold 128 bits to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// k5
+	x0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits, with the polynomial and mu
+	x0 = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static crc_t crc_pclmul(crc_t crc, const unsigned char* data, unsigned len)
+{
+	if (len >= 64) {
+		unsigned run = len & ~15U;
+
+		crc = ~crc_pclmul_fold(~crc, data, run);
+
+		data += run;
+		len -= run;
+	}
+
+	// the tail is computed with zlib
+	if (len)
+		crc = crc32(crc, data, len);
+
+	return crc;
+}
+#endif
+
+#if USE_CRC_ARMV8
+static crc_t crc_armv8(crc_t crc, const unsigned char* data, unsigned len)
+{
+	crc = ~crc;
+
+	while (len && ((unsigned long)data & 7) != 0) {
+		crc = __crc32b(crc, *data);
+		++data;
+		--len;
+	}
+
+	while (len >= 8) {
+		unsigned long long v;
+		memcpy(&v, data, 8);
+		crc = __crc32d(crc, v);
+		data += 8;
+		len -= 8;
+	}
+
+	while (len) {
+		crc = __crc32b(crc, *data);
+		++data;
+		--len;
+	}
+
+	return ~crc;
+}
+#endif
+
+struct crc_kernel {
+	crc_kernel_t* func;
+	const char* name;
+};
+
+/**
+ * Select the fastest kernel supported by the processor.
+ */
+static crc_kernel crc_select()
+{
+	crc_kernel k;
+
+#if USE_CRC_PCLMUL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+		k.func = crc_pclmul;
+		k.name = "pclmul";
+		return k;
+	}
+#endif
+
+#if USE_CRC_ARMV8
+	k.func = crc_armv8;
+	k.name = "armv8";
+	return k;
+#endif
+
+	k.func = crc_zlib;
+	k.name = "zlib";
+	return k;
+}
+
+/**
+ * Kernel used, selected before main() is called.
+ */
+static crc_kernel crc_used = crc_select();
+
+crc_t crc_compute(const char* data, unsigned len)
+{
+	return crc_used.func(0, (const unsigned char*)data, len);
+}
+
+crc_t crc_compute(crc_t pred, const char* data, unsigned len)
+{
+	return crc_used.func(pred, (const unsigned char*)data, len);
+}
+
+crc_t crc_combine(crc_t crc1, crc_t crc2, unsigned len2)
+{
+	return crc32_combine(crc1, crc2, len2);
+}
+
+crc_t crc_compute_zlib(crc_t pred, const char* data, unsigned len)
+{
+	return crc_zlib(pred, (const unsigned char*)data, len);
+}
+
+const char* crc_kernel_name()
+{
+	return crc_used.name;
+}
+
@@ -0,0 +1,61 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __CRC_H
+#define __CRC_H
+
+typedef unsigned crc_t;
+
+/**
+ * Compute the crc32 of a block of data.
+ * It's the same crc32 of the zip files, computed with the fastest
+ * implementation supported by the processor.
+ */
+crc_t crc_compute(const char* data, unsigned len);
+
+/**
+ * Continue the crc32 computation of a block of data.
+ * \param pred Crc of the previous data, 0 at the start.
+ */
+crc_t crc_compute(crc_t pred, const char* data, unsigned len);
+
+/**
+ * Combine the crc32 of two consecutive blocks of data.
+ * It allows to compute the crc of different parts of the data in parallel.
+ * \param crc1 Crc of the first block.
+ * \param crc2 Crc of the second block.
+ * \param len2 Size of the second block.
+ * \return The crc of the two blocks.
+ */
+crc_t crc_combine(crc_t crc1, crc_t crc2, unsigned len2);
+
+/**
+ * Compute the crc32 with the zlib implementation.
+ * It's used only as reference.
+ */
+crc_t crc_compute_zlib(crc_t pred, const char* data, unsigned len);
+
+/**
+ * Name of the crc32 implementation used.
+ */
+const char* crc_kernel_name();
+
+#endif
+
@@ -0,0 +1,135 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Benchmark of the crc32 implementation used, compared with zlib.
+ * It also checks that the results are the same.
+ */
+
+#include "portable.h"
+
+#include "crc.h"
+
+#include <iostream>
+#include <iomanip>
+#include <ctime>
+
+using namespace std;
+
+/**
+ * Total data processed for each size.
+ */
+#define BENCH_TOTAL (1024*1024*1024)
+
+static double bench(crc_t (*func)(crc_t, const char*, unsigned), const char* data, unsigned size, crc_t& result)
+{
+	unsigned count = BENCH_TOTAL / size;
+	crc_t crc = 0;
+
+	clock_t start = clock();
+	for(unsigned i=0;i<count;++i)
+		crc = func(crc, data, size);
+	clock_t stop = clock();
+
+	result = crc;
+
+	double elapsed = (double)(stop - start) / CLOCKS_PER_SEC;
+	if (elapsed <= 0)
+		return 0;
+
+	return (double)count * size / (1024*1024) / elapsed;
+}
+
+static crc_t crc_used(crc_t pred, const char* data, unsigned len)
+{
+	return crc_compute(pred, data, len);
+}
+
+static bool check(const char* data, unsigned size)
+{
+	bool ok = true;
+
+	// check all the lengths and alignments of the tail
+	for(unsigned i=0;i<size && i<1024;++i) {
+		if (crc_compute(0, data + i % 16, i) != crc_compute_zlib(0, data + i % 16, i)) {
+			cout << "error: different crc with size " << i << "\n";
+			ok = false;
+		}
+	}
+
+	// check the combine of two blocks
+	for(unsigned i=0;i<size;i+=size/7+1) {
+		crc_t crc1 = crc_compute(0, data, i);
+		crc_t crc2 = crc_compute(0, data + i, size - i);
+		if (crc_combine(crc1, crc2, size - i) != crc_compute_zlib(0, data, size)) {
+			cout << "error: different combined crc at " << i << "\n";
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+int main()
+{
+	static const unsigned size_map[] = { 64, 1024, 16*1024, 256*1024, 4*1024*1024, 0 };
+	unsigned size_max = 4*1024*1024;
+
+	char* data = new char[size_max + 16];
+
+	// pseudo random data
+	unsigned seed = 1;
+	for(unsigned i=0;i<size_max + 16;++i) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed >> 16;
+	}
+
+	cout << "kernel " << crc_kernel_name() << "\n";
+
+	if (!check(data, size_max)) {
+		delete [] data;
+		return EXIT_FAILURE;
+	}
+
+	cout << setw(10) << "size" << setw(12) << "zlib MB/s" << setw(12) << "used MB/s" << setw(10) << "speedup" << "\n";
+
+	for(unsigned i=0;size_map[i];++i) {
+		crc_t zlib_crc;
+		crc_t used_crc;
+		double zlib_speed = bench(crc_compute_zlib, data, size_map[i], zlib_crc);
+		double used_speed = bench(crc_used, data, size_map[i], used_crc);
+
+		if (zlib_crc != used_crc) {
+			cout << "error: different crc with size " << size_map[i] << "\n";
+			delete [] data;
+			return EXIT_FAILURE;
+		}
+
+		cout << setw(10) << size_map[i];
+		cout << setw(12) << fixed << setprecision(0) << zlib_speed;
+		cout << setw(12) << fixed << setprecision(0) << used_speed;
+		cout << setw(10) << fixed << setprecision(2) << (zlib_speed > 0 ? used_speed / zlib_speed : 0) << "\n";
+	}
+
+	delete [] data;
+
+	return EXIT_SUCCESS;
+}
+
@@ -26,8 +26,13 @@
 #include <set>
 #include <iostream>
 
+/**
+ * Size of the sha1 hash.
+ */
+#define SHA1_SIZE 20
+
 class sha1 {
-	unsigned char hash[20];
+	unsigned char hash[SHA1_SIZE];
 
 	friend std::ostream& operator<<(std::ostream& os, const sha1& A);
 public:
@@ -36,6 +41,8 @@ public:
 	sha1(const unsigned char* A);
 	sha1(const std::string& A);
 
+	const unsigned char* data_get() const { return hash; }
+
 	bool operator==(const sha1& A) const;
 	sha1& operator=(const sha1& A);
 };
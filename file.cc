@@ -22,20 +22,8 @@
 
 #include "file.h"
 
-#include <zlib.h>
-
 using namespace std;
 
-crc_t crc_compute(const char* data, unsigned len)
-{
-	return crc32(0, (unsigned char*)data, len);
-}
-
-crc_t crc_compute(crc_t pred, const char* data, unsigned len)
-{
-	return crc32(pred, (unsigned char*)data, len);
-}
-
 filepath::filepath()
 {
 }
@@ -202,48 +190,157 @@ unsigned file_size(const string& path)
 }
 
 /**
- * Get the crc of a file.
+ * Size of the buffers used to process a file in chunks.
  */
-crc_t file_crc(const string& path)
+#define FILE_STREAM_BUFFER (1024*1024)
+
+/**
+ * Receiver of the chunks of a file read by file_stream().
+ */
+class file_stream_sink {
+public:
+	virtual ~file_stream_sink() { }
+	virtual void process(const char* data, unsigned size) = 0;
+};
+
+/**
+ * Read a whole file in chunks, using a constant amount of memory.
+ * The system is asked to read ahead the next chunk, while the sink processes the current one.
+ */
+static void file_stream(const string& path, file_stream_sink& sink)
 {
-	unsigned size = file_size(path);
+	FILE* f = fopen(path.c_str(), "rb");
+	if (!f)
+		throw error() << "Failed open for read file " << path;
+
+#if HAVE_POSIX_FADVISE
+	posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
-	char* data = (char*)operator new(size);
+	// the stdio buffering is useless with large reads
+	setvbuf(f, 0, _IONBF, 0);
+
+	char* buf = (char*)operator new(FILE_STREAM_BUFFER);
 
 	try {
-		file_read(path, data, size);
+		off_t offset = 0;
+
+		while (true) {
+			unsigned size = fread(buf, 1, FILE_STREAM_BUFFER, f);
+			if (size != FILE_STREAM_BUFFER && ferror(f))
+				throw error() << "Failed read file " << path;
+
+			offset += size;
+
+#if HAVE_POSIX_FADVISE && defined(POSIX_FADV_WILLNEED)
+			// start the read of the next chunk in background
+			if (size == FILE_STREAM_BUFFER)
+				posix_fadvise(fileno(f), offset, FILE_STREAM_BUFFER, POSIX_FADV_WILLNEED);
+#endif
+
+			if (size)
+				sink.process(buf, size);
+
+			if (size != FILE_STREAM_BUFFER)
+				break;
+		}
 	} catch (...) {
-		operator delete(data);
+		operator delete(buf);
+		fclose(f);
 		throw;
 	}
 
-	crc_t crc = crc_compute(data, size);
+	operator delete(buf);
+	fclose(f);
+}
+
+class file_crc_sink : public file_stream_sink {
+	crc_t crc;
+public:
+	file_crc_sink() : crc(0) { }
 
-	operator delete(data);
+	crc_t crc_get() const { return crc; }
 
-	return crc;
+	void process(const char* data, unsigned size)
+	{
+		crc = crc_compute(crc, data, size);
+	}
+};
+
+/**
+ * Get the crc of a file.
+ */
+crc_t file_crc(const string& path)
+{
+	file_crc_sink sink;
+
+	file_stream(path, sink);
+
+	return sink.crc_get();
 }
 
+/**
+ * Read a whole file only to load it in the system cache.
+ * The data is discarded, and errors are ignored, as the file is read again later.
+ */
+void file_prefetch(const string& path)
+{
+	FILE* f = fopen(path.c_str(), "rb");
+	if (!f)
+		return;
+
+#if HAVE_POSIX_FADVISE
+	posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fileno(f), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+
+	setvbuf(f, 0, _IONBF, 0);
+
+	char* buf = (char*)operator new(FILE_STREAM_BUFFER);
+
+	while (fread(buf, 1, FILE_STREAM_BUFFER, f) == FILE_STREAM_BUFFER) {
+	}
+
+	operator delete(buf);
+	fclose(f);
+}
+
+class file_copy_sink : public file_stream_sink {
+	FILE* f;
+	const string& path;
+public:
+	file_copy_sink(FILE* Af, const string& Apath) : f(Af), path(Apath) { }
+
+	void process(const char* data, unsigned size)
+	{
+		if (fwrite(data, size, 1, f) != 1)
+			throw error() << "Failed write file " << path;
+	}
+};
+
 /**
  * Copy a file.
  */
 void file_copy(const string& path1, const string& path2)
 {
-	unsigned size;
-
-	size = file_size(path1);
+	FILE* f = fopen(path2.c_str(), "wb");
+	if (!f)
+		throw error() << "Failed open for write file " << path2;
 
-	char* data = (char*)operator new(size);
+	file_copy_sink sink(f, path2);
 
 	try {
-		file_read(path1, data, size);
-		file_write(path2, data, size);
+		file_stream(path1, sink);
 	} catch (...) {
-		operator delete(data);
+		fclose(f);
+		remove(path2.c_str());
 		throw;
 	}
 
-	operator delete(data);
+	if (fclose(f) != 0) {
+		remove(path2.c_str());
+		throw error() << "Failed write file " << path2;
+	}
 }
 
 /**
@@ -22,6 +22,7 @@
 #define __FILE_H
 
 #include "except.h"
+#include "crc.h"
 
 #include <string>
 #include <list>
@@ -62,11 +63,6 @@ public:
 
 typedef std::list<infopath> zippath_container;
 
-typedef unsigned crc_t;
-
-crc_t crc_compute(const char* data, unsigned len);
-crc_t crc_compute(crc_t pred, const char* data, unsigned len);
-
 bool file_exists(const std::string& file);
 void file_write(const std::string& path, const char* data, unsigned size);
 void file_read(const std::string& path, char* data, unsigned size);
@@ -75,8 +71,10 @@ time_t file_time(const std::string& path);
 void file_utime(const std::string& path, time_t tod);
 unsigned file_size(const std::string& path);
 crc_t file_crc(const std::string& path);
+void file_prefetch(const std::string& path);
 void file_copy(const std::string& path1, const std::string& path2);
 void file_move(const std::string& path1, const std::string& path2);
+void file_rename(const std::string& path1, const std::string& path2);
 void file_remove(const std::string& path1);
 void file_mktree(const std::string& path1);
 
@@ -0,0 +1,118 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __FLATSET_H
+#define __FLATSET_H
+
+#include <vector>
+#include <utility>
+
+/**
+ * Set stored in a sorted array.
+ * It has the same interface of std::set for the operations used, but the
+ * elements are contiguous in memory. Insert and erase move the following
+ * elements, so it's intended for small sets, or for sets filled in order.
+ * Differently than std::set, erase() invalidates the iterators.
+ */
+template<class T, class Less>
+class flat_set {
+	std::vector<T> data;
+
+	static bool less(const T& A, const T& B) { return Less()(A, B); }
+
+	unsigned search(const T& A) const
+	{
+		unsigned first = 0;
+		unsigned count = data.size();
+		while (count > 0) {
+			unsigned step = count / 2;
+			if (less(data[first + step], A)) {
+				first += step + 1;
+				count -= step + 1;
+			} else {
+				count = step;
+			}
+		}
+		return first;
+	}
+public:
+	typedef T value_type;
+	typedef typename std::vector<T>::const_iterator iterator;
+	typedef typename std::vector<T>::const_iterator const_iterator;
+
+	const_iterator begin() const { return data.begin(); }
+	const_iterator end() const { return data.end(); }
+	unsigned size() const { return data.size(); }
+	bool empty() const { return data.empty(); }
+	void clear() { data.clear(); }
+	void swap(flat_set& A) { data.swap(A.data); }
+
+	const_iterator lower_bound(const T& A) const
+	{
+		return data.begin() + search(A);
+	}
+
+	const_iterator find(const T& A) const
+	{
+		const_iterator i = lower_bound(A);
+		if (i != data.end() && !less(A, *i))
+			return i;
+		return data.end();
+	}
+
+	std::pair<const_iterator, bool> insert(const T& A)
+	{
+		typename std::vector<T>::iterator i = data.begin() + search(A);
+		if (i != data.end() && !less(A, *i))
+			return std::pair<const_iterator, bool>(i, false);
+		i = data.insert(i, A);
+		return std::pair<const_iterator, bool>(i, true);
+	}
+
+	/**
+	 * Insert with a hint.
+	 * Inserting at the end elements already sorted doesn't need to search.
+	 */
+	const_iterator insert(const_iterator hint, const T& A)
+	{
+		if (hint == data.end() && (data.empty() || less(data.back(), A))) {
+			data.push_back(A);
+			return data.end() - 1;
+		}
+		return insert(A).first;
+	}
+
+	void erase(const_iterator i)
+	{
+		data.erase(data.begin() + (i - data.begin()));
+	}
+
+	unsigned erase(const T& A)
+	{
+		const_iterator i = find(A);
+		if (i == data.end())
+			return 0;
+		erase(i);
+		return 1;
+	}
+};
+
+#endif
+
@@ -21,11 +21,21 @@
 #include "portable.h"
 
 #include "game.h"
+#include "stats.h"
+
+#include <vector>
 
 using namespace std;
 
 game::game()
 {
+	name = 0;
+	romof = 0;
+	cloneof = 0;
+	sampleof = 0;
+	description = 0;
+	year = 0;
+	manufacturer = 0;
 	resource = false;
 	working = true;
 	working_subset = false;
@@ -33,8 +43,14 @@ game::game()
 }
 
 game::game(const string& Aname)
-	: name(Aname)
-{
+	: name(intern(Aname))
+{
+	romof = 0;
+	cloneof = 0;
+	sampleof = 0;
+	description = 0;
+	year = 0;
+	manufacturer = 0;
 	resource = false;
 	working = true;
 	working_subset = false;
@@ -221,37 +237,37 @@ void game::working_parent_subset_set(bool Aworking) const
 
 void game::name_set(const string& Aname)
 {
-	name = Aname;
+	name = intern(Aname);
 }
 
 void game::cloneof_set(const string& Acloneof)
 {
-	cloneof = Acloneof;
+	cloneof = intern(Acloneof);
 }
 
 void game::romof_set(const string& Aromof)
 {
-	romof = Aromof;
+	romof = intern(Aromof);
 }
 
 void game::sampleof_set(const string& Asampleof)
 {
-	sampleof = Asampleof;
+	sampleof = intern(Asampleof);
 }
 
 void game::description_set(const string& Adescription)
 {
-	description = Adescription;
+	description = intern(Adescription);
 }
 
 void game::year_set(const string& Ayear)
 {
-	year = Ayear;
+	year = intern(Ayear);
 }
 
 void game::manufacturer_set(const string& Amanufacturer)
 {
-	manufacturer = Amanufacturer;
+	manufacturer = intern(Amanufacturer);
 }
 
 void game::resource_set(bool Aresource)
@@ -267,10 +283,10 @@ void game::rs_remove_name(const rom_by_name_set& A) const {
 	for(rom_by_name_set::const_iterator i=rs_get().begin();i!=rs_get().end();++i) {
 		rom_by_name_set::const_iterator j = A.find(*i);
 		if (j == A.end() || j->crc_get()!=i->crc_get() || j->size_get()!=i->size_get()) {
-			B.insert(*i);
+			B.insert(B.end(), *i);
 		}
 	}
-	rs = B;
+	rs.swap(B);
 }
 
 /**
@@ -281,10 +297,10 @@ void game::rs_remove_crc(const rom_by_crc_set& A) const {
 	for(rom_by_name_set::const_iterator i=rs_get().begin();i!=rs_get().end();++i) {
 		rom_by_crc_set::const_iterator j = A.find(*i);
 		if (j == A.end()) {
-			B.insert(*i);
+			B.insert(B.end(), *i);
 		}
 	}
-	rs = B;
+	rs.swap(B);
 }
 
 /**
@@ -339,72 +355,6 @@ gamearchive::const_iterator gamearchive::find(const game& A) const
 	return map.find(A);
 }
 
-bool gamearchive::is_game_parent(const game& g)
-{
-	const_iterator j = find(g.romof_get());
-	if (j == end())
-		return true;
-	if (j->resource_get())
-		return true;
-	return false;
-}
-
-/**
- * Compute for the subtree the "working" relationship.
- * Assume to have all the "working" flags set to false and
- * to be called only for parents and not for resources or sons.
- */
-bool gamearchive::game_working_subset_compute(const game& g)
-{
-	bool result = false;
-
-	if (g.working_get())
-		result = true;
-
-	for(string_container::const_iterator i=g.rom_son_get().begin();i!=g.rom_son_get().end();++i) {
-		gamearchive::iterator j = find(*i);
-		if (j!=end()) {
-			if (game_working_subset_compute(*j))
-				result = true;
-		}
-	}
-
-	if (result)
-		g.working_subset_set(true);
-
-	return result;
-}
-
-/**
- * Compute for the subtree the "working_parent" relationship.
- * Assume to have all the "working_parent" flags set to false and
- * to be called only for parents and not for resources or sons.
- */
-bool gamearchive::game_working_parent_subset_compute(const game& g)
-{
-	bool result = false;
-
-	if (g.working_get()) {
-		result = true;
-	}
-
-	if (!result) {
-		for(string_container::const_iterator i=g.rom_son_get().begin();i!=g.rom_son_get().end();++i) {
-			gamearchive::iterator j = find(*i);
-			if (j!=end()) {
-				result = game_working_parent_subset_compute(*j);
-				if (result)
-					break;
-			}
-		}
-	}
-
-	if (result)
-		g.working_parent_subset_set(true);
-
-	return result;
-}
-
 string_container gamearchive::find_working_clones(const game& g) const
 {
 	string_container r;
@@ -440,6 +390,41 @@ bool gamearchive::has_working_clone_with_rom(const game& g) const
 	return false;
 }
 
+/**
+ * Missing game index.
+ */
+#define GAME_NONE static_cast<unsigned>(-1)
+
+// State of the roms by crc of a game
+#define GAME_CRC_NONE 0
+#define GAME_CRC_ORIGINAL 1
+#define GAME_CRC_REDUCED 2
+
+/**
+ * Find a game by name in the index sorted by name.
+ * \return The game index, or GAME_NONE if missing.
+ */
+static unsigned game_index_find(const vector<const game*>& index, const string& name)
+{
+	unsigned first = 0;
+	unsigned count = index.size();
+
+	while (count > 0) {
+		unsigned step = count / 2;
+		if (index[first + step]->name_get() < name) {
+			first += step + 1;
+			count -= step + 1;
+		} else {
+			count = step;
+		}
+	}
+
+	if (first < index.size() && index[first]->name_get() == name)
+		return first;
+
+	return GAME_NONE;
+}
+
 void gamearchive::load(istream& f)
 {
 	int c;
@@ -457,112 +442,177 @@ void gamearchive::load(istream& f)
 		load_info(f);
 	}
 
+	reduce();
+}
+
+/**
+ * Remove the merged roms and compute the relationships of the games loaded.
+ */
+void gamearchive::reduce()
+{
+	stats_phase sp(stats_phase_reduce);
+
+	// index of the games in name order
+	vector<const game*> index;
+	for(const_iterator i=begin();i!=end();++i)
+		index.insert(index.end(), &*i);
+
+	unsigned n = index.size();
+
+	// parents by index
+	vector<unsigned> romof(n);
+	vector<unsigned> sampleof(n);
+	for(unsigned i=0;i<n;++i) {
+		romof[i] = game_index_find(index, index[i]->romof_get());
+		sampleof[i] = game_index_find(index, index[i]->sampleof_get());
+	}
+
 	// reduce, eliminate merged rom and sample
-	for(iterator i=begin();i!=end();++i) {
-		// rom/disk
-		string romof = i->romof_get();
-		while (romof.length()) {
-			iterator j = find(game(romof));
-			if (j!=end()) {
+	{
+		// roms by crc of the games used as parent, built only once for
+		// the original game, and once after its reduction
+		vector<rom_by_crc_set> crc(n);
+		vector<unsigned char> crc_state(n, GAME_CRC_NONE);
+
+		for(unsigned i=0;i<n;++i) {
+			const game& g = *index[i];
+
+			// rom/disk
+			unsigned j = romof[i];
+			for(unsigned hop=0;j != GAME_NONE && hop<n;++hop) {
 				// if itself, breaks now
-				if (romof == i->name_get())
+				if (j == i)
 					break;
 
 				// remove merged stuff
-				rom_by_crc_set A;
-				for(rom_by_name_set::const_iterator k=j->rs_get().begin();k!=j->rs_get().end();++k) {
-					A.insert(*k);
+				unsigned char state = j < i ? GAME_CRC_REDUCED : GAME_CRC_ORIGINAL;
+				if (crc_state[j] != state) {
+					rom_by_crc_set A;
+					for(rom_by_name_set::const_iterator k=index[j]->rs_get().begin();k!=index[j]->rs_get().end();++k) {
+						A.insert(*k);
+					}
+					crc[j].swap(A);
+					crc_state[j] = state;
 				}
-				i->rs_remove_crc(A);
+				g.rs_remove_crc(crc[j]);
 
-				disk_by_name_set B;
-				for(disk_by_name_set::const_iterator k=j->ds_get().begin();k!=j->ds_get().end();++k) {
-					B.insert(*k);
-				}
-				i->ds_remove_name(B);
+				g.ds_remove_name(index[j]->ds_get());
 
-				romof = j->romof_get();
-				if (romof == j->name_get())
+				if (romof[j] == j)
 					break;
-			} else
-				break;
-		}
+				j = romof[j];
+			}
 
-		// sample
-		string sampleof = i->sampleof_get();
-		while (sampleof.length()) {
-			iterator j = find(game(sampleof));
-			if (j!=end()) {
+			// sample
+			j = sampleof[i];
+			for(unsigned hop=0;j != GAME_NONE && hop<n;++hop) {
 				// if itself, breaks now
-				if (sampleof == i->name_get())
+				if (j == i)
 					break;
 
 				// remove merged stuff
-				i->ss_remove_name(j->ss_get());
+				g.ss_remove_name(index[j]->ss_get());
 
-				sampleof = j->sampleof_get();
-				if (sampleof == j->name_get())
+				if (sampleof[j] == j)
 					break;
-			} else
-				break;
+				j = sampleof[j];
+			}
 		}
 	}
 
 	// test romof relationship and adjust it
-	for(iterator i=begin();i!=end();++i) {
-		if (i->romof_get().length() != 0) {
-			const_iterator j = find(i->romof_get());
-			if (j == end()) {
-				cerr << "Missing definition of romof '" << i->romof_get() << "' for game '" << i->name_get() << "'." << endl;
-				(const_cast<game*>((&*i)))->romof_set(string());
-			} else if (j->name_get() == i->name_get()) {
-				cerr << "Self definition of romof '" << i->romof_get() << "' for game '" << i->name_get() << "'." << endl;
-				(const_cast<game*>((&*i)))->romof_set(string());
+	for(unsigned i=0;i<n;++i) {
+		game& g = const_cast<game&>(*index[i]);
+		if (g.romof_get().length() != 0) {
+			if (romof[i] == GAME_NONE) {
+				cerr << "Missing definition of romof '" << g.romof_get() << "' for game '" << g.name_get() << "'." << endl;
+				g.romof_set(string());
+				romof[i] = game_index_find(index, string());
+			} else if (romof[i] == i) {
+				cerr << "Self definition of romof '" << g.romof_get() << "' for game '" << g.name_get() << "'." << endl;
+				g.romof_set(string());
+				romof[i] = game_index_find(index, string());
 			}
 		}
 	}
 
 	// test sampleof relationship and adjust it
-	for(iterator i=begin();i!=end();++i) {
-		if (i->sampleof_get().length() != 0) {
-			const_iterator j = find(i->sampleof_get());
-			if (j == end()) {
+	for(unsigned i=0;i<n;++i) {
+		game& g = const_cast<game&>(*index[i]);
+		if (g.sampleof_get().length() != 0) {
+			if (sampleof[i] == GAME_NONE || sampleof[i] == i) {
 #if 0 // recent MAME have many pf them, like "genpin", but also others
-				cerr << "Missing definition of sampleof '" << i->sampleof_get() << "' for game '" << i->name_get() << "'." << endl;
-#endif
-				(const_cast<game*>((&*i)))->sampleof_set(string());
-			} else if (j->name_get() == i->name_get()) {
-#if 0 // they are normal
-				cerr << "Self definition of romof '" << i->sampleof_get() << "' for game '" << i->name_get() << "'." << endl;
+				cerr << "Missing definition of sampleof '" << g.sampleof_get() << "' for game '" << g.name_get() << "'." << endl;
 #endif
-				(const_cast<game*>((&*i)))->sampleof_set(string());
+				g.sampleof_set(string());
 			}
 		}
 	}
 
-	// compute the rom_son container
-	for(iterator i=begin();i!=end();++i) {
-		iterator j = find(game(i->romof_get()));
-		if (j!=end()) {
-			j->rom_son_get().insert(j->rom_son_get().end(), i->name_get());
+	// compute the rom_son container, and the sons by index
+	vector<vector<unsigned> > son(n);
+	for(unsigned i=0;i<n;++i) {
+		unsigned j = romof[i];
+		if (j != GAME_NONE) {
+			index[j]->rom_son_get().insert(index[j]->rom_son_get().end(), index[i]->name_get());
+			son[j].insert(son[j].end(), i);
 		}
 	}
 
+	// visit the games from the parents, that have a missing or resource romof,
+	// with the sons after their parent
+	vector<unsigned> order;
+	for(unsigned i=0;i<n;++i) {
+		if (!index[i]->resource_get() && (romof[i] == GAME_NONE || index[romof[i]]->resource_get()))
+			order.insert(order.end(), i);
+	}
+	for(unsigned k=0;k<order.size();++k) {
+		for(unsigned h=0;h<son[order[k]].size();++h)
+			order.insert(order.end(), son[order[k]][h]);
+	}
+
+	// if the game, or any game in its subtree, is working
+	vector<bool> subset(n, false);
+	for(unsigned k=order.size();k>0;--k) {
+		unsigned i = order[k-1];
+		bool result = index[i]->working_get();
+		for(unsigned h=0;!result && h<son[i].size();++h)
+			result = subset[son[i][h]];
+		subset[i] = result;
+	}
+
 	// compute the working subset info
-	for(iterator i=begin();i!=end();++i) {
-		if (i->resource_get()) {
-			i->working_subset_set(true);
-		} else if (is_game_parent(*i)) {
-			game_working_subset_compute(*i);
-		}
+	for(unsigned i=0;i<n;++i) {
+		if (index[i]->resource_get())
+			index[i]->working_subset_set(true);
+	}
+	for(unsigned k=0;k<order.size();++k) {
+		if (subset[order[k]])
+			index[order[k]]->working_subset_set(true);
 	}
 
 	// compute the working parent subset info
-	for(iterator i=begin();i!=end();++i) {
-		if (i->resource_get()) {
-			i->working_parent_subset_set(true);
-		} else if (is_game_parent(*i)) {
-			game_working_parent_subset_compute(*i);
+	// the subtree is visited until the first working game, like
+	// the working parent relationship requires
+	vector<bool> visit(n, false);
+	for(unsigned i=0;i<n;++i) {
+		if (index[i]->resource_get())
+			index[i]->working_parent_subset_set(true);
+	}
+	for(unsigned k=0;k<order.size();++k) {
+		unsigned i = order[k];
+		bool root = !index[i]->resource_get() && (romof[i] == GAME_NONE || index[romof[i]]->resource_get());
+		if (!root && !visit[i])
+			continue;
+		if (subset[i])
+			index[i]->working_parent_subset_set(true);
+		if (!index[i]->working_get()) {
+			// visit the sons until the first one with a working subtree
+			for(unsigned h=0;h<son[i].size();++h) {
+				visit[son[i][h]] = true;
+				if (subset[son[i][h]])
+					break;
+			}
 		}
 	}
 }
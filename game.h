@@ -28,6 +28,7 @@
 #include <list>
 
 class game;
+struct info_context;
 
 typedef std::list<std::string> string_container;
 
@@ -40,14 +41,14 @@ class game {
 	mutable zippath_container szs; // set of sample zip for the game
 	mutable zippath_container dzs; // set of disk chd for the game
 
-	// game information
-	std::string name;
-	std::string romof;
-	std::string cloneof;
-	std::string sampleof;
-	std::string description;
-	std::string year;
-	std::string manufacturer;
+	// game information, as identifiers of the string pool
+	intern_t name;
+	intern_t romof;
+	intern_t cloneof;
+	intern_t sampleof;
+	intern_t description;
+	intern_t year;
+	intern_t manufacturer;
 	bool resource;
 
 	mutable bool working;
@@ -70,13 +71,13 @@ public:
 	void manufacturer_set(const std::string& Amanufacturer);
 	void resource_set(bool Aresource);
 
-	const std::string& name_get() const { return name; }
-	const std::string& cloneof_get() const { return cloneof; }
-	const std::string& romof_get() const { return romof; }
-	const std::string& sampleof_get() const { return sampleof; }
-	const std::string& description_get() const { return description; }
-	const std::string& year_get() const { return year; }
-	const std::string& manufacturer_get() const { return manufacturer; }
+	const std::string& name_get() const { return intern_get(name); }
+	const std::string& cloneof_get() const { return intern_get(cloneof); }
+	const std::string& romof_get() const { return intern_get(romof); }
+	const std::string& sampleof_get() const { return intern_get(sampleof); }
+	const std::string& description_get() const { return intern_get(description); }
+	const std::string& year_get() const { return intern_get(year); }
+	const std::string& manufacturer_get() const { return intern_get(manufacturer); }
 	bool resource_get() const { return resource; }
 
 	void working_set(bool Aworking) const;
@@ -156,13 +157,15 @@ class gamearchive {
 	gamearchive(const gamearchive&);
 	gamearchive& operator=(const gamearchive&);
 
-	bool load_info_internal();
+	bool load_info_internal(struct info_context* context);
 	void load_info(std::istream& f);
+	void load_info(const char* data, unsigned size);
 	void load_xml(std::istream& f);
+	void load_xml(const std::string& data);
+	bool load_snapshot(const std::string& path, const std::string& key);
+	void save_snapshot(const std::string& path, const std::string& key) const;
+	void reduce();
 
-	bool is_game_parent(const game& g);
-	bool game_working_subset_compute(const game& g);
-	bool game_working_parent_subset_compute(const game& g);
 
 public:
 	gamearchive();
@@ -181,6 +184,7 @@ public:
 	bool has_working_clone_with_rom(const game& A) const;
 
 	void load(std::istream& f);
+	void load(std::istream& f, const std::string& snapshot);
 	void filter(filter_proc* p);
 };
 
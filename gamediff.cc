@@ -99,58 +99,58 @@ std::ostream& operator<<(std::ostream &os, const game& A)
 	return os;
 }
 
-bool game_set_load::load(bool remove_merge)
+bool game_set_load::load(struct info_context* context, bool remove_merge)
 {
-	info_t token = info_token_get();
+	info_t token = info_context_token_get(context);
 	while (token!=info_eof) {
 		if (token != info_symbol) return false;
-		if (strcmp(info_text_get(), "game")==0) {
-			if (info_token_get() != info_open) return false;
+		if (info_context_text_is(context, "game")) {
+			if (info_context_token_get(context) != info_open) return false;
 			game g;
-			token = info_token_get();
+			token = info_context_token_get(context);
 			while (token != info_close) {
 				if (token != info_symbol)
 					return false;
-				if (strcmp(info_text_get(), "name")==0) {
-					if (info_token_get() != info_symbol) return false;
-					g.name_set(info_text_get());
-				} else if (strcmp(info_text_get(), "rom")==0) {
-					if (info_token_get() != info_open) return false;
-					token = info_token_get();
+				if (info_context_text_is(context, "name")) {
+					if (info_context_token_get(context) != info_symbol) return false;
+					g.name_set(info_context_text_get(context));
+				} else if (info_context_text_is(context, "rom")) {
+					if (info_context_token_get(context) != info_open) return false;
+					token = info_context_token_get(context);
 					rom r;
 					bool merge = false;
 					while (token != info_close) {
 						if (token != info_symbol) return false;
-						if (strcmp(info_text_get(), "size")==0) {
-							if (info_token_get() != info_symbol) return false;
-							r.size_set(atoi(info_text_get()));
-						} else if (strcmp(info_text_get(), "crc")==0 || strcmp(info_text_get(), "crc32")==0) {
-							if (info_token_get() != info_symbol) return false;
-							r.crc_set(strtoul(info_text_get(), 0, 16));
-						} else if (strcmp(info_text_get(), "name")==0) {
-							if (info_token_get() != info_symbol) return false;
-							r.name_set(info_text_get());
-						} else if (strcmp(info_text_get(), "merge")==0) {
-							if (info_token_get() != info_symbol) return false;
+						if (info_context_text_is(context, "size")) {
+							if (info_context_token_get(context) != info_symbol) return false;
+							r.size_set(atoi(info_context_text_get(context)));
+						} else if (info_context_text_is(context, "crc") || info_context_text_is(context, "crc32")) {
+							if (info_context_token_get(context) != info_symbol) return false;
+							r.crc_set(strtoul(info_context_text_get(context), 0, 16));
+						} else if (info_context_text_is(context, "name")) {
+							if (info_context_token_get(context) != info_symbol) return false;
+							r.name_set(info_context_text_get(context));
+						} else if (info_context_text_is(context, "merge")) {
+							if (info_context_token_get(context) != info_symbol) return false;
 							merge = true;
 						} else {
-							if (info_skip_value() == info_error) return false;
+							if (info_context_skip_value(context) == info_error) return false;
 						}
-						token = info_token_get();
+						token = info_context_token_get(context);
 					}
 					if (!(remove_merge && merge))
 						g.roms_get().insert(r);
 				} else {
-					if (info_skip_value() == info_error) return false;
+					if (info_context_skip_value(context) == info_error) return false;
 				}
-				token = info_token_get();
+				token = info_context_token_get(context);
 			}
 			insert(g);
 		} else {
-			if (info_skip_value() == info_error)
+			if (info_context_skip_value(context) == info_error)
 				return false;
 		}
-		token = info_token_get();
+		token = info_context_token_get(context);
 	}
 
 	return true;
@@ -26,6 +26,8 @@
 #include <vector>
 #include <string>
 
+struct info_context;
+
 class rom {
 	std::string name;
 	unsigned size;
@@ -77,7 +79,7 @@ public:
 	typedef game_set::const_iterator const_iterator;
 	typedef game_set::iterator iterator;
 
-	bool load(bool remove_merge);
+	bool load(struct info_context* context, bool remove_merge);
 };
 
 #endif
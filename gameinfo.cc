@@ -26,117 +26,113 @@
 
 using namespace std;
 
-extern "C" int info_ext_get(void* _arg)
-{
-	istream* arg = static_cast<istream*>(_arg);
-	return arg->get();
-}
-
-extern "C" void info_ext_unget(void* _arg, char c)
+/**
+ * Get the text of the last token as a string.
+ */
+static inline string info_context_string(const struct info_context* context)
 {
-	istream* arg = static_cast<istream*>(_arg);
-	arg->putback(c);
+	return string(info_context_text_ptr(context), info_context_text_len(context));
 }
 
-bool gamearchive::load_info_internal()
+bool gamearchive::load_info_internal(struct info_context* context)
 {
-	info_t token = info_token_get();
+	info_t token = info_context_token_get(context);
 	while (token!=info_eof) {
 		if (token != info_symbol) return false;
-		if (strcmp(info_text_get(), "game")==0 || strcmp(info_text_get(), "resource")==0 || strcmp(info_text_get(), "machine")==0) {
+		if (info_context_text_is(context, "game") || info_context_text_is(context, "resource") || info_context_text_is(context, "machine")) {
 			game g;
-			g.resource_set(strcmp(info_text_get(), "resource")==0);
-			if (info_token_get() != info_open) return false;
-			token = info_token_get();
+			g.resource_set(info_context_text_is(context, "resource"));
+			if (info_context_token_get(context) != info_open) return false;
+			token = info_context_token_get(context);
 			while (token != info_close) {
 				if (token != info_symbol)
 					return false;
-				if (strcmp(info_text_get(), "name")==0) {
-					if (info_token_get() != info_symbol) return false;
-					g.name_set(info_text_get());
-				} else if (strcmp(info_text_get(), "description")==0) {
-					if (info_token_get() != info_string) return false;
-					g.description_set(info_text_get());
-				} else if (strcmp(info_text_get(), "manufacturer")==0) {
-					if (info_token_get() != info_string) return false;
-					g.manufacturer_set(info_text_get());
-				} else if (strcmp(info_text_get(), "year")==0) {
-					if (info_token_get() != info_symbol) return false;
-					g.year_set(info_text_get());
-				} else if (strcmp(info_text_get(), "cloneof")==0) {
-					if (info_token_get() != info_symbol) return false;
-					g.cloneof_set(info_text_get());
-				} else if (strcmp(info_text_get(), "romof")==0) {
-					if (info_token_get() != info_symbol) return false;
-					g.romof_set(info_text_get());
-				} else if (strcmp(info_text_get(), "sampleof")==0) {
-					if (info_token_get() != info_symbol) return false;
-					g.sampleof_set(info_text_get());
-				} else if (strcmp(info_text_get(), "rom")==0) {
-					if (info_token_get() != info_open)  return false;
+				if (info_context_text_is(context, "name")) {
+					if (info_context_token_get(context) != info_symbol) return false;
+					g.name_set(info_context_string(context));
+				} else if (info_context_text_is(context, "description")) {
+					if (info_context_token_get(context) != info_string) return false;
+					g.description_set(info_context_string(context));
+				} else if (info_context_text_is(context, "manufacturer")) {
+					if (info_context_token_get(context) != info_string) return false;
+					g.manufacturer_set(info_context_string(context));
+				} else if (info_context_text_is(context, "year")) {
+					if (info_context_token_get(context) != info_symbol) return false;
+					g.year_set(info_context_string(context));
+				} else if (info_context_text_is(context, "cloneof")) {
+					if (info_context_token_get(context) != info_symbol) return false;
+					g.cloneof_set(info_context_string(context));
+				} else if (info_context_text_is(context, "romof")) {
+					if (info_context_token_get(context) != info_symbol) return false;
+					g.romof_set(info_context_string(context));
+				} else if (info_context_text_is(context, "sampleof")) {
+					if (info_context_token_get(context) != info_symbol) return false;
+					g.sampleof_set(info_context_string(context));
+				} else if (info_context_text_is(context, "rom")) {
+					if (info_context_token_get(context) != info_open)  return false;
 					rom r;
-					token = info_token_get();
+					token = info_context_token_get(context);
 					while (token != info_close) {
 						if (token != info_symbol) return false;
-						if (strcmp(info_text_get(), "name")==0) {
-							if (info_token_get() != info_symbol) return false;
-							r.name_set(info_text_get());
-						} else if (strcmp(info_text_get(), "size")==0) {
+						if (info_context_text_is(context, "name")) {
+							if (info_context_token_get(context) != info_symbol) return false;
+							r.name_set(info_context_string(context));
+						} else if (info_context_text_is(context, "size")) {
 							const char* e;
-							if (info_token_get() != info_symbol) return false;
-							unsigned v = strdec(info_text_get(), &e);
+							if (info_context_token_get(context) != info_symbol) return false;
+							unsigned v = strdec(info_context_text_get(context), &e);
 							if (*e != 0)
 								return false;
 							r.size_set(v);
-						} else if (strcmp(info_text_get(), "crc")==0) {
+						} else if (info_context_text_is(context, "crc")) {
 							const char* e;
 							const char* n;
-							if (info_token_get() != info_symbol) return false;
-							n = info_text_get();
+							if (info_context_token_get(context) != info_symbol) return false;
+							n = info_context_text_get(context);
 							if (n[0] == '0' && n[1] == 'x')
 								n += 2;
 							unsigned v = strhex(n, &e);
 							if (*e != 0)
 								return false;
 							r.crc_set(v);
-						} else if (strcmp(info_text_get(), "flags")==0) {
-							if (info_token_get() != info_symbol) return false;
-							if (strcmp(info_text_get(), "nodump")==0)
+						} else if (info_context_text_is(context, "flags")) {
+							if (info_context_token_get(context) != info_symbol) return false;
+							if (info_context_text_is(context, "nodump"))
 								r.nodump_set(true);
 						} else {
-							if (info_skip_value() == info_error) return false;
+							if (info_context_skip_value(context) == info_error) return false;
 						}
-						token = info_token_get();
+						token = info_context_token_get(context);
 					}
 					g.rs_get().insert(r);
-				} else if (strcmp(info_text_get(), "driver")==0) {
-					if (info_token_get() != info_open)  return false;
-					token = info_token_get();
+				} else if (info_context_text_is(context, "driver")) {
+					if (info_context_token_get(context) != info_open)  return false;
+					token = info_context_token_get(context);
 					while (token != info_close) {
 						if (token != info_symbol) return false;
-						if (strcmp(info_text_get(), "status")==0) {
-							if (info_token_get() != info_symbol) return false;
-							if (strcmp(info_text_get(), "preliminary") == 0)
+						if (info_context_text_is(context, "status")) {
+							if (info_context_token_get(context) != info_symbol) return false;
+							if (info_context_text_is(context, "preliminary"))
 								g.working_set(false);
 						} else {
-							if (info_skip_value() == info_error) return false;
+							if (info_context_skip_value(context) == info_error) return false;
 						}
-						token = info_token_get();
+						token = info_context_token_get(context);
 					}
-				} else if (strcmp(info_text_get(), "sample")==0) {
-					if (info_token_get() != info_symbol) return false;
-					sample s(info_text_get());
+				} else if (info_context_text_is(context, "sample")) {
+					if (info_context_token_get(context) != info_symbol) return false;
+					sample s(info_context_string(context));
 					g.ss_get().insert(s);
 				} else {
-					if (info_skip_value() == info_error) return false;
+					if (info_context_skip_value(context) == info_error) return false;
 				}
-				token = info_token_get();
+				token = info_context_token_get(context);
 			}
 			map.insert(g);
 		} else {
-			if (info_skip_value() == info_error) return false;
+			if (info_context_skip_value(context) == info_error) return false;
 		}
-		token = info_token_get();
+		token = info_context_token_get(context);
 	}
 
 	return true;
@@ -144,17 +140,35 @@ bool gamearchive::load_info_internal()
 
 void gamearchive::load_info(istream& f)
 {
-	info_init(info_ext_get, info_ext_unget, &f);
+	// read all the file in memory, the tokens point directly into it
+	string data;
+	char buf[16384];
+	while (f.read(buf, sizeof(buf)) || f.gcount() > 0)
+		data.append(buf, f.gcount());
+	if (f.bad())
+		throw error() << "Failed read of the information file";
 
-	bool r = load_info_internal();
+	load_info(data.data(), data.length());
+}
+
+/**
+ * Load the games from an information file already in memory.
+ * The data must remain valid until the end of the load.
+ */
+void gamearchive::load_info(const char* data, unsigned size)
+{
+	struct info_context context;
+
+	info_context_init(&context, data, size);
+
+	bool r = load_info_internal(&context);
 
 	if (!r) {
-		unsigned row = info_row_get()+1;
-		unsigned col = info_col_get()+1;
-		info_done();
+		unsigned row = info_context_row_get(&context)+1;
+		unsigned col = info_context_col_get(&context)+1;
+		info_context_done(&context);
 		throw error() << "Invalid data at row " << row << " at column " << col << ".";
 	}
 
-	info_done();
+	info_context_done(&context);
 }
-
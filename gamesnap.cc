@@ -0,0 +1,361 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "portable.h"
+
+#include "game.h"
+#include "data.h"
+#include "lib/endianrw.h"
+
+#include <zlib.h>
+
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+
+using namespace std;
+
+/**
+ * Signature and version of the snapshot file.
+ * Any change of the format, or of the processing done by
+ * gamearchive::load(), requires a different version.
+ */
+#define SNAPSHOT_MAGIC "AdvanceSCAN dat snapshot 1\n"
+#define SNAPSHOT_MAGIC_SIZE (sizeof(SNAPSHOT_MAGIC) - 1)
+
+// Flags of the game
+#define SNAPSHOT_FLAG_RESOURCE 0x1
+#define SNAPSHOT_FLAG_WORKING 0x2
+#define SNAPSHOT_FLAG_WORKING_SUBSET 0x4
+#define SNAPSHOT_FLAG_WORKING_PARENT_SUBSET 0x8
+
+/**
+ * Writer of the snapshot.
+ */
+class snapshot_writer {
+	string data;
+public:
+	void u8(unsigned v)
+	{
+		data += static_cast<char>(v);
+	}
+
+	void u32(unsigned v)
+	{
+		unsigned char buf[4];
+		le_uint32_write(buf, v);
+		data.append(reinterpret_cast<const char*>(buf), 4);
+	}
+
+	void str(const string& s)
+	{
+		u32(s.length());
+		data += s;
+	}
+
+	void raw(const unsigned char* p, unsigned size)
+	{
+		data.append(reinterpret_cast<const char*>(p), size);
+	}
+
+	const string& data_get() const { return data; }
+};
+
+/**
+ * Reader of the snapshot, with bound checks.
+ */
+class snapshot_reader {
+	const unsigned char* p;
+	const unsigned char* end;
+
+	void need(unsigned size)
+	{
+		if (static_cast<unsigned>(end - p) < size)
+			throw error_invalid() << "Truncated snapshot";
+	}
+public:
+	snapshot_reader(const unsigned char* data, unsigned size) : p(data), end(data + size) { }
+
+	unsigned u8()
+	{
+		need(1);
+		return *p++;
+	}
+
+	unsigned u32()
+	{
+		need(4);
+		unsigned v = le_uint32_read(p);
+		p += 4;
+		return v;
+	}
+
+	string str()
+	{
+		unsigned size = u32();
+		need(size);
+		string s(reinterpret_cast<const char*>(p), size);
+		p += size;
+		return s;
+	}
+
+	const unsigned char* raw(unsigned size)
+	{
+		need(size);
+		const unsigned char* r = p;
+		p += size;
+		return r;
+	}
+
+	bool is_end() const { return p == end; }
+};
+
+/**
+ * Compute the key of the information file.
+ * It's used to detect if the snapshot is still valid.
+ */
+static string snapshot_key(const string& data)
+{
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data());
+
+	crc_t crc = crc_compute(data.data(), data.length());
+	unsigned adler = adler32(adler32(0, 0, 0), p, data.length());
+
+	ostringstream os;
+	os << hex << setfill('0') << setw(8) << crc << setw(8) << adler << dec << ":" << data.length();
+
+	return os.str();
+}
+
+/**
+ * Load the games from a snapshot.
+ * \return If the snapshot was loaded. If not, the archive is empty.
+ */
+bool gamearchive::load_snapshot(const string& path, const string& key)
+{
+	if (access(path.c_str(), F_OK) != 0)
+		return false;
+
+	unsigned size;
+	unsigned char* buf;
+	try {
+		size = file_size(path);
+		buf = data_alloc(size);
+		try {
+			file_read(path, reinterpret_cast<char*>(buf), size);
+		} catch (...) {
+			data_free(buf);
+			throw;
+		}
+	} catch (error& e) {
+		cerr << "warning: " << e << "\n";
+		cerr << "warning: ignoring the snapshot " << path << "\n";
+		return false;
+	}
+
+	try {
+		// check the magic and the crc of all the content
+		if (size < SNAPSHOT_MAGIC_SIZE + 4 || memcmp(buf, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0)
+			throw error_invalid() << "Invalid snapshot signature";
+		if (crc_compute(reinterpret_cast<const char*>(buf), size - 4) != le_uint32_read(buf + size - 4))
+			throw error_invalid() << "Invalid snapshot crc";
+
+		snapshot_reader r(buf + SNAPSHOT_MAGIC_SIZE, size - SNAPSHOT_MAGIC_SIZE - 4);
+
+		if (r.str() != key) {
+			// not damaged, only made from a different information file
+			data_free(buf);
+			return false;
+		}
+
+		unsigned count = r.u32();
+		for(unsigned n=0;n<count;++n) {
+			// the games are saved in order, insert them at the end
+			iterator i = map.insert(map.end(), game(r.str()));
+			game& g = const_cast<game&>(*i);
+
+			g.romof_set(r.str());
+			g.cloneof_set(r.str());
+			g.sampleof_set(r.str());
+			g.description_set(r.str());
+			g.year_set(r.str());
+			g.manufacturer_set(r.str());
+
+			unsigned flag = r.u8();
+			g.resource_set((flag & SNAPSHOT_FLAG_RESOURCE) != 0);
+			g.working_set((flag & SNAPSHOT_FLAG_WORKING) != 0);
+			g.working_subset_set((flag & SNAPSHOT_FLAG_WORKING_SUBSET) != 0);
+			g.working_parent_subset_set((flag & SNAPSHOT_FLAG_WORKING_PARENT_SUBSET) != 0);
+
+			unsigned rs_count = r.u32();
+			for(unsigned k=0;k<rs_count;++k) {
+				string name = r.str();
+				unsigned rom_size = r.u32();
+				crc_t rom_crc = r.u32();
+				bool nodump = r.u8() != 0;
+				g.rs_get().insert(g.rs_get().end(), rom(name, rom_size, rom_crc, nodump));
+			}
+
+			unsigned ss_count = r.u32();
+			for(unsigned k=0;k<ss_count;++k) {
+				g.ss_get().insert(g.ss_get().end(), sample(r.str()));
+			}
+
+			unsigned ds_count = r.u32();
+			for(unsigned k=0;k<ds_count;++k) {
+				disk d(r.str());
+				d.sha1_set(sha1(r.raw(SHA1_SIZE)));
+				g.ds_get().insert(g.ds_get().end(), d);
+			}
+
+			unsigned son_count = r.u32();
+			for(unsigned k=0;k<son_count;++k) {
+				g.rom_son_get().insert(g.rom_son_get().end(), r.str());
+			}
+		}
+
+		if (!r.is_end() || map.size() != count)
+			throw error_invalid() << "Invalid snapshot content";
+	} catch (error& e) {
+		map.clear();
+		data_free(buf);
+		cerr << "warning: damaged snapshot " << path << "\n";
+		cerr << "warning: " << e << "\n";
+		cerr << "warning: ignoring it and resuming\n";
+		return false;
+	}
+
+	data_free(buf);
+
+	return true;
+}
+
+/**
+ * Save the games in a snapshot.
+ * Errors are only reported, as the snapshot is not required.
+ */
+void gamearchive::save_snapshot(const string& path, const string& key) const
+{
+	snapshot_writer w;
+
+	w.raw(reinterpret_cast<const unsigned char*>(SNAPSHOT_MAGIC), SNAPSHOT_MAGIC_SIZE);
+	w.str(key);
+
+	w.u32(map.size());
+	for(const_iterator i=begin();i!=end();++i) {
+		w.str(i->name_get());
+		w.str(i->romof_get());
+		w.str(i->cloneof_get());
+		w.str(i->sampleof_get());
+		w.str(i->description_get());
+		w.str(i->year_get());
+		w.str(i->manufacturer_get());
+
+		unsigned flag = 0;
+		if (i->resource_get())
+			flag |= SNAPSHOT_FLAG_RESOURCE;
+		if (i->working_get())
+			flag |= SNAPSHOT_FLAG_WORKING;
+		if (i->working_subset_get())
+			flag |= SNAPSHOT_FLAG_WORKING_SUBSET;
+		if (i->working_parent_subset_get())
+			flag |= SNAPSHOT_FLAG_WORKING_PARENT_SUBSET;
+		w.u8(flag);
+
+		w.u32(i->rs_get().size());
+		for(rom_by_name_set::const_iterator j=i->rs_get().begin();j!=i->rs_get().end();++j) {
+			w.str(j->name_get());
+			w.u32(j->size_get());
+			w.u32(j->crc_get());
+			w.u8(j->nodump_get());
+		}
+
+		w.u32(i->ss_get().size());
+		for(sample_by_name_set::const_iterator j=i->ss_get().begin();j!=i->ss_get().end();++j) {
+			w.str(j->name_get());
+		}
+
+		w.u32(i->ds_get().size());
+		for(disk_by_name_set::const_iterator j=i->ds_get().begin();j!=i->ds_get().end();++j) {
+			w.str(j->name_get());
+			w.raw(j->sha1_get().data_get(), SHA1_SIZE);
+		}
+
+		w.u32(i->rom_son_get().size());
+		for(string_container::const_iterator j=i->rom_son_get().begin();j!=i->rom_son_get().end();++j) {
+			w.str(*j);
+		}
+	}
+
+	w.u32(crc_compute(w.data_get().data(), w.data_get().length()));
+
+	string save_path = file_temp(path);
+
+	try {
+		file_write(save_path, w.data_get().data(), w.data_get().length());
+
+		// delete the file if exists
+		if (access(path.c_str(), F_OK) == 0)
+			file_remove(path);
+
+		file_rename(save_path, path);
+	} catch (error& e) {
+		remove(save_path.c_str());
+		cerr << "warning: " << e << "\n";
+		cerr << "warning: failed write of the snapshot " << path << "\n";
+	}
+}
+
+/**
+ * Load the games using a snapshot.
+ * If the snapshot was made from the same information file, it's used
+ * instead of parsing the file. Otherwise the snapshot is written again.
+ * \param f Information file.
+ * \param path File of the snapshot.
+ */
+void gamearchive::load(istream& f, const string& path)
+{
+	// read all the information file, to compute its key
+	string data;
+	char buf[16384];
+	while (f.read(buf, sizeof(buf)) || f.gcount() > 0)
+		data.append(buf, f.gcount());
+	if (f.bad())
+		throw error() << "Failed read of the information file";
+
+	string key = snapshot_key(data);
+
+	if (load_snapshot(path, key))
+		return;
+
+	// parse the data already read, without copying it again
+	string::size_type pos = data.find_first_not_of(" \t\n\v\f\r");
+	if (pos != string::npos && data[pos] == '<') {
+		load_xml(data);
+	} else {
+		load_info(data.data(), data.length());
+	}
+
+	reduce();
+
+	save_snapshot(path, key);
+}
+
@@ -22,9 +22,11 @@
 
 #include "game.h"
 #include "strcov.h"
+#include "thread.h"
 #include "expat/expat.h"
 
 #include <string>
+#include <vector>
 #include <iostream>
 
 using namespace std;
@@ -34,6 +36,16 @@ using namespace std;
  */
 #define DEPTH_MAX 5
 
+/**
+ * Size of the buffer read at every parsing step.
+ */
+#define XML_BUFFER_SIZE (1024*1024)
+
+/**
+ * Min size of the chunks parsed in parallel.
+ */
+#define XML_CHUNK_MIN (1024*1024)
+
 enum token_t {
 	token_open,
 	token_close,
@@ -60,6 +72,7 @@ struct level_t {
 struct state_t {
 	XML_Parser parser; /**< Parser. */
 	int depth; /**< Current depth. */
+	int skip_depth; /**< Depth of the element skipped, or -1. */
 	struct level_t level[DEPTH_MAX]; /**< Level state. */
 	int error; /**< Error flag. */
 	string error_desc;
@@ -381,46 +394,113 @@ static struct conversion_t CONV3[] = {
 	{ 0, { 0, 0, 0, 0, 0 }, 0 }
 };
 
+/**
+ * Check if a conversion matches the elements up to the specified depth.
+ */
+static bool match(const struct conversion_t* conv, unsigned depth, const struct level_t* level)
+{
+	// check all the item, backward
+	for(int j=depth;j>=0;--j) {
+		if (conv->name[j] == match_mamemessraine) {
+			if (strcmp(level[j].tag, "mame") != 0 && strcmp(level[j].tag, "mess") != 0 && strcmp(level[j].tag, "raine") != 0)
+				return false;
+		} else if (conv->name[j] == match_gamemachine) {
+			if (strcmp(level[j].tag, "game") != 0 && strcmp(level[j].tag, "machine") != 0)
+				return false;
+		} else {
+			if (strcmp(level[j].tag, conv->name[j]) != 0)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static struct conversion_t* conversion(unsigned depth)
+{
+	switch (depth) {
+	case 1 : return CONV1;
+	case 2 : return CONV2;
+	case 3 : return CONV3;
+	}
+
+	return 0;
+}
+
 /**
  * Identify the specified element/attribute.
  */
 static struct conversion_t* identify(unsigned depth, const struct level_t* level)
 {
-	struct conversion_t* conv;
+	struct conversion_t* conv = conversion(depth);
 
-	switch (depth) {
-	case 1 : conv = CONV1; break;
-	case 2 : conv = CONV2; break;
-	case 3 : conv = CONV3; break;
-	default:
+	if (!conv)
 		return 0;
-	}
 
 	for(unsigned i=0;conv[i].name[0];++i) {
-		bool equal = true;
-
-		// check all the item, backward
-		for(int j=depth;equal && j>=0;--j) {
-			if (conv[i].name[j] == match_mamemessraine) {
-				if (strcmp(level[j].tag, "mame") != 0 && strcmp(level[j].tag, "mess") != 0 && strcmp(level[j].tag, "raine") != 0)
-					equal = false;
-			} else if (conv[i].name[j] == match_gamemachine) {
-				if (strcmp(level[j].tag, "game") != 0 && strcmp(level[j].tag, "machine") != 0)
-					equal = false;
-			} else {
-				if (strcmp(level[j].tag, conv[i].name[j]) != 0)
-					equal = false;
-			}
-		}
-
-		// if match return
-		if (equal)
+		if (match(&conv[i], depth, level))
 			return &conv[i];
 	}
 
 	return 0;
 }
 
+/**
+ * Check if some element/attribute inside the specified element may be processed.
+ * If not, all the subtree can be skipped.
+ */
+static bool is_inside_processed(unsigned depth, const struct level_t* level)
+{
+	// the root element is always parsed, it may not have a conversion
+	if (depth == 0)
+		return true;
+
+	for(unsigned d=depth+1;d<DEPTH_MAX;++d) {
+		struct conversion_t* conv = conversion(d);
+
+		if (!conv)
+			break;
+
+		for(unsigned i=0;conv[i].name[0];++i) {
+			if (match(&conv[i], depth, level))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static void start_handler(void* data, const XML_Char* name, const XML_Char** attributes);
+static void end_handler(void* data, const XML_Char* name);
+static void data_handler(void* data, const XML_Char* s, int len);
+
+/**
+ * Start Handler for the Expat parser, used inside a skipped element.
+ */
+static void skip_start_handler(void* data, const XML_Char* name, const XML_Char** attributes)
+{
+	struct state_t* state = (struct state_t*)data;
+
+	++state->depth;
+}
+
+/**
+ * End Handler for the Expat parser, used inside a skipped element.
+ */
+static void skip_end_handler(void* data, const XML_Char* name)
+{
+	struct state_t* state = (struct state_t*)data;
+
+	// at the end of the skipped element restore the normal processing
+	if (state->depth == state->skip_depth) {
+		state->skip_depth = -1;
+		XML_SetElementHandler(state->parser, start_handler, end_handler);
+		XML_SetCharacterDataHandler(state->parser, data_handler);
+	}
+
+	--state->depth;
+}
+
 /**
  * End Handler for the Expat parser.
  */
@@ -448,12 +528,13 @@ static void end_handler(void* data, const XML_Char* name)
 /**
  * Data Handler for the Expat parser.
  */
-void data_handler(void* data, const XML_Char* s, int len)
+static void data_handler(void* data, const XML_Char* s, int len)
 {
 	struct state_t* state = (struct state_t*)data;
 
 	if (state->depth < DEPTH_MAX) {
-		if (state->error == 0) {
+		// the data is used only by the processed elements
+		if (state->error == 0 && state->level[state->depth].process) {
 			/* accumulate the data */
 			unsigned new_len = state->level[state->depth].len + len;
 			state->level[state->depth].data = (char*)realloc(state->level[state->depth].data, new_len);
@@ -468,11 +549,11 @@ void data_handler(void* data, const XML_Char* s, int len)
 }
 
 /**
- * Start Handler for the Expat parser.
+ * Start of an element or attribute.
+ * \param skip If the element can be skipped with all its subtree.
  */
-static void start_handler(void* data, const XML_Char* name, const XML_Char** attributes)
+static void start_element(struct state_t* state, const XML_Char* name, const XML_Char** attributes, bool skip)
 {
-	struct state_t* state = (struct state_t*)data;
 	struct conversion_t* c;
 	unsigned i;
 
@@ -485,6 +566,16 @@ static void start_handler(void* data, const XML_Char* name, const XML_Char** att
 
 		if (state->error == 0) {
 			c = identify(state->depth, state->level);
+
+			// skip all the subtree without processing it
+			if (skip && !c && !is_inside_processed(state->depth, state->level)) {
+				state->level[state->depth].process = 0;
+				state->skip_depth = state->depth;
+				XML_SetElementHandler(state->parser, skip_start_handler, skip_end_handler);
+				XML_SetCharacterDataHandler(state->parser, 0);
+				return;
+			}
+
 			if (c) {
 				state->level[state->depth].process = c->process;
 				state->level[state->depth].process(state, token_open, 0, 0, attributes);
@@ -494,9 +585,9 @@ static void start_handler(void* data, const XML_Char* name, const XML_Char** att
 
 			for(i=0;attributes[i];i+=2) {
 				const char* null_atts[1] = { 0 };
-				start_handler(data, attributes[i], null_atts);
-				data_handler(data, attributes[i+1], strlen(attributes[i+1]));
-				end_handler(data, attributes[i]);
+				start_element(state, attributes[i], null_atts, false);
+				data_handler(state, attributes[i+1], strlen(attributes[i+1]));
+				end_handler(state, attributes[i]);
 			}
 		} else {
 			state->level[state->depth].process = 0;
@@ -504,33 +595,242 @@ static void start_handler(void* data, const XML_Char* name, const XML_Char** att
 	}
 }
 
-void gamearchive::load_xml(istream& is)
+/**
+ * Start Handler for the Expat parser.
+ */
+static void start_handler(void* data, const XML_Char* name, const XML_Char** attributes)
 {
-	struct state_t state;
-	char buf[16384];
+	start_element((struct state_t*)data, name, attributes, true);
+}
 
-	state.parser = XML_ParserCreate(NULL);
-	if (!state.parser) {
+/**
+ * Initialize the parsing state.
+ */
+static void state_init(struct state_t* state, game_by_name_set* a)
+{
+	state->parser = XML_ParserCreate(NULL);
+	if (!state->parser) {
 		throw error() << "Error creating the XML parser";
 	}
 
-	state.depth = -1;
-	state.error = 0;
-	state.error_desc = "";
-	state.r = 0;
-	state.d = 0;
-	state.g = 0;
-	state.a = &map;
+	state->depth = -1;
+	state->skip_depth = -1;
+	state->error = 0;
+	state->error_desc = "";
+	state->r = 0;
+	state->d = 0;
+	state->g = 0;
+	state->a = a;
+
+	XML_SetUserData(state->parser, state);
+	XML_SetElementHandler(state->parser, start_handler, end_handler);
+	XML_SetCharacterDataHandler(state->parser, data_handler);
+}
+
+static void state_done(struct state_t* state)
+{
+	XML_ParserFree(state->parser);
+}
+
+/**
+ * Parse a block of data.
+ * \return false if the parsing must be stopped.
+ */
+static bool state_parse(struct state_t* state, const char* data, unsigned len, bool done)
+{
+	if (XML_Parse(state->parser, data, len, done) == XML_STATUS_ERROR) {
+		process_error(state, "", XML_ErrorString(XML_GetErrorCode(state->parser)));
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Find the start of a game element.
+ * It may be also inside a comment or at a deeper level, but in such case
+ * the parsing of the chunks fails.
+ */
+static string::size_type xml_find_game(const string& data, string::size_type pos)
+{
+	while ((pos = data.find('<', pos)) != string::npos) {
+		string::size_type end;
+
+		if (data.compare(pos + 1, 7, "machine") == 0)
+			end = pos + 8;
+		else if (data.compare(pos + 1, 4, "game") == 0)
+			end = pos + 5;
+		else
+			end = 0;
+
+		if (end && end < data.length() && (isspace(static_cast<unsigned char>(data[end])) || data[end] == '>' || data[end] == '/'))
+			return pos;
+
+		++pos;
+	}
+
+	return string::npos;
+}
 
-	XML_SetUserData(state.parser, &state);
-	XML_SetElementHandler(state.parser, start_handler, end_handler);
-	XML_SetCharacterDataHandler(state.parser, data_handler);
+/**
+ * Get the name of the root element from the data before the first game.
+ * It's the last start tag. If it isn't the root, the parsing of the chunks fails.
+ */
+static string xml_root(const string& prolog)
+{
+	string::size_type pos = prolog.rfind('<');
+
+	while (pos != string::npos) {
+		unsigned char c = prolog[pos + 1];
+		if (isalpha(c) || c == '_' || c == ':') {
+			string::size_type end = pos + 1;
+			while (end < prolog.length() && !isspace(static_cast<unsigned char>(prolog[end])) && prolog[end] != '>' && prolog[end] != '/')
+				++end;
+			return prolog.substr(pos + 1, end - pos - 1);
+		}
+
+		if (pos == 0)
+			break;
+		pos = prolog.rfind('<', pos - 1);
+	}
+
+	return string();
+}
+
+/**
+ * Parse a chunk of games.
+ * The chunk is parsed as a complete document, with the same prolog of the
+ * input and closing the root element.
+ */
+class xml_job : public thread_job {
+	const string& prolog;
+	const char* data;
+	unsigned len;
+	string epilog;
+	game_by_name_set set;
+	bool failed;
+public:
+	xml_job(const string& Aprolog, const char* Adata, unsigned Alen, const string& Aepilog)
+		: prolog(Aprolog), data(Adata), len(Alen), epilog(Aepilog), failed(true) { }
+
+	void run()
+	{
+		struct state_t state;
+
+		state_init(&state, &set);
+
+		failed = !state_parse(&state, prolog.data(), prolog.length(), false)
+			|| !state_parse(&state, data, len, epilog.length() == 0)
+			|| (epilog.length() != 0 && !state_parse(&state, epilog.data(), epilog.length(), true))
+			|| state.error;
+
+		state_done(&state);
+	}
+
+	bool is_parse_failed() const { return failed; }
+	game_by_name_set& set_get() { return set; }
+};
+
+/**
+ * Load the games parsing the chunks of the input in parallel.
+ * \return false if the input cannot be parsed in chunks.
+ * In such case the serial parsing must be used, also to report the error.
+ */
+static bool load_xml_parallel(game_by_name_set& map, const string& data, unsigned count)
+{
+	string::size_type first = xml_find_game(data, 0);
+	if (first == string::npos)
+		return false;
+
+	string prolog = data.substr(0, first);
+	string root = xml_root(prolog);
+	if (root.length() == 0)
+		return false;
+	string epilog = "</" + root + ">";
+
+	string::size_type chunk_size = data.length() / (count * 4);
+	if (chunk_size < XML_CHUNK_MIN)
+		chunk_size = XML_CHUNK_MIN;
+
+	// split at the start of the games
+	vector<string::size_type> bound;
+	string::size_type pos = first;
+	while (pos != string::npos) {
+		bound.insert(bound.end(), pos);
+		pos = xml_find_game(data, pos + chunk_size);
+	}
+	bound.insert(bound.end(), data.length());
+
+	if (bound.size() < 3)
+		return false;
+
+	vector<xml_job*> js;
+
+	{
+		thread_pool pool(count);
+
+		for(unsigned i=0;i+1<bound.size();++i) {
+			// the last chunk already contains the end of the document
+			bool last = i + 2 == bound.size();
+			xml_job* j = new xml_job(prolog, data.data() + bound[i], bound[i+1] - bound[i], last ? string() : epilog);
+			js.insert(js.end(), j);
+			pool.push(j);
+		}
+
+		pool.wait();
+	}
+
+	bool ok = true;
+	try {
+		for(unsigned i=0;i<js.size();++i) {
+			js[i]->rethrow();
+			if (js[i]->is_parse_failed())
+				ok = false;
+		}
+
+		// merge in the input order, if duplicate the first game is kept
+		for(unsigned i=0;ok && i<js.size();++i) {
+			game_by_name_set& set = js[i]->set_get();
+			if (map.empty()) {
+				map.swap(set);
+			} else {
+				for(game_by_name_set::const_iterator j=set.begin();j!=set.end();++j)
+					map.insert(*j);
+			}
+		}
+	} catch (...) {
+		for(unsigned i=0;i<js.size();++i)
+			delete js[i];
+		throw;
+	}
+
+	for(unsigned i=0;i<js.size();++i)
+		delete js[i];
+
+	return ok;
+}
+
+/**
+ * Load the games reading the input in blocks.
+ */
+static void load_xml_serial(game_by_name_set& map, istream& is)
+{
+	struct state_t state;
+
+	state_init(&state, &map);
 
 	while (1) {
 		int done;
 		int len;
 
-		is.read(buf, sizeof(buf));
+		// read directly in the parser buffer, avoiding a copy
+		char* buf = static_cast<char*>(XML_GetBuffer(state.parser, XML_BUFFER_SIZE));
+		if (!buf) {
+			process_error(&state, "", "low memory");
+			break;
+		}
+
+		is.read(buf, XML_BUFFER_SIZE);
 		if (is.bad()) {
 			process_error(&state, "", "read error");
 			break;
@@ -540,7 +840,7 @@ void gamearchive::load_xml(istream& is)
 
 		done = is.eof();
 
-		if (XML_Parse(state.parser, buf, len, done) == XML_STATUS_ERROR) {
+		if (XML_ParseBuffer(state.parser, len, done) == XML_STATUS_ERROR) {
 			process_error(&state, "", XML_ErrorString(XML_GetErrorCode(state.parser)));
 			break;
 		}
@@ -549,10 +849,56 @@ void gamearchive::load_xml(istream& is)
 			break;
 	}
 
-	XML_ParserFree(state.parser);
+	state_done(&state);
 
 	if (state.error) {
 		throw error() << state.error_desc;
 	}
 }
 
+void gamearchive::load_xml(istream& is)
+{
+	unsigned count = thread_count_get();
+
+	if (count <= 1) {
+		load_xml_serial(map, is);
+		return;
+	}
+
+	// read all the input to split it in chunks
+	string data;
+	char buf[16384];
+	while (is.read(buf, sizeof(buf)) || is.gcount() > 0)
+		data.append(buf, is.gcount());
+	if (is.bad())
+		throw error() << "Error reading the XML input";
+
+	load_xml(data);
+}
+
+/**
+ * Load the games from an XML information file already in memory.
+ */
+void gamearchive::load_xml(const string& data)
+{
+	unsigned count = thread_count_get();
+
+	if (count > 1 && load_xml_parallel(map, data, count))
+		return;
+
+	// if the parallel parsing fails, parse again all the input to get
+	// the same result and the same error of the serial parsing
+	map.clear();
+
+	struct state_t state;
+
+	state_init(&state, &map);
+
+	state_parse(&state, data.data(), data.length(), true);
+
+	state_done(&state);
+
+	if (state.error) {
+		throw error() << state.error_desc;
+	}
+}
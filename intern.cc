@@ -0,0 +1,149 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "portable.h"
+
+#include "intern.h"
+
+#include <vector>
+#include <new>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+using namespace std;
+
+/**
+ * The strings are stored in blocks, never moved, so they can be read
+ * without locking, also while other strings are inserted.
+ */
+#define INTERN_BLOCK_SIZE 4096
+#define INTERN_BLOCK_MAX 65536
+
+/**
+ * First block, always present. It contains the empty string at 0.
+ */
+static string intern_first[INTERN_BLOCK_SIZE];
+
+static string* intern_block[INTERN_BLOCK_MAX] = { intern_first };
+
+/**
+ * Number of strings, including the empty string at 0.
+ */
+static unsigned intern_count = 1;
+
+/**
+ * Hash table of the identifiers, with open addressing.
+ * An empty bucket contains 0.
+ */
+static vector<intern_t> intern_hash;
+static unsigned intern_mask;
+
+#if HAVE_PTHREAD
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static inline string& intern_at(intern_t id)
+{
+	return intern_block[id / INTERN_BLOCK_SIZE][id % INTERN_BLOCK_SIZE];
+}
+
+static inline unsigned intern_hash_compute(const string& s)
+{
+	// FNV-1a
+	unsigned h = 2166136261U;
+	for(string::const_iterator i=s.begin();i!=s.end();++i) {
+		h ^= static_cast<unsigned char>(*i);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void intern_rehash()
+{
+	unsigned size = intern_hash.size() ? intern_hash.size() * 2 : 4096;
+
+	vector<intern_t> hash(size, 0);
+	intern_mask = size - 1;
+
+	for(intern_t id=1;id<intern_count;++id) {
+		unsigned h = intern_hash_compute(intern_at(id)) & intern_mask;
+		while (hash[h] != 0)
+			h = (h + 1) & intern_mask;
+		hash[h] = id;
+	}
+
+	intern_hash.swap(hash);
+}
+
+static intern_t intern_locked(const string& s)
+{
+	// keep the load factor under 1/2
+	if (2 * intern_count >= intern_hash.size())
+		intern_rehash();
+
+	unsigned h = intern_hash_compute(s) & intern_mask;
+	while (intern_hash[h] != 0) {
+		if (intern_at(intern_hash[h]) == s)
+			return intern_hash[h];
+		h = (h + 1) & intern_mask;
+	}
+
+	intern_t id = intern_count;
+
+	if (id / INTERN_BLOCK_SIZE >= INTERN_BLOCK_MAX)
+		throw bad_alloc();
+
+	if (!intern_block[id / INTERN_BLOCK_SIZE])
+		intern_block[id / INTERN_BLOCK_SIZE] = new string[INTERN_BLOCK_SIZE];
+
+	intern_at(id) = s;
+	intern_hash[h] = id;
+	++intern_count;
+
+	return id;
+}
+
+intern_t intern(const string& s)
+{
+	if (s.empty())
+		return 0;
+
+#if HAVE_PTHREAD
+	pthread_mutex_lock(&intern_lock);
+	try {
+		intern_t id = intern_locked(s);
+		pthread_mutex_unlock(&intern_lock);
+		return id;
+	} catch (...) {
+		pthread_mutex_unlock(&intern_lock);
+		throw;
+	}
+#else
+	return intern_locked(s);
+#endif
+}
+
+const string& intern_get(intern_t id)
+{
+	return intern_at(id);
+}
+
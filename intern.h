@@ -0,0 +1,46 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __INTERN_H
+#define __INTERN_H
+
+#include <string>
+
+/**
+ * Identifier of a string in the pool of unique strings.
+ * The empty string has always the identifier 0.
+ */
+typedef unsigned intern_t;
+
+/**
+ * Get the identifier of a string, inserting it in the pool if missing.
+ * Equal strings get the same identifier. The strings are never released.
+ * It can be called concurrently from different threads.
+ */
+intern_t intern(const std::string& s);
+
+/**
+ * Get the string of an identifier.
+ * The reference remains valid until the program end.
+ */
+const std::string& intern_get(intern_t id);
+
+#endif
+
@@ -25,204 +25,246 @@
 /* Start size of buffer */
 #define INFO_BUF_MIN 64
 
-/* Buffer used for storing last token */
-static unsigned info_buf_mac;
-static unsigned info_buf_max;
-static char* info_buf_map;
-
-/* Position in the stream */
-static unsigned info_pos; /* Char */
-static unsigned info_row; /* Row */
-static unsigned info_col; /* Column */
-
-static int (*info_ptr_get)(void*);
-static void (*info_ptr_unget)(void*, char);
-void* info_ptr_arg;
-
-/* Initialize */
-void info_init(int (*get)(void*), void (*unget)(void*, char), void* arg)
+static unsigned hexdigit(char c)
 {
-	info_buf_max = 0;
-	info_buf_map = 0;
-	info_pos = 0;
-	info_row = 0;
-	info_col = 0;
-	info_ptr_get = get;
-	info_ptr_unget = unget;
-	info_ptr_arg = arg;
+	if (isdigit(c))
+		return c - '0';
+	return toupper(c) - 'A' + 10;
 }
 
-/* Deinitialize */
-void info_done(void)
+/* Initialize a context on a buffer */
+void info_context_init(struct info_context* context, const char* data, unsigned size)
 {
-	free(info_buf_map);
+	context->begin = data;
+	context->end = data + size;
+	context->ptr = data;
+	context->text = data;
+	context->text_len = 0;
+	context->buf_map = 0;
+	context->buf_max = 0;
 }
 
-/* Get information of file position */
-unsigned info_row_get(void)
+/* Deinitialize a context */
+void info_context_done(struct info_context* context)
 {
-	return info_row;
+	free(context->buf_map);
+	context->buf_map = 0;
+	context->buf_max = 0;
 }
 
-unsigned info_col_get(void)
+/* Ensure the context buffer has the specified size */
+static char* info_context_buf(struct info_context* context, unsigned size)
 {
-	return info_col;
+	if (size > context->buf_max) {
+		if (!context->buf_max)
+			context->buf_max = INFO_BUF_MIN;
+		while (context->buf_max < size)
+			context->buf_max *= 2;
+		context->buf_map = realloc(context->buf_map, context->buf_max);
+		assert(context->buf_map);
+	}
+	return context->buf_map;
 }
 
-unsigned info_pos_get(void)
+/* Get information of the position, computed only when requested */
+unsigned info_context_pos_get(const struct info_context* context)
 {
-	return info_pos;
+	return context->ptr - context->begin;
 }
 
-/* Resize the buffer */
-static void info_buf_resize(unsigned size)
+unsigned info_context_row_get(const struct info_context* context)
 {
-	if (!info_buf_max)
-		info_buf_max = INFO_BUF_MIN;
-	else
-		info_buf_max *= 2;
-	if (size > info_buf_max)
-		info_buf_max = size;
-	info_buf_map = realloc(info_buf_map, info_buf_max);
-	assert(info_buf_map);
+	const char* p;
+	unsigned row = 0;
+	for(p=context->begin;p<context->ptr;++p)
+		if (*p == '\n')
+			++row;
+	return row;
 }
 
-/* Add a char to the buffer end */
-static inline void info_buf_add(char c)
+unsigned info_context_col_get(const struct info_context* context)
 {
-	if (info_buf_mac >= info_buf_max)
-		info_buf_resize(info_buf_mac + 1);
-	info_buf_map[info_buf_mac++] = c;
+	const char* p = context->ptr;
+	while (p > context->begin && p[-1] != '\n')
+		--p;
+	return context->ptr - p;
 }
 
-/* Reset the buffer */
-static void info_buf_reset()
+/* Return last token text */
+const char* info_context_text_ptr(const struct info_context* context)
 {
-	info_buf_mac = 0;
+	return context->text;
 }
 
-/* Return last token text */
-const char* info_text_get(void)
+unsigned info_context_text_len(const struct info_context* context)
 {
-	/* ensure the buffer end with zero */
-	if (info_buf_mac==0 || info_buf_map[info_buf_mac-1]!=0)
-		info_buf_add(0);
-	return info_buf_map;
+	return context->text_len;
 }
 
-/* Read a char from file */
-static int info_getc(void)
+/* Return last token text zero terminated */
+const char* info_context_text_get(struct info_context* context)
 {
-	int c = info_ptr_get(info_ptr_arg);
-	switch (c) {
-		case EOF:
-			break;
-		case '\n':
-			info_col = 0;
-			++info_row;
-			++info_pos;
-			break;
-		default:
-			++info_col;
-			++info_pos;
-			break;
-	}
-	return c;
+	char* buf;
+
+	/* already in the buffer and terminated */
+	if (context->text == context->buf_map && context->text_len < context->buf_max && context->buf_map[context->text_len] == 0)
+		return context->text;
+
+	buf = info_context_buf(context, context->text_len + 1);
+	memmove(buf, context->text, context->text_len);
+	buf[context->text_len] = 0;
+	context->text = buf;
+
+	return buf;
 }
 
-/* Unget a char from file */
-static void info_ungetc(int c)
+/* Compare the last token text with a zero terminated string */
+int info_context_text_is(const struct info_context* context, const char* s)
 {
-	--info_pos;
-	--info_col;
-	info_ptr_unget(info_ptr_arg, c);
+	return strncmp(context->text, s, context->text_len) == 0 && s[context->text_len] == 0;
 }
 
-static enum info_t get_symbol(int c)
+static inline int info_context_is_delimiter(int c)
 {
-	while (c!=EOF && !isspace(c) && c!='(' && c!=')' && c!='\"') {
-		info_buf_add(c);
-		c = info_getc();
-	}
-	/* no reason to unget space or EOF */
-	if (c!=EOF && !isspace(c))
-		info_ungetc(c);
-	return info_symbol;
+	return isspace(c) || c=='(' || c==')' || c=='\"';
 }
 
-static unsigned hexdigit(char c)
+static enum info_t info_context_get_symbol(struct info_context* context)
 {
-	if (isdigit(c))
-		return c - '0';
-	return toupper(c) - 'A' + 10;
+	const char* p = context->ptr;
+
+	while (p != context->end && !info_context_is_delimiter((unsigned char)*p))
+		++p;
+
+	context->text = context->ptr;
+	context->text_len = p - context->ptr;
+
+	/* no reason to keep space */
+	if (p != context->end && isspace((unsigned char)*p))
+		++p;
+
+	context->ptr = p;
+
+	return info_symbol;
 }
 
-static enum info_t get_string(void)
+static enum info_t info_context_get_string(struct info_context* context)
 {
-	int c = info_getc();
-	while (c!=EOF && c!='\"') {
-		if (c=='\\') {
-			c = info_getc();
-			switch (c) {
-				case 'a' : info_buf_add('\a'); break;
-				case 'b' : info_buf_add('\b'); break;
-				case 'f' : info_buf_add('\f'); break;
-				case 'n' : info_buf_add('\n'); break;
-				case 'r' : info_buf_add('\r'); break;
-				case 't' : info_buf_add('\t'); break;
-				case 'v' : info_buf_add('\v'); break;
-				case '\\' : info_buf_add('\\'); break;
-				case '?' : info_buf_add('\?'); break;
-				case '\'' : info_buf_add('\''); break;
-				case '\"' : info_buf_add('\"'); break;
+	const char* p = context->ptr;
+	unsigned mac;
+	char* buf;
+
+	/* fast path for the strings without escape sequences */
+	while (p != context->end && *p != '\"' && *p != '\\')
+		++p;
+
+	if (p != context->end && *p == '\"') {
+		context->text = context->ptr;
+		context->text_len = p - context->ptr;
+		context->ptr = p + 1;
+		return info_string;
+	}
+
+	/* find the end of the string, skipping the escaped chars */
+	while (p != context->end && *p != '\"') {
+		if (*p == '\\' && p + 1 != context->end)
+			++p;
+		++p;
+	}
+
+	/* decode the string in the buffer, the result is never longer */
+	buf = info_context_buf(context, p - context->ptr + 1);
+	p = context->ptr;
+	mac = 0;
+	while (p != context->end && *p != '\"') {
+		if (*p == '\\') {
+			++p;
+			if (p == context->end)
+				break;
+			switch (*p) {
+				case 'a' : buf[mac++] = '\a'; break;
+				case 'b' : buf[mac++] = '\b'; break;
+				case 'f' : buf[mac++] = '\f'; break;
+				case 'n' : buf[mac++] = '\n'; break;
+				case 'r' : buf[mac++] = '\r'; break;
+				case 't' : buf[mac++] = '\t'; break;
+				case 'v' : buf[mac++] = '\v'; break;
+				case '\\' : buf[mac++] = '\\'; break;
+				case '?' : buf[mac++] = '\?'; break;
+				case '\'' : buf[mac++] = '\''; break;
+				case '\"' : buf[mac++] = '\"'; break;
 				case 'x' : {
 					int d0, d1;
-					unsigned char cc;
-					d0 = info_getc();
-					if (!isxdigit(d0))
+					if (context->end - p < 3) {
+						context->ptr = context->end;
+						return info_error;
+					}
+					d0 = (unsigned char)p[1];
+					d1 = (unsigned char)p[2];
+					if (!isxdigit(d0)) {
+						context->ptr = p + 2;
 						return info_error;
-					d1 = info_getc();
-					if (!isxdigit(d1))
+					}
+					if (!isxdigit(d1)) {
+						context->ptr = p + 3;
 						return info_error;
-					cc = hexdigit(d0) * 16 + hexdigit(d1);
-					info_buf_add(cc);
+					}
+					buf[mac++] = hexdigit(d0) * 16 + hexdigit(d1);
+					p += 2;
 				}
 				break;
 				default:
+					context->ptr = p + 1;
 					return info_error;
 			}
 		} else {
-			info_buf_add(c);
+			buf[mac++] = *p;
 		}
-		c = info_getc();
+		++p;
 	}
-	if (c!='\"')
+
+	if (p == context->end) {
+		context->ptr = p;
 		return info_error;
+	}
+
+	buf[mac] = 0;
+	context->text = buf;
+	context->text_len = mac;
+	context->ptr = p + 1;
+
 	return info_string;
 }
 
 /* Extract a token */
-enum info_t info_token_get(void)
+enum info_t info_context_token_get(struct info_context* context)
 {
-	int c = info_getc();
-	/* reset the buffer */
-	info_buf_reset();
+	const char* p = context->ptr;
+
+	context->text_len = 0;
+
 	/* skip space */
-	while (c!=EOF && isspace(c)) {
-		c = info_getc();
+	while (p != context->end && isspace((unsigned char)*p))
+		++p;
+
+	if (p == context->end) {
+		context->ptr = p;
+		return info_eof;
 	}
+
+	context->ptr = p + 1;
+
 	/* get token */
-	switch (c) {
-		case EOF:
-			return info_eof;
+	switch (*p) {
 		case '(':
 			return info_open;
 		case ')':
 			return info_close;
 		case '\"':
-			return get_string();
+			return info_context_get_string(context);
 		default:
-			return get_symbol(c);
+			context->ptr = p;
+			return info_context_get_symbol(context);
 	}
 }
 
@@ -233,13 +275,13 @@ enum info_t info_token_get(void)
  *   info_error error
  *   otherwise last token skipped
  */
-enum info_t info_skip_value(void)
+enum info_t info_context_skip_value(struct info_context* context)
 {
 	/* read value token */
-	enum info_t t = info_token_get();
+	enum info_t t = info_context_token_get(context);
 	switch (t) {
 		case info_open:
-			t = info_token_get();
+			t = info_context_token_get(context);
 			if (t==info_error)
 				return info_error;
 			while (t!=info_close) {
@@ -247,12 +289,12 @@ enum info_t info_skip_value(void)
 				if (t!=info_symbol)
 					return info_error;
 				/* second skip the value */
-				t = info_skip_value();
+				t = info_context_skip_value(context);
 				/* two value required */
 				if (t==info_error)
 					return info_error;
 				/* read next token, a type or a info_close */
-				t = info_token_get();
+				t = info_context_token_get(context);
 				if (t==info_error)
 					return info_error;
 			}
@@ -265,4 +307,3 @@ enum info_t info_skip_value(void)
 	}
 	return t;
 }
-
@@ -41,16 +41,45 @@ enum info_t {
 	info_string      /* c string automatically converted */
 };
 
-void info_init(int (*get)(void*), void (*unget)(void*, char), void* arg);
-void info_done(void);
+/**
+ * Reentrant tokenizer working on a buffer in memory.
+ * The text of the tokens points into the buffer, and it's copied only
+ * for strings with escape sequences. Different contexts can be used
+ * concurrently.
+ */
+struct info_context {
+	const char* begin; /**< Start of the data. */
+	const char* end; /**< End of the data. */
+	const char* ptr; /**< Current position. */
+	const char* text; /**< Text of the last token, not zero terminated. */
+	unsigned text_len; /**< Length of the text of the last token. */
+	char* buf_map; /**< Buffer for the decoded strings and the zero terminated text. */
+	unsigned buf_max; /**< Size of the buffer. */
+};
+
+void info_context_init(struct info_context* context, const char* data, unsigned size);
+void info_context_done(struct info_context* context);
+
+enum info_t info_context_token_get(struct info_context* context);
+enum info_t info_context_skip_value(struct info_context* context);
 
-const char* info_text_get(void);
-enum info_t info_token_get(void);
-enum info_t info_skip_value(void);
+/**
+ * Get the text of the last token.
+ * The text isn't zero terminated, use info_context_text_len() for its length.
+ */
+const char* info_context_text_ptr(const struct info_context* context);
+unsigned info_context_text_len(const struct info_context* context);
+
+/**
+ * Get the text of the last token zero terminated.
+ * It may require a copy, use info_context_text_ptr() when possible.
+ */
+const char* info_context_text_get(struct info_context* context);
+int info_context_text_is(const struct info_context* context, const char* s);
 
-unsigned info_row_get(void);
-unsigned info_col_get(void);
-unsigned info_pos_get(void);
+unsigned info_context_row_get(const struct info_context* context);
+unsigned info_context_col_get(const struct info_context* context);
+unsigned info_context_pos_get(const struct info_context* context);
 
 /*@}*/
 
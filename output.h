@@ -23,8 +23,11 @@
 
 #include "game.h"
 
+class plan;
+
 class output {
 	std::ostream& os;
+	plan* pl; // where the commands are also written, 0 if none
 
 	std::ostream& op(const std::string& op);
 	std::ostream& total(const std::string& op);
@@ -33,10 +36,13 @@ class output {
 	std::ostream& pair(unsigned size, crc_t crc);
 
 public:
-	output(std::ostream& Aos) : os(Aos) { os.setf(std::ios::left, std::ios::adjustfield); }
+	output(std::ostream& Aos) : os(Aos), pl(0) { os.setf(std::ios::left, std::ios::adjustfield); }
 
 	std::ostream& operator()() { return os; }
 
+	void plan_set(plan* A) { pl = A; }
+	plan* plan_get() const { return pl; }
+
 	std::ostream& zip(const std::string& op, const std::string& zip);
 	std::ostream& ziptag(const std::string& op, const std::string& zip, const std::string& tag);
 
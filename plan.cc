@@ -0,0 +1,440 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "portable.h"
+
+#include "plan.h"
+#include "ziprom.h"
+#include "thread.h"
+
+#include <sstream>
+#include <iomanip>
+#include <map>
+
+using namespace std;
+
+/**
+ * Signature of the plan file.
+ */
+#define PLAN_MAGIC "advscan plan 1"
+
+/**
+ * Number of fields of an operation.
+ */
+#define PLAN_FIELD_MAX 9
+
+static const char* plan_type_name(plan_type type)
+{
+	switch (type) {
+	case plan_add : return "add";
+	case plan_rename : return "rename";
+	case plan_remove : return "remove";
+	}
+	return "";
+}
+
+/**
+ * Escape a field, to not contain tabs and newlines.
+ */
+static string plan_escape(const string& s)
+{
+	string r;
+	for(string::const_iterator i=s.begin();i!=s.end();++i) {
+		switch (*i) {
+		case '\\' : r += "\\\\"; break;
+		case '\t' : r += "\\t"; break;
+		case '\n' : r += "\\n"; break;
+		case '\r' : r += "\\r"; break;
+		default: r += *i; break;
+		}
+	}
+	return r;
+}
+
+static bool plan_unescape(const string& s, string& r)
+{
+	r.erase();
+	for(string::const_iterator i=s.begin();i!=s.end();++i) {
+		if (*i != '\\') {
+			r += *i;
+			continue;
+		}
+		if (++i == s.end())
+			return false;
+		switch (*i) {
+		case '\\' : r += '\\'; break;
+		case 't' : r += '\t'; break;
+		case 'n' : r += '\n'; break;
+		case 'r' : r += '\r'; break;
+		default: return false;
+		}
+	}
+	return true;
+}
+
+static bool plan_number(const string& s, unsigned& v, int base)
+{
+	if (!s.length())
+		return false;
+
+	char* e;
+	unsigned long r = strtoul(s.c_str(), &e, base);
+	if (*e)
+		return false;
+
+	v = r;
+	return true;
+}
+
+/**
+ * Remove the carriage return of a text file written with CRLF.
+ */
+static void plan_chomp(string& line)
+{
+	if (line.length() && line[line.length() - 1] == '\r')
+		line.erase(line.length() - 1);
+}
+
+void plan::insert(plan_type type, const string& zip, const string& name, const zip_entry& src, const string& reject)
+{
+	plan_op o;
+
+	o.type = type;
+	o.zip = zip;
+	o.name = name;
+	o.src_zip = src.parentname_get();
+	o.src_name = src.name_get();
+	o.src_offset = src.offset_get();
+	o.size = src.uncompressed_size_get();
+	o.crc = src.crc_get();
+	o.reject = reject;
+
+	op.insert(op.end(), o);
+}
+
+/**
+ * Add a copy of an entry.
+ * \param reject Where the entry with the same name is moved, if any.
+ */
+void plan::add(const string& zip, const string& name, const zip_entry& src, const string& reject)
+{
+	insert(plan_add, zip, name, src, reject);
+}
+
+/**
+ * Rename an entry of the zip.
+ * \param reject Where the entry with the same name is moved, if any.
+ */
+void plan::rename(const string& zip, const string& name, const zip_entry& src, const string& reject)
+{
+	insert(plan_rename, zip, name, src, reject);
+}
+
+/**
+ * Remove an entry of the zip.
+ * \param reject Where the entry is moved, or empty to delete it.
+ */
+void plan::remove(const string& zip, const zip_entry& entry, const string& reject)
+{
+	insert(plan_remove, zip, entry.name_get(), entry, reject);
+}
+
+void plan::append(const plan& A)
+{
+	op.insert(op.end(), A.op.begin(), A.op.end());
+}
+
+void plan::save(ostream& os) const
+{
+	os << PLAN_MAGIC << "\n";
+
+	for(plan_op_container::const_iterator i=op.begin();i!=op.end();++i) {
+		ostringstream crc;
+		crc << hex << setw(8) << setfill('0') << i->crc;
+
+		os << plan_type_name(i->type);
+		os << "\t" << plan_escape(i->zip);
+		os << "\t" << plan_escape(i->name);
+		os << "\t" << plan_escape(i->src_zip);
+		os << "\t" << plan_escape(i->src_name);
+		os << "\t" << i->src_offset;
+		os << "\t" << i->size;
+		os << "\t" << crc.str();
+		os << "\t" << plan_escape(i->reject);
+		os << "\n";
+	}
+}
+
+void plan::load(istream& is)
+{
+	string line;
+
+	if (getline(is, line))
+		plan_chomp(line);
+	if (!is || line != PLAN_MAGIC)
+		throw error_invalid() << "Invalid plan signature";
+
+	unsigned row = 1;
+	while (getline(is, line)) {
+		++row;
+
+		plan_chomp(line);
+
+		if (!line.length())
+			continue;
+
+		// split the fields
+		vector<string> field;
+		string::size_type begin = 0;
+		while (true) {
+			string::size_type end = line.find('\t', begin);
+			if (end == string::npos) {
+				field.insert(field.end(), line.substr(begin));
+				break;
+			}
+			field.insert(field.end(), line.substr(begin, end - begin));
+			begin = end + 1;
+		}
+		if (field.size() != PLAN_FIELD_MAX)
+			throw error_invalid() << "Invalid number of fields in the plan at row " << row;
+
+		plan_op o;
+
+		if (field[0] == "add")
+			o.type = plan_add;
+		else if (field[0] == "rename")
+			o.type = plan_rename;
+		else if (field[0] == "remove")
+			o.type = plan_remove;
+		else
+			throw error_invalid() << "Invalid operation `" << field[0] << "' in the plan at row " << row;
+
+		if (!plan_unescape(field[1], o.zip)
+			|| !plan_unescape(field[2], o.name)
+			|| !plan_unescape(field[3], o.src_zip)
+			|| !plan_unescape(field[4], o.src_name)
+			|| !plan_number(field[5], o.src_offset, 10)
+			|| !plan_number(field[6], o.size, 10)
+			|| !plan_number(field[7], o.crc, 16)
+			|| !plan_unescape(field[8], o.reject))
+			throw error_invalid() << "Invalid field in the plan at row " << row;
+
+		if (!o.zip.length() || !o.name.length() || !o.src_zip.length() || !o.src_name.length())
+			throw error_invalid() << "Missing zip in the plan at row " << row;
+
+		if (o.type == plan_rename && !o.reject.length())
+			throw error_invalid() << "Missing reject zip in the plan at row " << row;
+
+		op.insert(op.end(), o);
+	}
+
+	if (is.bad())
+		throw error() << "Failed read of the plan";
+}
+
+// ----------------------------------------------------------------------------
+// execute
+
+typedef map<string, ziprom*> plan_zip_map;
+
+/**
+ * Get a zip, opening it at the first use.
+ * \param order Where the zips are inserted in the order of the first use.
+ */
+static ziprom& plan_open(plan_zip_map& zips, vector<ziprom*>& order, const string& path, ostream& log)
+{
+	plan_zip_map::iterator i = zips.find(path);
+	if (i != zips.end())
+		return *i->second;
+
+	ziprom* z = new ziprom(path, zip_own, false);
+
+	try {
+		z->open();
+	} catch (error& e) {
+		delete z;
+		throw e << " opening zip " << path;
+	} catch (...) {
+		delete z;
+		throw;
+	}
+
+	z->log_set(log);
+
+	zips[path] = z;
+	order.insert(order.end(), z);
+
+	return *z;
+}
+
+/**
+ * Get the source entry of an operation, checking that it's not changed.
+ */
+static ziprom::iterator plan_source(ziprom& z, const plan_op& o)
+{
+	ziprom::iterator i = z.find(o.src_name);
+	if (i == z.end())
+		throw error() << "Missing source " << o.src_zip << "/" << o.src_name;
+	if (i->offset_get() != o.src_offset || i->uncompressed_size_get() != o.size || i->crc_get() != o.crc)
+		throw error() << "Changed source " << o.src_zip << "/" << o.src_name;
+	return i;
+}
+
+/**
+ * Save of a changed zip.
+ */
+class plan_save_job : public thread_job {
+	ziprom& z;
+	ostringstream log; // log of the save, printed later in order
+public:
+	plan_save_job(ziprom& Az) : z(Az) { }
+
+	void run() {
+		ostream& prev = z.log();
+		z.log_set(log);
+		try {
+			z.save();
+			z.unload();
+		} catch (...) {
+			z.log_set(prev);
+			throw;
+		}
+		z.log_set(prev);
+	}
+
+	const ziprom& zip_get() const { return z; }
+	string log_get() const { return log.str(); }
+};
+
+static void plan_close(plan_zip_map& zips)
+{
+	for(plan_zip_map::iterator i=zips.begin();i!=zips.end();++i) {
+		i->second->close();
+		delete i->second;
+	}
+	zips.clear();
+}
+
+/**
+ * Execute the plan.
+ * All the operations are done in memory, in the same order of the scan,
+ * and every zip is then written once. The source entries are taken from
+ * the zips as changed by the previous operations, and the consecutive adds
+ * to the same zip are done in the order of the position in the sources,
+ * to read them sequentially. The changed zips are written concurrently.
+ */
+void plan::execute(ostream& log) const
+{
+	plan_zip_map zips; // zips used
+	vector<ziprom*> order; // zips used, in the order of first use
+	vector<plan_save_job*> js;
+
+	try {
+		ziprom* add_zip = 0; // zip of the adds not yet done
+		ziprom_add_container add_plan; // adds not yet done
+
+		for(plan_op_container::const_iterator i=op.begin();i!=op.end();++i) {
+			ziprom& z = plan_open(zips, order, i->zip, log);
+
+			// the consecutive adds without reject are done together
+			if (add_zip && (add_zip != &z || i->type != plan_add || i->reject.length())) {
+				add_zip->add(add_plan);
+				add_plan.clear();
+				add_zip = 0;
+			}
+
+			ziprom* reject = 0;
+			if (i->reject.length())
+				reject = &plan_open(zips, order, i->reject, log);
+
+			try {
+				switch (i->type) {
+				case plan_add : {
+					ziprom& s = plan_open(zips, order, i->src_zip, log);
+					ziprom::iterator j = plan_source(s, *i);
+					if (reject == &s && i->src_name == i->name) {
+						// the entry with the same name in the reject zip is swapped
+						z.swap(i->name, *reject, j);
+					} else if (reject) {
+						z.add(j, i->name, *reject);
+					} else {
+						ziprom_add a;
+						a.entry = j;
+						a.name = i->name;
+						add_plan.insert(add_plan.end(), a);
+						add_zip = &z;
+					}
+					break;
+				}
+				case plan_rename :
+					plan_source(z, *i);
+					z.rename(i->src_name, i->name, *reject);
+					break;
+				case plan_remove :
+					if (reject)
+						z.remove(i->name, *reject);
+					else
+						z.remove(i->name);
+					break;
+				}
+			} catch (error& e) {
+				throw e << " executing " << plan_type_name(i->type) << " of " << i->zip << "/" << i->name;
+			}
+		}
+
+		if (add_zip)
+			add_zip->add(add_plan);
+
+		// write the changed zips
+		unsigned count = thread_count_get();
+		if (count > order.size())
+			count = order.size();
+
+		if (count) {
+			thread_pool pool(count);
+
+			for(vector<ziprom*>::iterator i=order.begin();i!=order.end();++i) {
+				plan_save_job* j = new plan_save_job(**i);
+				js.insert(js.end(), j);
+				pool.push(j);
+			}
+
+			pool.wait();
+		}
+
+		for(unsigned k=0;k<js.size();++k) {
+			log << js[k]->log_get();
+			try {
+				js[k]->rethrow();
+			} catch (error& e) {
+				throw e << " saving zip " << js[k]->zip_get().file_get();
+			}
+		}
+	} catch (...) {
+		for(unsigned k=0;k<js.size();++k)
+			delete js[k];
+		plan_close(zips);
+		throw;
+	}
+
+	for(unsigned k=0;k<js.size();++k)
+		delete js[k];
+	plan_close(zips);
+}
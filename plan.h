@@ -0,0 +1,82 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __PLAN_H
+#define __PLAN_H
+
+#include "zip.h"
+#include "crc.h"
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+/**
+ * Type of an operation of the plan.
+ */
+enum plan_type {
+	plan_add, // copy an entry of a zip in another, or in the same, zip
+	plan_rename, // rename an entry of a zip
+	plan_remove // remove an entry of a zip
+};
+
+/**
+ * Operation of the plan.
+ * The replaced and removed entries are moved in the reject zip, if present.
+ */
+struct plan_op {
+	plan_type type;
+	std::string zip; // zip changed
+	std::string name; // name of the entry in the zip
+	std::string src_zip; // zip of the source entry, for add and rename
+	std::string src_name; // name of the source entry, for add and rename
+	unsigned src_offset; // position of the source entry in its zip, checked by the execution
+	unsigned size; // uncompressed size of the entry
+	crc_t crc; // crc of the entry
+	std::string reject; // reject zip, empty if none
+};
+
+typedef std::vector<plan_op> plan_op_container;
+
+/**
+ * Plan of the operations on the zips.
+ * It's written by a scan changing the zips only in memory, and it can be
+ * executed later, with the same result.
+ */
+class plan {
+	plan_op_container op;
+
+	void insert(plan_type type, const std::string& zip, const std::string& name, const zip_entry& src, const std::string& reject);
+public:
+	bool empty() const { return op.empty(); }
+	unsigned size() const { return op.size(); }
+
+	void add(const std::string& zip, const std::string& name, const zip_entry& src, const std::string& reject);
+	void rename(const std::string& zip, const std::string& name, const zip_entry& src, const std::string& reject);
+	void remove(const std::string& zip, const zip_entry& entry, const std::string& reject);
+	void append(const plan& A);
+
+	void load(std::istream& is);
+	void save(std::ostream& os) const;
+
+	void execute(std::ostream& log) const;
+};
+
+#endif
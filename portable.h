@@ -121,6 +121,13 @@ extern int optind, opterr, optopt;
 #define HAVE_FUNC_MKDIR_ONEARG 0
 #endif
 
+/* If a file can be deleted or replaced while it's still open */
+#if defined(__MSDOS__) || defined(__WIN32__)
+#define HAVE_OPEN_UNLINK 0
+#else
+#define HAVE_OPEN_UNLINK 1
+#endif
+
 #if defined(__WIN32__)
 #define HAVE_SIGHUP 0
 #define HAVE_SIGQUIT 0
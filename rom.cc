@@ -24,18 +24,20 @@
 #include "zip.h"
 
 #include <iostream>
+#include <algorithm>
 
 using namespace std;
 
 rom::rom()
 {
+	name = 0;
 	size = 0;
 	crc = 0;
 	nodump = false;
 }
 
 rom::rom(const string& Aname, unsigned Asize, crc_t Acrc, bool Anodump)
-	: name(Aname), size(Asize), crc(Acrc), nodump(Anodump)
+	: name(intern(Aname)), size(Asize), crc(Acrc), nodump(Anodump)
 {
 }
 
@@ -50,7 +52,7 @@ rom::~rom()
 
 void rom::name_set(const string& Aname)
 {
-	name = Aname;
+	name = intern(Aname);
 }
 
 void rom::crc_set(crc_t Acrc)
@@ -70,20 +72,21 @@ void rom::nodump_set(bool Anodump)
 
 bool rom::operator==(const rom& A) const
 {
-	return file_compare(name_get(), A.name_get())==0 && size_get()==A.size_get() && crc_get()==A.crc_get();
+	return (name == A.name || file_compare(name_get(), A.name_get())==0) && size_get()==A.size_get() && crc_get()==A.crc_get();
 }
 
 gamerom::gamerom()
 {
+	game = 0;
 }
 
 gamerom::gamerom(const string& Agame, const string& Aname, const unsigned Asize, const crc_t Acrc, bool Anodump)
-	: rom(Aname, Asize, Acrc, Anodump), game(Agame)
+	: rom(Aname, Asize, Acrc, Anodump), game(intern(Agame))
 {
 }
 
 gamerom::gamerom(const std::string& Agame, const rom& Arom)
-	: rom(Arom), game(Agame)
+	: rom(Arom), game(intern(Agame))
 {
 }
 
@@ -98,6 +101,16 @@ gamerom::~gamerom()
 
 void gamerom::game_set(const string& Agame)
 {
-	game = Agame;
+	game = intern(Agame);
+}
+
+void gamerom_by_crc_index::sort()
+{
+	stable_sort(data.begin(), data.end(), gamerom_by_crc_less());
+}
+
+pair<gamerom_by_crc_index::const_iterator, gamerom_by_crc_index::const_iterator> gamerom_by_crc_index::equal_range(const gamerom& A) const
+{
+	return std::equal_range(data.begin(), data.end(), A, gamerom_by_crc_less());
 }
 
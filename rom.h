@@ -22,6 +22,8 @@
 #define __ROM_H
 
 #include "file.h"
+#include "intern.h"
+#include "flatset.h"
 
 #include <set>
 #include <vector>
@@ -29,7 +31,7 @@
 
 class rom {
 protected:
-	std::string name;
+	intern_t name;
 	unsigned size;
 	crc_t crc;
 	bool nodump;
@@ -39,7 +41,7 @@ public:
 	rom(const rom&);
 	~rom();
 
-	const std::string& name_get() const { return name; }
+	const std::string& name_get() const { return intern_get(name); }
 	void name_set(const std::string& Aname);
 
 	crc_t crc_get() const { return crc; }
@@ -70,8 +72,8 @@ struct rom_by_name_less {
 };
 
 typedef std::list<rom> rom_container;
-typedef std::set<rom, rom_by_name_less> rom_by_name_set;
-typedef std::set<rom, rom_by_crc_less> rom_by_crc_set;
+typedef flat_set<rom, rom_by_name_less> rom_by_name_set;
+typedef flat_set<rom, rom_by_crc_less> rom_by_crc_set;
 
 inline bool operator==(const rom_by_name_set& A, const rom_by_name_set& B)
 {
@@ -80,7 +82,7 @@ inline bool operator==(const rom_by_name_set& A, const rom_by_name_set& B)
 
 class gamerom : public rom {
 protected:
-	std::string game;
+	intern_t game;
 public:
 	gamerom();
 	gamerom(const std::string& Agame, const std::string& Aname, unsigned Asize, crc_t Acrc, bool Anodump);
@@ -89,7 +91,7 @@ public:
 	~gamerom();
 
 	void game_set(const std::string& Agame);
-	const std::string& game_get() const { return game; }
+	const std::string& game_get() const { return intern_get(game); }
 };
 
 struct gamerom_by_crc_less {
@@ -101,7 +103,24 @@ struct gamerom_by_crc_less {
 	}
 };
 
-typedef std::multiset<gamerom, gamerom_by_crc_less> gamerom_by_crc_multiset;
+/**
+ * Index of the roms of all the games by crc.
+ * It's filled with insert(), then sorted with sort(), and then only searched.
+ * Roms with the same crc and size are kept in the insertion order.
+ */
+class gamerom_by_crc_index {
+	std::vector<gamerom> data;
+public:
+	typedef std::vector<gamerom>::const_iterator const_iterator;
+
+	const_iterator begin() const { return data.begin(); }
+	const_iterator end() const { return data.end(); }
+	unsigned size() const { return data.size(); }
+
+	void insert(const gamerom& A) { data.push_back(A); }
+	void sort();
+	std::pair<const_iterator, const_iterator> equal_range(const gamerom& A) const;
+};
 
 #endif
 
@@ -26,15 +26,23 @@
 #include "operatio.h"
 #include "output.h"
 #include "analyze.h"
+#include "thread.h"
+#include "cache.h"
+#include "plan.h"
+#include "stats.h"
 #include "lib/readinfo.h"
 
 #include <fstream>
 #include <iomanip>
 #include <sstream>
+#include <map>
+#include <set>
 
 using namespace std;
 
 void read_dir(const string& path, filepath_container& ds, bool recursive, const string& ext) {
+	stats_phase sp(stats_phase_dir);
+
 	DIR* dir = opendir(path.c_str());
 	if (!dir)
 		throw error() << "Failed open on dir " << path;
@@ -64,39 +72,111 @@ void read_dir(const string& path, filepath_container& ds, bool recursive, const
 	closedir(dir);
 }
 
-void read_zip(const string& path, ziparchive& zar, zip_type type, bool ignore_error, bool rename_error) {
+class read_zip_job : public thread_job {
+	ziprom& z;
+	zip_cent cent;
+	bool updated;
+	bool verify;
+	list<string> report; // errors found by the verify
+public:
+	read_zip_job(ziprom& Az, bool Averify) : z(Az), updated(false), verify(Averify) { }
+	void run() {
+		updated = z.open(cent);
+		if (verify)
+			z.verify(report);
+	}
+
+	zip_cent& cent_get() { return cent; }
+	bool is_updated() const { return updated; }
+	const list<string>& report_get() const { return report; }
+};
+
+void read_zip(const string& path, ziparchive& zar, zipcache& cache, zip_type type, bool ignore_error, bool rename_error, bool verify) {
+	stats_phase sp(stats_phase_zip_open);
+
 	filepath_container ds;
 
 	read_dir(path, ds, false, ".zip");
+	cache.dir_read(path);
 
-	for(filepath_container::iterator i=ds.begin();i!=ds.end();++i) {
-		ziparchive::iterator j;
+	// open all the zips concurrently
+	zipromcontainer zs;
+	vector<read_zip_job*> js;
 
-		try {
-			j = zar.open_and_insert(ziprom(i->file_get(), type, true));
-		} catch (error_invalid& e) {
-			if (ignore_error) {
-				cerr << "warning: damaged zip " << i->file_get() << "\n";
-				cerr << "warning: " << e << "\n";
-				cerr << "warning: ignoring it and resuming\n";
-			} else if (rename_error) {
-				cerr << "warning: damaged zip " << i->file_get() << "\n";
-				cerr << "warning: " << e << "\n";
+	{
+		unsigned count = thread_count_get();
+		if (count > ds.size())
+			count = ds.size();
+
+		thread_pool pool(count);
+
+		for(filepath_container::iterator i=ds.begin();i!=ds.end();++i) {
+			ziprom& z = *zs.insert(zs.end(), ziprom(i->file_get(), type, true));
+			read_zip_job* j = new read_zip_job(z, verify);
+			js.insert(js.end(), j);
+			cache.get(i->file_get(), j->cent_get());
+			pool.push(j);
+		}
+
+		pool.wait();
+	}
+
+	// insert them in the directory order
+	try {
+		filepath_container::iterator i = ds.begin();
+		zipromcontainer::iterator z = zs.begin();
+		for(unsigned k=0;k<js.size();++k) {
+			zipromcontainer::iterator next = z;
+			++next;
+
+			try {
+				js[k]->rethrow();
+
+				if (js[k]->is_updated())
+					cache.set(i->file_get(), js[k]->cent_get());
+
+				for(list<string>::const_iterator j=js[k]->report_get().begin();j!=js[k]->report_get().end();++j) {
+					cerr << "warning: verify failed in zip " << i->file_get() << "\n";
+					cerr << "warning: " << *j << "\n";
+				}
+
+				zar.insert(zs, z);
+			} catch (error_invalid& e) {
+				cache.erase(i->file_get());
+
+				if (ignore_error) {
+					cerr << "warning: damaged zip " << i->file_get() << "\n";
+					cerr << "warning: " << e << "\n";
+					cerr << "warning: ignoring it and resuming\n";
+				} else if (rename_error) {
+					cerr << "warning: damaged zip " << i->file_get() << "\n";
+					cerr << "warning: " << e << "\n";
 
 #if HAVE_LONG_FNAME
-				string reject = i->file_get() + ".damaged";
+					string reject = i->file_get() + ".damaged";
 #else
-				string reject = file_basepath(i->file_get()) + ".bad";
+					string reject = file_basepath(i->file_get()) + ".bad";
 #endif
 
-				cerr << "warning: renaming it to " << reject << " and resuming\n";
+					cerr << "warning: renaming it to " << reject << " and resuming\n";
 
-				file_move(i->file_get(), reject);
-			} else {
-				throw e << " opening zip " << i->file_get();
+					file_move(i->file_get(), reject);
+				} else {
+					throw e << " opening zip " << i->file_get();
+				}
 			}
+
+			z = next;
+			++i;
 		}
+	} catch (...) {
+		for(unsigned k=0;k<js.size();++k)
+			delete js[k];
+		throw;
 	}
+
+	for(unsigned k=0;k<js.size();++k)
+		delete js[k];
 }
 
 // ---------------------------------------------------------------------------
@@ -129,6 +209,21 @@ struct rom_stat_t {
 	rom_by_name_set nodump_miss; // nodump missing
 };
 
+/**
+ * Set of roms filled in any order.
+ * Inserting in a flat set out of order moves all the following elements.
+ */
+typedef set<rom, rom_by_name_less> rom_by_name_tree;
+
+/**
+ * Copy the roms already sorted, appending them at the end.
+ */
+static void stat_rom_copy(rom_by_name_set& dst, const rom_by_name_tree& src)
+{
+	for(rom_by_name_tree::const_iterator i=src.begin();i!=src.end();++i)
+		dst.insert(dst.end(), *i);
+}
+
 void stat_rom_zip(
 	const ziprom& zd,
 	const game& gam,
@@ -138,6 +233,13 @@ void stat_rom_zip(
 	// setup
 	rom_by_name_set b = gam.rs_get();
 
+	// found in the zip order, and copied sorted at the end
+	rom_by_name_tree rom_equal;
+	rom_by_name_tree unk_binary;
+	rom_by_name_tree unk_text;
+	rom_by_name_tree unk_garbage;
+	rom_by_name_tree nodump_equal;
+
 	for(ziprom::const_iterator z=zd.begin();z!=zd.end();++z) {
 		// search for name
 		rom_by_name_set::iterator i = b.find(rom(z->name_get(), 0, 0, false));
@@ -148,19 +250,19 @@ void stat_rom_zip(
 			analyze_type t = ana(z->name_get(), z->uncompressed_size_get(), z->crc_get());
 			switch (t) {
 				case analyze_text :
-					result.unk_text.insert(r);
+					unk_text.insert(r);
 					break;
 				case analyze_binary :
-					result.unk_binary.insert(r);
+					unk_binary.insert(r);
 					break;
 				case analyze_garbage :
-					result.unk_garbage.insert(r);
+					unk_garbage.insert(r);
 					break;
 			}
 		} else { // if name know
 			if (i->nodump_get()) {
-				if (z->uncompressed_size_get() == i->size_get() && z->crc_get() == i->crc_get()) {
-					result.nodump_equal.insert(*i);
+				if (!z->is_damaged() && z->uncompressed_size_get() == i->size_get() && z->crc_get() == i->crc_get()) {
+					nodump_equal.insert(*i);
 				} else {
 					rom_bad r;
 					r.r = *i;
@@ -169,10 +271,10 @@ void stat_rom_zip(
 					result.nodump_bad.insert(result.nodump_bad.end(), r);
 				}
 			} else {
-				if (z->uncompressed_size_get() == i->size_get() && z->crc_get() == i->crc_get()) {
-					result.rom_equal.insert(*i);
+				if (!z->is_damaged() && z->uncompressed_size_get() == i->size_get() && z->crc_get() == i->crc_get()) {
+					rom_equal.insert(*i);
 				} else {
-					// rom is wrong
+					// rom is wrong, or damaged
 					rom_bad r;
 					r.r = *i;
 					r.bad_size = z->uncompressed_size_get();
@@ -186,6 +288,12 @@ void stat_rom_zip(
 		}
 	}
 
+	stat_rom_copy(result.rom_equal, rom_equal);
+	stat_rom_copy(result.unk_binary, unk_binary);
+	stat_rom_copy(result.unk_text, unk_text);
+	stat_rom_copy(result.unk_garbage, unk_garbage);
+	stat_rom_copy(result.nodump_equal, nodump_equal);
+
 	for(rom_by_name_set::iterator i=b.begin();i!=b.end();++i) {
 		if (i->nodump_get()) {
 			result.nodump_miss.insert(*i);
@@ -268,15 +376,27 @@ void disk_stat(
 // ----------------------------------------------------------------------------
 // add a new rom set
 
+/**
+ * Schedule the add of a rom from another zip.
+ */
+void rom_add_plan(ziprom_add_container& adds, const ziprom::const_iterator& entry, const string& name)
+{
+	ziprom_add a;
+	a.entry = entry;
+	a.name = name;
+	adds.insert(adds.end(), a);
+}
+
 void rom_add(
 	const operation& oper,
 	ziprom& z,
 	const game& g, 
 	const ziparchive& zar,
-	gamerom_by_crc_multiset& rcb,
+	gamerom_by_crc_index& rcb,
 	output& out) 
 {
 	bool title = false; // true if is printed the zip file name
+	ziprom_add_container adds; // roms to add, executed at the end
 
 	rom_by_name_set good;
 	rom_by_name_set miss_unique;
@@ -284,7 +404,7 @@ void rom_add(
 
 	// split the roms in shared and unique
 	for(rom_by_name_set::iterator i=g.rs_get().begin();i!=g.rs_get().end();++i) {
-		pair<gamerom_by_crc_multiset::iterator,gamerom_by_crc_multiset::iterator> range;
+		pair<gamerom_by_crc_index::const_iterator,gamerom_by_crc_index::const_iterator> range;
 
 		range = rcb.equal_range(gamerom("",*i));
 
@@ -313,10 +433,12 @@ void rom_add(
 			ziparchive::const_iterator j = zar.find_exclude(z, i->size_get(), i->crc_get(), k);
 			if (j!=zar.end()) {
 				if (oper.active_add() && !z.is_readonly()) {
-					z.add(k, i->name_get());
+					if (out.plan_get())
+						out.plan_get()->add(z.file_get(), i->name_get(), *k, "");
+					rom_add_plan(adds, k, i->name_get());
 					good.insert(*i);
 					added = true;
-				} 
+				}
 				if (oper.output_add()) {
 					out.title("rom_zip", title, z.file_get());
 					out.cmd_rom("rom_good", "add", *i) << " " << k->parentname_get() << "/" << k->name_get() << "\n";
@@ -350,7 +472,9 @@ void rom_add(
 				ziparchive::const_iterator j = zar.find_exclude(z, i->size_get(), i->crc_get(), k);
 				if (j!=zar.end()) {
 					if (oper.active_add() && !z.is_readonly()) {
-						z.add(k, i->name_get());
+						if (out.plan_get())
+							out.plan_get()->add(z.file_get(), i->name_get(), *k, "");
+						rom_add_plan(adds, k, i->name_get());
 						good.insert(*i);
 						added = true;
 					}
@@ -374,6 +498,9 @@ void rom_add(
 
 	// if zip created with almost one good rom
 	if (!good.empty()) {
+		// add all the roms, reading each source zip only once
+		z.add(adds);
+
 		// update the zip
 		z.save();
 		z.unload();
@@ -382,8 +509,12 @@ void rom_add(
 			// get file information
 			struct stat fst;
 			string path = z.file_get();
-			if (stat(path.c_str(), &fst) != 0)
-				throw error() << "Failed stat file " << z.file_get();
+			if (stat(path.c_str(), &fst) != 0) {
+				// a zip changed only in memory may not exist yet
+				if (ziprom::save_get())
+					throw error() << "Failed stat file " << z.file_get();
+				fst.st_size = 0;
+			}
 
 			// if no rom is missing
 			if (miss_unique.empty() && miss_shared.empty()) {
@@ -423,16 +554,19 @@ bool rom_scan_add(
 			if (s_crc == j->crc_get() && s_size == j->size_get()) {
 				if (oper.active_fix() && !z.is_readonly()) {
 					// rename the rom
+					if (out.plan_get())
+						out.plan_get()->rename(z.file_get(), s_name, *z.find(j->name_get()), reject.file_get());
 					z.rename(j->name_get(), s_name, reject);
 					added = true;
-
-					// remove from the remove bag
-					rremove.erase(j);
 				}
 				if (oper.output_fix()) {
 					out.title("rom_zip", title, z.file_get());
 					out.cmd_rom(s_add, s_cmd, s_name, s_size, s_crc) << " " << j->name_get() << "\n";
 				}
+				if (added) {
+					// remove from the remove bag, after the last use of the iterator
+					rremove.erase(j);
+				}
 				found = true;
 
 				// interrupt
@@ -443,63 +577,59 @@ bool rom_scan_add(
 
 	if (!found) {
 		// check if it's present in the same zip
-		for(zip::iterator j=z.begin();j!=z.end();++j) {
-			// compare crc, size
-			if (s_crc == j->crc_get() && s_size == j->uncompressed_size_get()) {
-				string name = j->name_get();
-				if (s_name != name) {
-					// the name must be different (it always be)
-					if (oper.active_fix() && !z.is_readonly()) {
-						// add the rom
-						// (this operation is safe, because the zip iterator is a list)
-						z.add(j, s_name, reject);
-						added = true;
-					}
-				} else {
-					throw error() << "Failed internal check";
-				}
-				if (oper.output_fix()) {
-					out.title("rom_zip", title, z.file_get());
-					out.cmd_rom(s_add, s_cmd, s_name, s_size, s_crc) << " " << name << "\n";
+		ziprom::iterator j = z.find(s_size, s_crc);
+		if (j!=z.end()) {
+			string name = j->name_get();
+			if (s_name != name) {
+				// the name must be different (it always be)
+				if (oper.active_fix() && !z.is_readonly()) {
+					// add the rom
+					// (this operation is safe, because the zip iterator is a list)
+					if (out.plan_get())
+						out.plan_get()->add(z.file_get(), s_name, *j, reject.file_get());
+					z.add(j, s_name, reject);
+					added = true;
 				}
-				found = true;
-
-				// interrupt
-				break;
+			} else {
+				throw error() << "Failed internal check";
 			}
+			if (oper.output_fix()) {
+				out.title("rom_zip", title, z.file_get());
+				out.cmd_rom(s_add, s_cmd, s_name, s_size, s_crc) << " " << name << "\n";
+			}
+			found = true;
 		}
 	}
 
 	if (!found) {
 		// check if it's present in the reject zip
-		for(zip::iterator j=reject.begin();j!=reject.end();++j) {
-			// compare crc, size
-			if (s_crc == j->crc_get() && s_size == j->uncompressed_size_get()) {
-				string name = j->name_get();
-				if (s_name != name) {
-					// the name must be different (it may not be)
-					if (oper.active_fix() && !z.is_readonly()) {
-						// add the rom
-						// (this operation is safe, because the zip iterator is a list)
-						z.add(j, s_name, reject);
-						added = true;
-					}
-				} else {
-					if (oper.active_fix() && !z.is_readonly()) {
-						// swap the roms
-						z.swap(s_name, reject, j);
-						added = true;
-					}
+		ziprom::iterator j = reject.find(s_size, s_crc);
+		if (j!=reject.end()) {
+			string name = j->name_get();
+			if (s_name != name) {
+				// the name must be different (it may not be)
+				if (oper.active_fix() && !z.is_readonly()) {
+					// add the rom
+					// (this operation is safe, because the zip iterator is a list)
+					if (out.plan_get())
+						out.plan_get()->add(z.file_get(), s_name, *j, reject.file_get());
+					z.add(j, s_name, reject);
+					added = true;
 				}
-				if (oper.output_fix()) {
-					out.title("rom_zip", title, z.file_get());
-					out.cmd_rom(s_add, s_cmd, s_name, s_size, s_crc) << " " << reject.file_get() << "/" << name << "\n";
+			} else {
+				if (oper.active_fix() && !z.is_readonly()) {
+					// swap the roms
+					if (out.plan_get())
+						out.plan_get()->add(z.file_get(), s_name, *j, reject.file_get());
+					z.swap(s_name, reject, j);
+					added = true;
 				}
-				found = true;
-
-				// interrupt
-				break;
 			}
+			if (oper.output_fix()) {
+				out.title("rom_zip", title, z.file_get());
+				out.cmd_rom(s_add, s_cmd, s_name, s_size, s_crc) << " " << reject.file_get() << "/" << name << "\n";
+			}
+			found = true;
 		}
 	}
 
@@ -509,6 +639,8 @@ bool rom_scan_add(
 		ziparchive::const_iterator j = zar.find_exclude(z, s_size, s_crc, k);
 		if (j!=zar.end()) {
 			if (oper.active_fix() && !z.is_readonly()) {
+				if (out.plan_get())
+					out.plan_get()->add(z.file_get(), s_name, *k, reject.file_get());
 				z.add(k, s_name, reject);
 				added = true;
 			}
@@ -523,6 +655,10 @@ bool rom_scan_add(
 	return added;
 }
 
+/**
+ * Scan a rom zip.
+ * \param st Status of the zip computed by stat_rom_zip(). It's updated with the changes.
+ */
 void rom_scan(
 	const operation& oper,
 	ziprom& z,
@@ -530,16 +666,12 @@ void rom_scan(
 	const game& gam,
 	const ziparchive& zar,
 	output& out,
-	const analyze& ana)
+	rom_stat_t& st)
 {
 	bool title = false; // true if is printed the zip file name
 
 	reject.open();
 
-	// get rom status
-	rom_stat_t st;
-	stat_rom_zip(z, gam, st, ana);
-
 	// for any missing rom
 	rom_by_name_set tmp_rom_miss; // missing rom
 	for(rom_by_name_set::iterator i=st.rom_miss.begin();i!=st.rom_miss.end();++i) {
@@ -589,6 +721,8 @@ void rom_scan(
 
 	for(rom_by_name_set::iterator i=st.unk_binary.begin();i!=st.unk_binary.end();++i) {
 		if (oper.active_remove_binary() && !z.is_readonly()) {
+			if (out.plan_get())
+				out.plan_get()->remove(z.file_get(), *z.find(i->name_get()), reject.file_get());
 			z.remove(i->name_get(), reject);
 		}
 		if (oper.output_remove_binary()) {
@@ -599,6 +733,8 @@ void rom_scan(
 
 	for(rom_by_name_set::iterator i=st.unk_text.begin();i!=st.unk_text.end();++i) {
 		if (oper.active_remove_text() && !z.is_readonly()) {
+			if (out.plan_get())
+				out.plan_get()->remove(z.file_get(), *z.find(i->name_get()), reject.file_get());
 			z.remove(i->name_get(), reject);
 		}
 		if (oper.output_remove_text()) {
@@ -609,6 +745,8 @@ void rom_scan(
 
 	for(rom_by_name_set::iterator i=st.unk_garbage.begin();i!=st.unk_garbage.end();++i) {
 		if (oper.active_remove_garbage() && !z.is_readonly()) {
+			if (out.plan_get())
+				out.plan_get()->remove(z.file_get(), *z.find(i->name_get()), "");
 			z.remove(i->name_get());
 		}
 		if (oper.output_remove_garbage()) {
@@ -778,7 +916,8 @@ void disk_scan(
 
 void unknown_scan(
 	ziprom& z,
-	const ziparchive& zar)
+	const ziparchive& zar,
+	output& out)
 {
 	// create the list of all the roms to remove
 	rom_by_name_set remove;
@@ -794,6 +933,8 @@ void unknown_scan(
 		ziparchive::const_iterator j = zar.find(i->size_get(), i->crc_get(), zip_own, k);
 		if (j != zar.end()) {
 			// if present remove the duplicate in the unknown set
+			if (out.plan_get())
+				out.plan_get()->remove(z.file_get(), *z.find(i->name_get()), "");
 			z.remove(i->name_get());
 		}
 	}
@@ -825,6 +966,8 @@ void rom_move(
 
 	for(rom_by_name_set::iterator i=remove.begin();i!=remove.end();++i) {
 		if (oper.active_move() && !z.is_readonly()) {
+			if (out.plan_get())
+				out.plan_get()->remove(z.file_get(), *z.find(i->name_get()), reject.file_get());
 			z.remove(i->name_get(), reject);
 		}
 		if (oper.output_move()) {
@@ -1046,46 +1189,55 @@ void disk_report(
 // ---------------------------------------------------------------------------
 // load
 
-void all_rom_load(ziparchive& zar, const config& cfg)
+void all_rom_load(ziparchive& zar, zipcache& cache, const config& cfg, bool verify)
 {
 	// read own zip
 	for(filepath_container::const_iterator i=cfg.rompath_get().begin();i!=cfg.rompath_get().end();++i) {
-		read_zip(i->file_get(), zar, zip_own, false, true);
+		read_zip(i->file_get(), zar, cache, zip_own, false, true, verify);
 	}
 
 	// read unknown zip
-	read_zip(cfg.romunknownpath_get().file_get(), zar, zip_unknown, false, true);
+	read_zip(cfg.romunknownpath_get().file_get(), zar, cache, zip_unknown, false, true, verify);
 
 	// read import zip
 	for(filepath_container::const_iterator i=cfg.romreadonlytree_get().begin();i!=cfg.romreadonlytree_get().end();++i) {
-		read_zip(i->file_get(), zar, zip_import, true, false);
+		read_zip(i->file_get(), zar, cache, zip_import, true, false, verify);
 	}
 }
 
-void set_rom_load(ziparchive& zar, const config& cfg)
+void set_rom_load(ziparchive& zar, zipcache& cache, const config& cfg, bool verify)
 {
 	for(filepath_container::const_iterator i=cfg.rompath_get().begin();i!=cfg.rompath_get().end();++i) {
-		read_zip(i->file_get(), zar, zip_own, false, true);
+		read_zip(i->file_get(), zar, cache, zip_own, false, true, verify);
 	}
 }
 
-void set_sample_load(filepath_container& zar, const config& cfg)
+void set_sample_load(filepath_container& zar, zipcache& cache, const config& cfg)
 {
+	stats_phase sp(stats_phase_zip_open);
+
 	filepath_container ds;
 
 	for(filepath_container::const_iterator i=cfg.samplepath_get().begin();i!=cfg.samplepath_get().end();++i) {
 		read_dir(i->file_get(), ds, false, ".zip");
+		cache.dir_read(i->file_get());
 	}
 
 	for(filepath_container::const_iterator i=ds.begin();i!=ds.end();++i) {
 		try {
 			zip z(i->file_get());
 
-			z.open(); // detect damaged archives
+			zip_cent cent;
+			cache.get(i->file_get(), cent);
+
+			if (z.open(cent)) // detect damaged archives
+				cache.set(i->file_get(), cent);
 
 			zar.insert(zar.end(), *i);
 
 		} catch (error_invalid& e) {
+			cache.erase(i->file_get());
+
 			cerr << "warning: damaged zip " << i->file_get() << "\n";
 			cerr << "warning: " << e << "\n";
 
@@ -1104,6 +1256,8 @@ void set_sample_load(filepath_container& zar, const config& cfg)
 
 void set_disk_load(filepath_container& zar, const config& cfg)
 {
+	stats_phase sp(stats_phase_zip_open);
+
 	filepath_container ds;
 
 	for(filepath_container::const_iterator i=cfg.diskpath_get().begin();i!=cfg.diskpath_get().end();++i) {
@@ -1133,35 +1287,417 @@ void set_disk_load(filepath_container& zar, const config& cfg)
 	}
 }
 
+// ----------------------------------------------------------------------------
+// prefetch
+
+/**
+ * Default memory used to read ahead the zips, in bytes.
+ */
+#define ROM_PREFETCH_BUDGET (64*1024*1024ULL)
+
+/**
+ * Check if the scan of a zip is going to rewrite it.
+ * It may also report zips that are not changed, if the missing roms are not found.
+ */
+bool rom_scan_is_modified(const operation& oper, const ziprom& z, const rom_stat_t& st)
+{
+	if (z.is_readonly())
+		return false;
+
+	if (oper.active_fix() && (!st.rom_miss.empty() || !st.rom_bad.empty()))
+		return true;
+	if (oper.active_remove_binary() && !st.unk_binary.empty())
+		return true;
+	if (oper.active_remove_text() && !st.unk_text.empty())
+		return true;
+	if (oper.active_remove_garbage() && !st.unk_garbage.empty())
+		return true;
+
+	return false;
+}
+
+class rom_prefetch_job : public thread_job {
+	string path;
+public:
+	rom_prefetch_job(const string& Apath) : path(Apath) { }
+	void run() {
+		file_prefetch(path);
+	}
+};
+
+/**
+ * Max number of zips checked ahead, and not yet processed.
+ */
+#define ROM_PREFETCH_CHECK 4096
+
+/**
+ * Read ahead the zips that the scan is going to rewrite.
+ * The zips are read in background in the system cache, while the
+ * current one is processed. The size of the zips read ahead, and not
+ * yet processed, is limited by the budget.
+ * The status of the zips checked is kept, and used later by the scan.
+ */
+class rom_prefetch {
+	const operation& oper;
+	gamearchive& gar;
+	ziparchive& zar;
+	const analyze& ana;
+	unsigned long long budget;
+	unsigned long long ahead; // size of the zips read ahead, and not yet processed
+	ziparchive::iterator next; // next zip to check
+	list<pair<const ziprom*, unsigned> > window; // zips read ahead
+	list<pair<const ziprom*, rom_stat_t*> > checked; // status of the zips checked, and not yet processed
+	vector<rom_prefetch_job*> js;
+	thread_pool* pool;
+
+	rom_prefetch(const rom_prefetch&);
+	rom_prefetch& operator=(const rom_prefetch&);
+public:
+	rom_prefetch(const operation& Aoper, gamearchive& Agar, ziparchive& Azar, const analyze& Aana, unsigned long long Abudget);
+	~rom_prefetch();
+
+	void fill();
+	rom_stat_t* take(const ziprom& z);
+	void done(const ziprom& z);
+};
+
+rom_prefetch::rom_prefetch(const operation& Aoper, gamearchive& Agar, ziparchive& Azar, const analyze& Aana, unsigned long long Abudget)
+	: oper(Aoper), gar(Agar), zar(Azar), ana(Aana), budget(Abudget), ahead(0), pool(0)
+{
+	next = zar.begin();
+
+	// a single worker thread executes the jobs directly in push()
+#if HAVE_PTHREAD
+	if (budget != 0)
+		pool = new thread_pool(2);
+#endif
+}
+
+rom_prefetch::~rom_prefetch()
+{
+	if (pool) {
+		pool->wait();
+		delete pool;
+	}
+
+	for(unsigned i=0;i<js.size();++i)
+		delete js[i];
+
+	for(list<pair<const ziprom*, rom_stat_t*> >::iterator i=checked.begin();i!=checked.end();++i)
+		delete i->second;
+}
+
+/**
+ * Read ahead the next zips, until the budget is used.
+ */
+void rom_prefetch::fill()
+{
+	if (!pool)
+		return;
+
+	for(;next!=zar.end();++next) {
+		if (next->type_get() != zip_own)
+			continue;
+
+		gamearchive::iterator g = gar.find(game(file_basename(next->file_get())));
+		if (g == gar.end() || !g->is_romset_required())
+			continue;
+
+		// the zip stopped by the budget is already checked
+		if (checked.empty() || checked.back().first != &*next) {
+			if (checked.size() >= ROM_PREFETCH_CHECK)
+				break;
+
+			rom_stat_t* st = new rom_stat_t;
+			checked.insert(checked.end(), pair<const ziprom*, rom_stat_t*>(&*next, st));
+			stat_rom_zip(*next, *g, *st, ana);
+		}
+
+		if (!rom_scan_is_modified(oper, *next, *checked.back().second))
+			continue;
+
+		unsigned size;
+		try {
+			size = file_size(next->file_get());
+		} catch (error&) {
+			// ignore, the error is reported by the scan
+			continue;
+		}
+
+		// zips bigger than the budget are not read ahead
+		if (size > budget)
+			continue;
+
+		// wait that the processed zips free the budget
+		if (ahead + size > budget)
+			break;
+
+		rom_prefetch_job* j = new rom_prefetch_job(next->file_get());
+		js.insert(js.end(), j);
+		pool->push(j);
+
+		window.insert(window.end(), pair<const ziprom*, unsigned>(&*next, size));
+		ahead += size;
+	}
+}
+
+/**
+ * Get the status of a zip already checked.
+ * The zips are processed in the archive order, and the status of the
+ * previous zips is discarded.
+ * \return The status, owned by the caller, or 0 if not checked.
+ */
+rom_stat_t* rom_prefetch::take(const ziprom& z)
+{
+	list<pair<const ziprom*, rom_stat_t*> >::iterator i = checked.begin();
+	while (i != checked.end() && i->first != &z)
+		++i;
+
+	if (i == checked.end()) {
+		// all the zips checked precede this one
+		for(i=checked.begin();i!=checked.end();++i)
+			delete i->second;
+		checked.clear();
+		return 0;
+	}
+
+	while (checked.front().first != &z) {
+		delete checked.front().second;
+		checked.pop_front();
+	}
+
+	rom_stat_t* st = checked.front().second;
+	checked.pop_front();
+
+	return st;
+}
+
+/**
+ * Release the budget of a processed zip.
+ */
+void rom_prefetch::done(const ziprom& z)
+{
+	if (!window.empty() && window.front().first == &z) {
+		ahead -= window.front().second;
+		window.pop_front();
+	}
+}
+
+// ----------------------------------------------------------------------------
+// parallel scan
+
+/**
+ * Max number of zips scanned concurrently, before updating the archive.
+ */
+#define ROM_SCAN_BATCH 256
+
+/**
+ * Check if the scan of a zip uses only the zip itself, and its reject zip.
+ * If no rom is missing or wrong, the other zips are never searched.
+ */
+bool rom_scan_is_local(const rom_stat_t& st)
+{
+	return st.rom_miss.empty() && st.rom_bad.empty();
+}
+
+class rom_scan_job : public thread_job {
+	const operation& oper;
+	ziprom& z;
+	ziprom reject;
+	const game& gam;
+	const ziparchive& zar;
+	ostringstream os; // output of the scan, printed later in order
+	ostringstream log; // log of the changes, printed later in order
+	plan pl; // plan of the changes, appended later in order
+	output out;
+	rom_stat_t* st; // status of the zip, owned by the job
+public:
+	rom_scan_job(const operation& Aoper, ziprom& Az, const ziprom& Areject, const game& Agam, const ziparchive& Azar, rom_stat_t* Ast, bool Aplan)
+		: oper(Aoper), z(Az), reject(Areject), gam(Agam), zar(Azar), out(os), st(Ast)
+	{
+		if (Aplan)
+			out.plan_set(&pl);
+	}
+
+	~rom_scan_job()
+	{
+		delete st;
+	}
+
+	void run() {
+		ostream& prev = z.log();
+		z.log_set(log);
+		reject.log_set(log);
+		try {
+			rom_scan(oper, z, reject, gam, zar, out, *st);
+		} catch (...) {
+			z.log_set(prev);
+			throw;
+		}
+		z.log_set(prev);
+	}
+
+	ziprom& zip_get() { return z; }
+	const ziprom& reject_get() const { return reject; }
+	string output_get() const { return os.str(); }
+	string log_get() const { return log.str(); }
+	const plan& plan_get() const { return pl; }
+};
+
+/**
+ * Scan of the rom zips, with the same result of scanning them one at time.
+ * The zips that don't search other zips change only themselves, and their
+ * reject zip, and they are scanned concurrently. The others are scanned alone,
+ * when all the previous ones are completed. The reject zips are inserted in
+ * the archive, and the output is printed, in the original order.
+ */
+class rom_scan_engine {
+	const operation& oper;
+	ziparchive& zar;
+	const config& cfg;
+	output& out;
+	const analyze& ana;
+	rom_prefetch prefetch;
+	bool parallel;
+	vector<rom_scan_job*> js; // zips waiting for the scan
+
+	rom_scan_engine(const rom_scan_engine&);
+	rom_scan_engine& operator=(const rom_scan_engine&);
+public:
+	rom_scan_engine(const operation& Aoper, ziparchive& Azar, gamearchive& Agar, const config& Acfg, output& Aout, const analyze& Aana, unsigned long long Aprefetch_budget);
+	~rom_scan_engine();
+
+	void scan(ziprom& z, const game& gam);
+	void flush();
+};
+
+rom_scan_engine::rom_scan_engine(const operation& Aoper, ziparchive& Azar, gamearchive& Agar, const config& Acfg, output& Aout, const analyze& Aana, unsigned long long Aprefetch_budget)
+	: oper(Aoper), zar(Azar), cfg(Acfg), out(Aout), ana(Aana),
+	// read ahead only if some zip may be rewritten
+	prefetch(Aoper, Agar, Azar, Aana, Aoper.active_fix() || Aoper.active_remove_binary() || Aoper.active_remove_text() || Aoper.active_remove_garbage() ? Aprefetch_budget : 0)
+{
+	parallel = thread_count_get() > 1;
+}
+
+rom_scan_engine::~rom_scan_engine()
+{
+	for(unsigned k=0;k<js.size();++k)
+		delete js[k];
+}
+
+/**
+ * Scan a zip, or schedule it for a later concurrent scan.
+ */
+void rom_scan_engine::scan(ziprom& z, const game& gam)
+{
+	ziprom reject(cfg.romunknownpath_get().file_get() + "/" + gam.name_get() + ".zip", zip_unknown, false);
+
+	// the status is computed only once, by the read ahead or here
+	prefetch.fill();
+	rom_stat_t* st = prefetch.take(z);
+	if (!st) {
+		st = new rom_stat_t;
+		try {
+			stat_rom_zip(z, gam, *st, ana);
+		} catch (...) {
+			delete st;
+			throw;
+		}
+	}
+
+	bool local = parallel && rom_scan_is_local(*st);
+
+	// the scans searching other zips must see all the previous changes
+	if (!local) {
+		try {
+			flush();
+		} catch (...) {
+			delete st;
+			throw;
+		}
+	}
+
+	js.insert(js.end(), new rom_scan_job(oper, z, reject, gam, zar, st, out.plan_get() != 0));
+
+	if (!local || js.size() >= ROM_SCAN_BATCH)
+		flush();
+}
+
+/**
+ * Scan all the scheduled zips.
+ */
+void rom_scan_engine::flush()
+{
+	if (js.empty())
+		return;
+
+	// read ahead when no zip is changing
+	prefetch.fill();
+
+	{
+		unsigned count = thread_count_get();
+		if (count > js.size())
+			count = js.size();
+
+		thread_pool pool(count);
+
+		for(unsigned k=0;k<js.size();++k)
+			pool.push(js[k]);
+
+		pool.wait();
+	}
+
+	for(unsigned k=0;k<js.size();++k) {
+		out() << js[k]->output_get();
+		// the changes only in memory are not logged
+		if (ziprom::save_get())
+			cerr << js[k]->log_get();
+		if (out.plan_get())
+			out.plan_get()->append(js[k]->plan_get());
+
+		try {
+			js[k]->rethrow();
+		} catch (error& e) {
+			throw e << " scanning rom " << js[k]->zip_get().file_get();
+		}
+
+		prefetch.done(js[k]->zip_get());
+
+		zar.update(js[k]->reject_get());
+	}
+
+	for(unsigned k=0;k<js.size();++k)
+		delete js[k];
+	js.clear();
+}
+
 // ----------------------------------------------------------------------------
 // scan
 
-void all_rom_scan(const operation& oper, ziparchive& zar, gamearchive& gar, gamerom_by_crc_multiset& rcb, const config& cfg, output& out, const analyze& ana)
+void all_rom_scan(const operation& oper, ziparchive& zar, gamearchive& gar, gamerom_by_crc_index& rcb, const config& cfg, output& out, const analyze& ana, unsigned long long prefetch_budget)
 {
 	filepath_container unknown; // container of unknown zip
 
-	// scan zips
-	for(ziparchive::iterator i=zar.begin();i!=zar.end();++i) {
-		assert(i->is_open());
+	{
+		rom_scan_engine engine(oper, zar, gar, cfg, out, ana, prefetch_budget);
 
-		if (i->type_get() == zip_own) {
-			gamearchive::iterator g = gar.find(game(file_basename(i->file_get())));
+		// scan zips
+		for(ziparchive::iterator i=zar.begin();i!=zar.end();++i) {
+			assert(i->is_open());
 
-			if (g == gar.end() || !g->is_romset_required()) {
-				// insert in the unknown set, processed later
-				unknown.insert(unknown.end(), filepath(i->file_get()));
-			} else {
-				ziprom reject(cfg.romunknownpath_get().file_get() + "/" + g->name_get() + ".zip", zip_unknown, false);
+			if (i->type_get() == zip_own) {
+				gamearchive::iterator g = gar.find(game(file_basename(i->file_get())));
 
-				try {
-					rom_scan(oper, *i, reject, *g, zar, out, ana);
-				} catch (error& e) {
-					throw e << " scanning rom " << i->file_get();
+				if (g == gar.end() || !g->is_romset_required()) {
+					// insert in the unknown set, processed later
+					unknown.insert(unknown.end(), filepath(i->file_get()));
+				} else {
+					engine.scan(*i, *g);
 				}
-
-				zar.update(reject);
 			}
 		}
+
+		engine.flush();
 	}
 
 	// add zips
@@ -1209,8 +1745,10 @@ void all_rom_scan(const operation& oper, ziparchive& zar, gamearchive& gar, game
 	}
 }
 
-void set_rom_scan(const operation& oper, ziparchive& zar, gamearchive& gar, const config& cfg, output& out, const analyze& ana)
+void set_rom_scan(const operation& oper, ziparchive& zar, gamearchive& gar, const config& cfg, output& out, const analyze& ana, unsigned long long prefetch_budget)
 {
+	rom_scan_engine engine(oper, zar, gar, cfg, out, ana, prefetch_budget);
+
 	// scan zips
 	for(ziparchive::iterator i=zar.begin();i!=zar.end();++i) {
 		assert(i->is_open());
@@ -1221,18 +1759,12 @@ void set_rom_scan(const operation& oper, ziparchive& zar, gamearchive& gar, cons
 			if (g == gar.end() || !g->is_romset_required()) {
 				// ignored
 			} else {
-				ziprom reject(cfg.romunknownpath_get().file_get() + "/" + g->name_get() + ".zip", zip_unknown, false);
-
-				try {
-					rom_scan(oper, *i, reject, *g, zar, out, ana);
-				} catch (error& e) {
-					throw e << " scanning rom " << i->file_get();
-				}
-
-				zar.update(reject);
+				engine.scan(*i, *g);
 			}
 		}
 	}
+
+	engine.flush();
 }
 
 void all_sample_scan(const operation& oper, filepath_container& zar, gamearchive& gar, config& cfg, output& out, const analyze& ana)
@@ -1301,26 +1833,36 @@ void set_sample_scan(const operation& oper, filepath_container& zar, gamearchive
 	}
 }
 
-void all_disk_scan(const operation& oper, filepath_container& zar, gamearchive& gar, config& cfg, output& out, const analyze& ana)
+/**
+ * Index of the games by disk name.
+ * For every disk it contains the first game in name order that requires it,
+ * that is the game owning the disk file.
+ */
+typedef map<disk, gamearchive::const_iterator, disk_by_name_less> disk_owner_map;
+
+void disk_owner_build(const gamearchive& gar, disk_owner_map& owner)
+{
+	for(gamearchive::const_iterator g=gar.begin();g!=gar.end();++g) {
+		for(disk_by_name_set::const_iterator i=g->ds_get().begin();i!=g->ds_get().end();++i) {
+			// if already present, the first game is kept
+			owner.insert(disk_owner_map::value_type(*i, g));
+		}
+	}
+}
+
+void all_disk_scan(const operation& oper, filepath_container& zar, const disk_owner_map& owner, config& cfg, output& out, const analyze& ana)
 {
 	filepath_container unknown;
 
 	// scan zips
 	for(filepath_container::iterator i=zar.begin();i!=zar.end();++i) {
 		string name = file_basename(i->file_get());
-		gamearchive::iterator g;
-		for(g=gar.begin();g!=gar.end();++g) {
-			if (g->is_diskset_required()) {
-				disk_by_name_set::iterator i = g->ds_get().find(disk(name));
-				if (i != g->ds_get().end())
-					break;
-			}
-		}
-		if (g == gar.end()) {
+		disk_owner_map::const_iterator g = owner.find(disk(name));
+		if (g == owner.end()) {
 			unknown.insert(unknown.end(), filepath(i->file_get()));
 		} else {
 			try {
-				disk_scan(oper, i->file_get(), *g, out, ana);
+				disk_scan(oper, i->file_get(), *g->second, out, ana);
 			} catch (error& e) {
 				throw e << " scanning disk " << i->file_get();
 			}
@@ -1340,26 +1882,19 @@ void all_disk_scan(const operation& oper, filepath_container& zar, gamearchive&
 	}
 }
 
-void set_disk_scan(const operation& oper, filepath_container& zar, gamearchive& gar, config& cfg, output& out, const analyze& ana)
+void set_disk_scan(const operation& oper, filepath_container& zar, const disk_owner_map& owner, config& cfg, output& out, const analyze& ana)
 {
 	filepath_container unknown;
 
 	// scan zips
 	for(filepath_container::iterator i=zar.begin();i!=zar.end();++i) {
 		string name = file_basename(i->file_get());
-		gamearchive::iterator g;
-		for(g=gar.begin();g!=gar.end();++g) {
-			if (g->is_diskset_required()) {
-				disk_by_name_set::iterator i = g->ds_get().find(disk(name));
-				if (i != g->ds_get().end())
-					break;
-			}
-		}
-		if (g == gar.end()) {
+		disk_owner_map::const_iterator g = owner.find(disk(name));
+		if (g == owner.end()) {
 			unknown.insert(unknown.end(), filepath(i->file_get()));
 		} else {
 			try {
-				disk_scan(oper, i->file_get(), *g, out, ana);
+				disk_scan(oper, i->file_get(), *g->second, out, ana);
 			} catch (error& e) {
 				throw e << " scanning disk " << i->file_get();
 			}
@@ -1376,7 +1911,7 @@ void all_unknown_scan(ziparchive& zar, const config& cfg, output& out)
 
 		if (i->type_get() == zip_unknown && !i->is_readonly()) {
 			try {
-				unknown_scan(*i, zar);
+				unknown_scan(*i, zar, out);
 			} catch (error& e) {
 				throw e << " scanning zip " << i->file_get();
 			}
@@ -1421,22 +1956,15 @@ void report_sample_zip(const filepath_container& zar, gamearchive& gar, output&
 	}
 }
 
-void report_disk_zip(const filepath_container& zar, gamearchive& gar, output& out, bool verbose, const analyze& ana)
+void report_disk_zip(const filepath_container& zar, const disk_owner_map& owner, output& out, bool verbose, const analyze& ana)
 {
 	for(filepath_container::const_iterator i=zar.begin();i!=zar.end();++i) {
 		string name = file_basename(i->file_get());
-		gamearchive::iterator g;
-		for(g=gar.begin();g!=gar.end();++g) {
-			if (g->is_diskset_required()) {
-				disk_by_name_set::iterator i = g->ds_get().find(disk(name));
-				if (i != g->ds_get().end())
-					break;
-			}
-		}
-		if (g == gar.end()) {
+		disk_owner_map::const_iterator g = owner.find(disk(name));
+		if (g == owner.end()) {
 			// ignore
 		} else {
-			disk_report(i->file_get(), *g, out, verbose, ana);
+			disk_report(i->file_get(), *g->second, out, verbose, ana);
 		}
 	}
 }
@@ -1809,14 +2337,14 @@ void filt(gamearchive& gar, const string& filter)
 // ----------------------------------------------------------------------------
 // command
 
-void equal(const gamearchive& gar, gamerom_by_crc_multiset& rcb, ostream& out)
+void equal(const gamearchive& gar, gamerom_by_crc_index& rcb, ostream& out)
 {
 	unsigned equal = 0;
 	
-	gamerom_by_crc_multiset::const_iterator start = rcb.begin();
+	gamerom_by_crc_index::const_iterator start = rcb.begin();
 	while (start != rcb.end()) {
 		unsigned count = 1;
-		gamerom_by_crc_multiset::const_iterator end = start;
+		gamerom_by_crc_index::const_iterator end = start;
 		++end;
 		while (end!=rcb.end() && start->crc_get()==end->crc_get() && start->size_get()==end->size_get()) {
 			++end;
@@ -1852,31 +2380,68 @@ void equal(const gamearchive& gar, gamerom_by_crc_multiset& rcb, ostream& out)
 	out << "\n";
 }
 
-void ident_data(const string& file, crc_t crc, unsigned size, const gamearchive& gar, ostream& out)
+void ident_data(const string& file, crc_t crc, unsigned size, const gamearchive& gar, const gamerom_by_crc_index& rcb, ostream& out)
 {
 	out << file << "\n";
 
-	for(gamearchive::const_iterator i=gar.begin();i!=gar.end();++i) {
-		for(rom_by_name_set::const_iterator j=i->rs_get().begin();j!=i->rs_get().end();++j) {
-			if (j->crc_get()==crc && j->size_get()==size) {
-				out << "\t" << setw(8) << i->name_get().c_str() << " " << setw(12) << j->name_get().c_str() << " " << i->description_get() << "\n";
-			}
-		}
+	// the index keeps the order of the games and roms
+	pair<gamerom_by_crc_index::const_iterator, gamerom_by_crc_index::const_iterator> r = rcb.equal_range(gamerom("", "", size, crc, false));
+	for(gamerom_by_crc_index::const_iterator j=r.first;j!=r.second;++j) {
+		gamearchive::const_iterator i = gar.find(game(j->game_get()));
+		if (i == gar.end())
+			throw error() << "Failed internal check on the game " << j->game_get();
+
+		out << "\t" << setw(8) << i->name_get().c_str() << " " << setw(12) << j->name_get().c_str() << " " << i->description_get() << "\n";
 	}
 }
 
-void ident_zip(const string& file, const gamearchive& gar, ostream& out)
-{
-	zip z(file);
+/**
+ * File found by the identification.
+ * The path isn't interned like the rom names, it's used only once.
+ */
+struct ident_entry {
+	string path; // file, or zip and file inside it
+	unsigned size;
+	crc_t crc;
+};
 
-	z.open();
+/**
+ * Read of the crc and size of a file, or of all the files in a zip.
+ */
+class ident_job : public thread_job {
+	string file;
+	bool is_zip;
+	list<ident_entry> data; // files found
+public:
+	ident_job(const string& Afile, bool Ais_zip) : file(Afile), is_zip(Ais_zip) { }
+
+	void run()
+	{
+		if (is_zip) {
+			zip z(file);
+
+			z.open();
 
-	for(zip::const_iterator i=z.begin();i!=z.end();++i) {
-		ident_data(z.file_get() + "/" + i->name_get(), i->crc_get(), i->uncompressed_size_get(), gar, out);
+			for(zip::const_iterator i=z.begin();i!=z.end();++i) {
+				ident_entry e;
+				e.path = z.file_get() + "/" + i->name_get();
+				e.size = i->uncompressed_size_get();
+				e.crc = i->crc_get();
+				data.insert(data.end(), e);
+			}
+		} else {
+			ident_entry e;
+			e.path = file;
+			e.size = file_size(file);
+			e.crc = file_crc(file);
+			data.insert(data.end(), e);
+		}
 	}
-}
 
-void ident_file(const string& file, const gamearchive& gar, ostream& out)
+	const list<ident_entry>& data_get() const { return data; }
+};
+
+void ident_walk(const string& file, vector<ident_job*>& js)
 {
 	struct stat st;
 	if (stat(file.c_str(), &st) != 0)
@@ -1887,20 +2452,77 @@ void ident_file(const string& file, const gamearchive& gar, ostream& out)
 		if (!d)
 			throw error() << "Failed open dir " << file;
 
-		struct dirent* dd;
-		while ((dd = readdir(d)) != 0) {
-			if (dd->d_name[0] != '.')
-				ident_file(file + "/" + dd->d_name, gar, out);
+		try {
+			struct dirent* dd;
+			while ((dd = readdir(d)) != 0) {
+				if (dd->d_name[0] != '.')
+					ident_walk(file + "/" + dd->d_name, js);
+			}
+		} catch (...) {
+			closedir(d);
+			throw;
 		}
 
 		closedir(d);
-	} else if (file_compare(file_ext(file), ".zip")==0) {
-		ident_zip(file, gar, out);
 	} else {
-		unsigned size = file_size(file);
-		crc_t crc = file_crc(file);
-		ident_data(file, crc, size, gar, out);
+		js.insert(js.end(), new ident_job(file, file_compare(file_ext(file), ".zip")==0));
+	}
+}
+
+/**
+ * Identify files and zips, also in directories.
+ * The files are read concurrently, but printed in the directory order.
+ */
+void ident_file(const string_container& files, const gamearchive& gar, const gamerom_by_crc_index& rcb, ostream& out)
+{
+	vector<ident_job*> js;
+
+	// an error in the walk is reported after the files found before it
+	bool walk_failed = false;
+	error walk_error;
+	try {
+		for(string_container::const_iterator i=files.begin();i!=files.end();++i)
+			ident_walk(*i, js);
+	} catch (error& e) {
+		walk_failed = true;
+		walk_error = e;
+	} catch (...) {
+		for(unsigned k=0;k<js.size();++k)
+			delete js[k];
+		throw;
+	}
+
+	try {
+		{
+			unsigned count = thread_count_get();
+			if (count > js.size())
+				count = js.size();
+
+			thread_pool pool(count);
+
+			for(unsigned k=0;k<js.size();++k)
+				pool.push(js[k]);
+
+			pool.wait();
+		}
+
+		for(unsigned k=0;k<js.size();++k) {
+			js[k]->rethrow();
+
+			for(list<ident_entry>::const_iterator i=js[k]->data_get().begin();i!=js[k]->data_get().end();++i)
+				ident_data(i->path, i->crc, i->size, gar, rcb, out);
+		}
+	} catch (...) {
+		for(unsigned k=0;k<js.size();++k)
+			delete js[k];
+		throw;
 	}
+
+	for(unsigned k=0;k<js.size();++k)
+		delete js[k];
+
+	if (walk_failed)
+		throw walk_error;
 }
 
 void bbs(const gamearchive& gar, ostream& out)
@@ -1950,10 +2572,20 @@ void usage()
 	cout << "Options:\n";
 	cout << "  " SWITCH_GETOPT_LONG("-c, --cfg FILE   ", "-c") "  Select a configuration file\n";
 	cout << "  " SWITCH_GETOPT_LONG("-f, --filter FILT", "-f") "  Filter the game list\n";
+	cout << "  " SWITCH_GETOPT_LONG("-D, --snap FILE  ", "-D") "  Use a snapshot of the information file\n";
 	cout << "  " SWITCH_GETOPT_LONG("-p, --report     ", "-p") "  Write a rom based report\n";
 	cout << "  " SWITCH_GETOPT_LONG("-P, --report-zip ", "-P") "  Write a zip based report\n";
 	cout << "  " SWITCH_GETOPT_LONG("-n, --print-only ", "-n") "  Only print operations, do nothing\n";
+	cout << "  " SWITCH_GETOPT_LONG("-w, --plan FILE  ", "-w") "  Write the rom operations in a plan, do nothing\n";
+	cout << "  " SWITCH_GETOPT_LONG("-x, --exec FILE  ", "-x") "  Execute the operations of a plan\n";
 	cout << "  " SWITCH_GETOPT_LONG("-v, --verbose    ", "-v") "  Verbose output\n";
+	cout << "  " SWITCH_GETOPT_LONG("-j, --jobs N     ", "-j") "  Number of parallel jobs\n";
+	cout << "  " SWITCH_GETOPT_LONG("-m, --mmap       ", "-m") "  Read the zips mapping them in memory\n";
+	cout << "  " SWITCH_GETOPT_LONG("-F, --prefetch MB", "-F") "  Memory used to read ahead the zips to change\n";
+	cout << "  " SWITCH_GETOPT_LONG("-A, --append N   ", "-A") "  Max unused space in % to save appending\n";
+	cout << "  " SWITCH_GETOPT_LONG("-C, --rescan     ", "-C") "  Ignore the cache and read all the zips\n";
+	cout << "  " SWITCH_GETOPT_LONG("-y, --verify     ", "-y") "  Decompress the roms and check the crc\n";
+	cout << "  " SWITCH_GETOPT_LONG("-T, --stats FILE ", "-T") "  Write the performance statistics in JSON\n";
 }
 
 #if HAVE_GETOPT_LONG
@@ -1974,6 +2606,7 @@ struct option long_options[] = {
 
 	{"filter", 1, 0, 'f'},
 	{"cfg", 1, 0, 'c'},
+	{"snap", 1, 0, 'D'},
 
 	{"bbs", 0, 0, 'l'},
 	{"equal", 0, 0, 'e'},
@@ -1983,15 +2616,29 @@ struct option long_options[] = {
 	{"report-file", 0, 0, 'P'},
 
 	{"print-only", 0, 0, 'n'},
+	{"plan", 1, 0, 'w'},
+	{"exec", 1, 0, 'x'},
 
 	{"verbose", 0, 0, 'v'},
+	{"jobs", 1, 0, 'j'},
+	{"mmap", 0, 0, 'm'},
+	{"prefetch", 1, 0, 'F'},
+	{"append", 1, 0, 'A'},
+	{"rescan", 0, 0, 'C'},
+	{"verify", 0, 0, 'y'},
+	{"stats", 1, 0, 'T'},
 	{"help", 0, 0, 'h'},
 	{"version", 0, 0, 'V'},
 	{0, 0, 0, 0}
 };
 #endif
 
-#define OPTIONS "rRsSkKabdutgf:c:leipPnvhV"
+#define OPTIONS "rRsSkKabdutgf:c:D:leipPnw:x:vj:mF:A:CyT:hV"
+
+/**
+ * Stream discarding the log of the changes done only in memory.
+ */
+static ostream log_null(0);
 
 void run(int argc, char* argv[])
 {
@@ -2017,9 +2664,16 @@ void run(int argc, char* argv[])
 	bool flag_remove_text = false;
 	bool flag_remove_garbage = false;
 	bool flag_ident = false;
+	bool flag_rescan = false;
+	bool flag_verify = false;
+	unsigned long long prefetch_budget = ROM_PREFETCH_BUDGET;
 	operation oper;
 	string cfg_file;
 	string filter;
+	string snapshot;
+	string plan_file;
+	string exec_file;
+	string stats_file;
 
 	int c = 0;
 
@@ -2086,6 +2740,9 @@ void run(int argc, char* argv[])
 			case 'f' :
 				filter = optarg;
 				break;
+			case 'D' :
+				snapshot = optarg;
+				break;
 			case 'l' :
 				flag_bbs = true;
 				break;
@@ -2104,6 +2761,13 @@ void run(int argc, char* argv[])
 			case 'n' :
 				flag_print_only = true;
 				break;
+			case 'w' :
+				plan_file = optarg;
+				flag_print_only = true;
+				break;
+			case 'x' :
+				exec_file = optarg;
+				break;
 			case 'h' :
 				usage();
 				return;
@@ -2113,6 +2777,42 @@ void run(int argc, char* argv[])
 			case 'v' :
 				flag_verbose = true;
 				break;
+			case 'j' : {
+				char* e;
+				long n = strtol(optarg, &e, 10);
+				if (*e || n < 1)
+					throw error() << "Invalid number of jobs `" << optarg << "'";
+				thread_count_set(n);
+				break;
+			}
+			case 'm' :
+				zip::mmap_set(true);
+				break;
+			case 'F' : {
+				char* e;
+				long n = strtol(optarg, &e, 10);
+				if (*e || n < 0)
+					throw error() << "Invalid prefetch size `" << optarg << "'";
+				prefetch_budget = n * 1024ULL * 1024ULL;
+				break;
+			}
+			case 'A' : {
+				char* e;
+				long n = strtol(optarg, &e, 10);
+				if (*e || n < 0 || n > 100)
+					throw error() << "Invalid append waste `" << optarg << "'";
+				zip::append_waste_set(n);
+				break;
+			}
+			case 'C' :
+				flag_rescan = true;
+				break;
+			case 'y' :
+				flag_verify = true;
+				break;
+			case 'T' :
+				stats_file = optarg;
+				break;
 			default: {
 				// not optimal code for g++ 2.95.3
 				string opt;
@@ -2122,6 +2822,35 @@ void run(int argc, char* argv[])
 		} 
 	}
 
+	if (stats_file.length())
+		stats_enable();
+
+	if (exec_file.length()) {
+		plan p;
+
+		ifstream f(exec_file.c_str());
+		if (!f)
+			throw error() << "Failed open of the plan " << exec_file;
+
+		try {
+			p.load(f);
+		} catch (error& e) {
+			throw e << " reading the plan " << exec_file;
+		}
+
+		{
+			stats_phase sp(stats_phase_save);
+			p.execute(cerr);
+		}
+
+		if (stats_file.length())
+			stats_save(stats_file);
+		return;
+	}
+
+	// the plan is made doing the rom operations only in memory
+	bool flag_plan = plan_file.length() != 0;
+
 	oper.active_set(!flag_print_only);
 	oper.output_set(flag_print_only);
 	oper.operation_set(flag_move, flag_add, flag_fix, flag_remove_binary, flag_remove_text, flag_remove_garbage);
@@ -2145,33 +2874,48 @@ void run(int argc, char* argv[])
 	// set of all game and roms
 	gamearchive gar;
 
-	// load the rom set
-	gar.load(cin);
+	// build the crc/size rom set used to detect unique roms
+	gamerom_by_crc_index rcb;
 
-	// filter the rom set
-	filt(gar, filter);
+	{
+		stats_phase sp(stats_phase_dat_load);
 
-	if (gar.begin() == gar.end())
-		throw error() << "Empty information file";
+		// load the rom set
+		if (snapshot.length())
+			gar.load(cin, snapshot);
+		else
+			gar.load(cin);
 
-	// build the crc/size rom set used to detect unique roms
-	gamerom_by_crc_multiset rcb;
-	for(gamearchive::const_iterator i=gar.begin();i!=gar.end();++i) {
-		for(rom_by_name_set::const_iterator j=i->rs_get().begin();j!=i->rs_get().end();++j) {
-			rcb.insert(gamerom(i->name_get(), j->name_get(), j->size_get(), j->crc_get(), j->nodump_get()));
+		// filter the rom set
+		filt(gar, filter);
+
+		if (gar.begin() == gar.end())
+			throw error() << "Empty information file";
+
+		for(gamearchive::const_iterator i=gar.begin();i!=gar.end();++i) {
+			for(rom_by_name_set::const_iterator j=i->rs_get().begin();j!=i->rs_get().end();++j) {
+				rcb.insert(gamerom(i->name_get(), *j));
+			}
 		}
+		rcb.sort();
 	}
 
-	if (flag_ident) {
-		for(int i=optind;i<argc;++i)
-			ident_file(argv[i], gar, cout);
-	}
+	if (flag_ident || flag_equal || flag_bbs) {
+		stats_phase sp(stats_phase_report);
 
-	if (flag_equal)
-		equal(gar, rcb, cout);
+		if (flag_ident) {
+			string_container files;
+			for(int i=optind;i<argc;++i)
+				files.insert(files.end(), argv[i]);
+			ident_file(files, gar, rcb, cout);
+		}
 
-	if (flag_bbs)
-		bbs(gar, cout);
+		if (flag_equal)
+			equal(gar, rcb, cout);
+
+		if (flag_bbs)
+			bbs(gar, cout);
+	}
 
 	if (flag_rom || flag_sample || flag_disk) {
 		config cfg(cfg_file, flag_rom, flag_sample, flag_disk, flag_change);
@@ -2179,41 +2923,79 @@ void run(int argc, char* argv[])
 		output out(cout);
 		analyze ana(gar);
 
+		plan pl;
+		if (flag_plan) {
+			out.plan_set(&pl);
+			ziprom::save_set(false);
+			ziprom::log_default_set(log_null);
+		}
+
+		zipcache cache;
+		{
+			stats_phase sp(stats_phase_zip_open);
+			cache.load(cfg.cachepath_get().file_get(), flag_rescan);
+		}
+
 		if (flag_rom) {
 			ziparchive zar;
 
+			// with a plan the rom operations are also done, but only in memory
+			operation rom_oper = oper;
+			if (flag_plan)
+				rom_oper.active_set(true);
+
 			if (flag_operation) {
-				all_rom_load(zar, cfg);
-				all_rom_scan(oper, zar, gar, rcb, cfg, out, ana);
+				all_rom_load(zar, cache, cfg, flag_verify);
+
+				stats_phase sp(stats_phase_scan);
+				all_rom_scan(rom_oper, zar, gar, rcb, cfg, out, ana, flag_plan ? 0 : prefetch_budget);
 			} else {
-				set_rom_load(zar, cfg);
-				set_rom_scan(oper, zar, gar, cfg, out, ana);
+				set_rom_load(zar, cache, cfg, flag_verify);
+
+				stats_phase sp(stats_phase_scan);
+				set_rom_scan(rom_oper, zar, gar, cfg, out, ana, flag_plan ? 0 : prefetch_budget);
 			}
 
 			if (flag_report) {
+				stats_phase sp(stats_phase_report);
 				report_rom_zip(zar, gar, out, flag_verbose, ana);
 				report_rom_set(gar, out);
 			}
 
 			if (flag_report_zip) {
+				stats_phase sp(stats_phase_report);
 				report_rom_set_zip(gar, out);
 			}
 
-			if (flag_change)
+			if (flag_change || (flag_plan && flag_operation)) {
+				stats_phase sp(stats_phase_scan);
 				all_unknown_scan(zar, cfg, out);
+			}
+
+			if (flag_plan) {
+				stats_phase sp(stats_phase_save);
+				ofstream f(plan_file.c_str());
+				pl.save(f);
+				f.close();
+				if (!f)
+					throw error() << "Failed write of the plan " << plan_file;
+			}
 		}
 
 		if (flag_sample) {
 			filepath_container zar;
 			
-			set_sample_load(zar, cfg);
+			set_sample_load(zar, cache, cfg);
 			if (flag_operation) {
+				stats_phase sp(stats_phase_scan);
 				all_sample_scan(oper, zar, gar, cfg, out, ana);
 			} else {
+				stats_phase sp(stats_phase_scan);
 				set_sample_scan(oper, zar, gar, cfg, out, ana);
 			}
 
 			if (flag_report) {
+				stats_phase sp(stats_phase_report);
 				report_sample_zip(zar, gar, out, flag_verbose, ana);
 				report_sample_set(gar, out);
 			}
@@ -2223,18 +3005,35 @@ void run(int argc, char* argv[])
 			filepath_container zar;
 			
 			set_disk_load(zar, cfg);
+
+			disk_owner_map owner;
+			disk_owner_build(gar, owner);
+
 			if (flag_operation) {
-				all_disk_scan(oper, zar, gar, cfg, out, ana);
+				stats_phase sp(stats_phase_scan);
+				all_disk_scan(oper, zar, owner, cfg, out, ana);
 			} else {
-				set_disk_scan(oper, zar, gar, cfg, out, ana);
+				stats_phase sp(stats_phase_scan);
+				set_disk_scan(oper, zar, owner, cfg, out, ana);
 			}
 
 			if (flag_report) {
-				report_disk_zip(zar, gar, out, flag_verbose, ana);
+				stats_phase sp(stats_phase_report);
+				report_disk_zip(zar, owner, out, flag_verbose, ana);
 				report_disk_set(gar, out);
 			}
 		}
+
+		// update the cache with the zips changed, only if changes are allowed
+		if (!flag_print_only) {
+			stats_phase sp(stats_phase_save);
+			cache.refresh();
+			cache.save();
+		}
 	}
+
+	if (stats_file.length())
+		stats_save(stats_file);
 }
 
 int main(int argc, char* argv[])
@@ -0,0 +1,217 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "portable.h"
+
+#include "stats.h"
+#include "thread.h"
+
+#include <fstream>
+#include <iomanip>
+
+#if HAVE_GETRUSAGE && HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+bool stats_flag = false;
+
+static const char* stats_phase_name[stats_phase_max] = {
+	"dat_load",
+	"reduce",
+	"dir",
+	"zip_open",
+	"scan",
+	"save",
+	"report"
+};
+
+static const char* stats_counter_name[stats_counter_max] = {
+	"zip_open",
+	"zip_load",
+	"zip_save",
+	"zip_delete",
+	"load_read_byte",
+	"save_read_byte",
+	"save_write_byte",
+	"compressed_read",
+	"compressed_read_byte",
+	"find"
+};
+
+static double stats_wall_start;
+static double stats_cpu_start;
+static double stats_phase_wall[stats_phase_max];
+static double stats_phase_cpu[stats_phase_max];
+static unsigned long long stats_counter[stats_counter_max];
+static stats_phase* stats_current = 0;
+
+#if HAVE_PTHREAD
+static pthread_t stats_main;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * Elapsed time, in seconds.
+ */
+static double stats_wall()
+{
+#if HAVE_GETTIMEOFDAY
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1E6;
+#else
+	return time(0);
+#endif
+}
+
+/**
+ * Processor time used by all the threads, in seconds.
+ */
+static double stats_cpu()
+{
+#if HAVE_GETRUSAGE && HAVE_SYS_RESOURCE_H
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1E6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1E6;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+void stats_enable()
+{
+#if HAVE_PTHREAD
+	stats_main = pthread_self();
+#endif
+	stats_wall_start = stats_wall();
+	stats_cpu_start = stats_cpu();
+	stats_flag = true;
+}
+
+void stats_count(stats_counter_type type, unsigned long long value)
+{
+#if HAVE_PTHREAD
+	pthread_mutex_lock(&stats_lock);
+#endif
+	stats_counter[type] += value;
+#if HAVE_PTHREAD
+	pthread_mutex_unlock(&stats_lock);
+#endif
+}
+
+stats_phase::stats_phase(stats_phase_type Atype) : type(Atype), parent(0), active(false)
+{
+	if (!stats_flag)
+		return;
+
+#if HAVE_PTHREAD
+	if (!pthread_equal(pthread_self(), stats_main))
+		return;
+#endif
+
+	active = true;
+	wall_start = stats_wall();
+	cpu_start = stats_cpu();
+
+	// suspend the enclosing phase
+	parent = stats_current;
+	if (parent)
+		parent->stop(wall_start, cpu_start);
+	stats_current = this;
+}
+
+stats_phase::~stats_phase()
+{
+	if (!active)
+		return;
+
+	double wall = stats_wall();
+	double cpu = stats_cpu();
+
+	stop(wall, cpu);
+
+	// resume the enclosing phase
+	stats_current = parent;
+	if (parent) {
+		parent->wall_start = wall;
+		parent->cpu_start = cpu;
+	}
+}
+
+/**
+ * Account the time from the start, or from the last resume.
+ */
+void stats_phase::stop(double wall, double cpu)
+{
+	stats_phase_wall[type] += wall - wall_start;
+	stats_phase_cpu[type] += cpu - cpu_start;
+}
+
+static void stats_time(ostream& os, const char* name, double wall, double cpu, bool last)
+{
+	if (wall < 0)
+		wall = 0;
+	if (cpu < 0)
+		cpu = 0;
+
+	os << "\t\t\"" << name << "\": { \"wall\": " << wall << ", \"cpu\": " << cpu << " }" << (last ? "" : ",") << "\n";
+}
+
+void stats_save(const string& path)
+{
+	double wall = stats_wall() - stats_wall_start;
+	double cpu = stats_cpu() - stats_cpu_start;
+
+	// time not in any phase
+	double other_wall = wall;
+	double other_cpu = cpu;
+	for(unsigned i=0;i<stats_phase_max;++i) {
+		other_wall -= stats_phase_wall[i];
+		other_cpu -= stats_phase_cpu[i];
+	}
+
+	ofstream f(path.c_str());
+
+	f << fixed << setprecision(6);
+	f << "{\n";
+	f << "\t\"program\": \"" PACKAGE "\",\n";
+	f << "\t\"version\": \"" VERSION "\",\n";
+	f << "\t\"jobs\": " << thread_count_get() << ",\n";
+	f << "\t\"wall\": " << wall << ",\n";
+	f << "\t\"cpu\": " << cpu << ",\n";
+	f << "\t\"phases\": {\n";
+	for(unsigned i=0;i<stats_phase_max;++i)
+		stats_time(f, stats_phase_name[i], stats_phase_wall[i], stats_phase_cpu[i], false);
+	stats_time(f, "other", other_wall, other_cpu, true);
+	f << "\t},\n";
+	f << "\t\"counters\": {\n";
+	for(unsigned i=0;i<stats_counter_max;++i)
+		f << "\t\t\"" << stats_counter_name[i] << "\": " << stats_counter[i] << (i + 1 < stats_counter_max ? "," : "") << "\n";
+	f << "\t}\n";
+	f << "}\n";
+
+	f.close();
+	if (!f)
+		throw error() << "Failed write of the statistics " << path;
+}
+
@@ -0,0 +1,106 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <string>
+
+/**
+ * Phases of the execution.
+ * Each phase is timed excluding the phases started inside it.
+ */
+enum stats_phase_type {
+	stats_phase_dat_load, // read of the information file
+	stats_phase_reduce, // reduction of the merged roms and samples
+	stats_phase_dir, // read of the directories
+	stats_phase_zip_open, // open of the zips
+	stats_phase_scan, // scan and fix
+	stats_phase_save, // write of the zips, the cache and the plan
+	stats_phase_report, // reports
+	stats_phase_max
+};
+
+/**
+ * Counters of the zip operations.
+ */
+enum stats_counter_type {
+	stats_zip_open, // zips opened
+	stats_zip_load, // zips loaded
+	stats_zip_save, // zips saved
+	stats_zip_delete, // zips deleted because empty
+	stats_load_read, // bytes read by zip::load()
+	stats_save_read, // bytes copied from other zips by zip::save()
+	stats_save_write, // bytes written by zip::save()
+	stats_compressed_read, // calls of zip_entry::compressed_read()
+	stats_compressed_read_byte, // bytes read by zip_entry::compressed_read()
+	stats_find, // lookups in ziparchive::find()
+	stats_counter_max
+};
+
+extern bool stats_flag;
+
+/**
+ * Enable the statistics.
+ * It must be called from the main thread, before starting any other thread.
+ */
+void stats_enable();
+
+/**
+ * Increment a counter.
+ * It can be called from any thread.
+ */
+void stats_count(stats_counter_type type, unsigned long long value);
+
+static inline void stats_add(stats_counter_type type, unsigned long long value = 1)
+{
+	if (stats_flag)
+		stats_count(type, value);
+}
+
+/**
+ * Time a phase of the execution, until the object is destroyed.
+ * The time of the enclosing phase is suspended. Only the phases of the
+ * main thread are timed, the jobs executed by other threads are included
+ * in the phase waiting for them.
+ */
+class stats_phase {
+	stats_phase_type type;
+	stats_phase* parent;
+	bool active;
+	double wall_start;
+	double cpu_start;
+
+	stats_phase(const stats_phase&);
+	stats_phase& operator=(const stats_phase&);
+
+	void stop(double wall, double cpu);
+public:
+	stats_phase(stats_phase_type Atype);
+	~stats_phase();
+};
+
+/**
+ * Save the statistics as a JSON document.
+ */
+void stats_save(const std::string& path);
+
+#endif
+
@@ -0,0 +1,224 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "portable.h"
+
+#include "thread.h"
+
+#include <new>
+
+using namespace std;
+
+// ---------------------------------------------------------------------------
+// count
+
+static unsigned thread_count = 0;
+
+void thread_count_set(unsigned count)
+{
+	thread_count = count;
+}
+
+unsigned thread_count_get()
+{
+	if (thread_count != 0)
+		return thread_count;
+
+#if HAVE_PTHREAD && HAVE_SYSCONF && defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0)
+		return n;
+#endif
+
+	return 1;
+}
+
+// ---------------------------------------------------------------------------
+// job
+
+thread_job::thread_job() : status(job_ok)
+{
+}
+
+thread_job::~thread_job()
+{
+}
+
+void thread_job::execute()
+{
+	try {
+		run();
+	} catch (error_invalid& e) {
+		status = job_invalid;
+		fail = e;
+	} catch (error_unsupported& e) {
+		status = job_unsupported;
+		fail = e;
+	} catch (error& e) {
+		status = job_error;
+		fail = e;
+	} catch (bad_alloc&) {
+		status = job_alloc;
+	} catch (...) {
+		status = job_unknown;
+	}
+}
+
+void thread_job::rethrow() const
+{
+	switch (status) {
+	case job_ok :
+		break;
+	case job_invalid : {
+		error_invalid e;
+		static_cast<error&>(e) = fail;
+		throw e;
+	}
+	case job_unsupported : {
+		error_unsupported e;
+		static_cast<error&>(e) = fail;
+		throw e;
+	}
+	case job_error :
+		throw fail;
+	case job_alloc :
+		throw bad_alloc();
+	default:
+		throw error() << "Unknown failure in worker thread";
+	}
+}
+
+// ---------------------------------------------------------------------------
+// pool
+
+#if HAVE_PTHREAD
+void* thread_pool::worker(void* arg)
+{
+	thread_pool* pool = static_cast<thread_pool*>(arg);
+
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (pool->todo.empty() && !pool->quit)
+			pthread_cond_wait(&pool->cond_todo, &pool->lock);
+
+		if (pool->todo.empty())
+			break;
+
+		thread_job* job = pool->todo.front();
+		pool->todo.pop_front();
+		++pool->running;
+
+		pthread_mutex_unlock(&pool->lock);
+		job->execute();
+		pthread_mutex_lock(&pool->lock);
+
+		--pool->running;
+		if (pool->todo.empty() && pool->running == 0)
+			pthread_cond_broadcast(&pool->cond_done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+#endif
+
+thread_pool::thread_pool(unsigned Acount) : count(Acount)
+{
+	if (count < 1)
+		count = 1;
+
+#if HAVE_PTHREAD
+	running = 0;
+	quit = false;
+
+	if (count > 1) {
+		pthread_mutex_init(&lock, 0);
+		pthread_cond_init(&cond_todo, 0);
+		pthread_cond_init(&cond_done, 0);
+
+		for(unsigned i=0;i<count;++i) {
+			pthread_t id;
+			if (pthread_create(&id, 0, worker, this) != 0)
+				break;
+			thread.insert(thread.end(), id);
+		}
+
+		if (thread.empty()) {
+			// fallback to the serial execution
+			pthread_cond_destroy(&cond_done);
+			pthread_cond_destroy(&cond_todo);
+			pthread_mutex_destroy(&lock);
+			count = 1;
+		} else {
+			// even a single worker thread is used, and it must be joined
+			count = thread.size();
+		}
+	}
+#else
+	count = 1;
+#endif
+}
+
+thread_pool::~thread_pool()
+{
+#if HAVE_PTHREAD
+	if (!thread.empty()) {
+		pthread_mutex_lock(&lock);
+		quit = true;
+		pthread_cond_broadcast(&cond_todo);
+		pthread_mutex_unlock(&lock);
+
+		for(unsigned i=0;i<thread.size();++i)
+			pthread_join(thread[i], 0);
+
+		pthread_cond_destroy(&cond_done);
+		pthread_cond_destroy(&cond_todo);
+		pthread_mutex_destroy(&lock);
+	}
+#endif
+}
+
+void thread_pool::push(thread_job* job)
+{
+#if HAVE_PTHREAD
+	if (!thread.empty()) {
+		pthread_mutex_lock(&lock);
+		todo.insert(todo.end(), job);
+		pthread_cond_signal(&cond_todo);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+#endif
+
+	job->execute();
+}
+
+void thread_pool::wait()
+{
+#if HAVE_PTHREAD
+	if (!thread.empty()) {
+		pthread_mutex_lock(&lock);
+		while (!todo.empty() || running != 0)
+			pthread_cond_wait(&cond_done, &lock);
+		pthread_mutex_unlock(&lock);
+	}
+#endif
+}
+
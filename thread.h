@@ -0,0 +1,105 @@
+/*
+ * This file is part of the Advance project.
+ *
+ * Copyright (C) 2018 Andrea Mazzoleni
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __THREAD_H
+#define __THREAD_H
+
+#include "except.h"
+
+#include <list>
+#include <vector>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/**
+ * Set the number of worker threads.
+ * A value of 0 selects the number of online processors.
+ */
+void thread_count_set(unsigned count);
+
+/**
+ * Get the number of worker threads.
+ */
+unsigned thread_count_get();
+
+/**
+ * Unit of work executed by a thread_pool.
+ * Any exception raised by run() is captured, and it's later raised again
+ * in the calling thread by rethrow().
+ */
+class thread_job {
+	enum {
+		job_ok,
+		job_error,
+		job_invalid,
+		job_unsupported,
+		job_alloc,
+		job_unknown
+	} status;
+	error fail;
+
+	thread_job(const thread_job&);
+	thread_job& operator=(const thread_job&);
+public:
+	thread_job();
+	virtual ~thread_job();
+
+	virtual void run() = 0;
+
+	void execute();
+	bool is_failed() const { return status != job_ok; }
+	void rethrow() const;
+};
+
+/**
+ * Pool of worker threads.
+ * Jobs are started in the same order of push(). With a count of 1, or
+ * if no thread can be created, the jobs are executed directly by push().
+ */
+class thread_pool {
+	unsigned count;
+#if HAVE_PTHREAD
+	pthread_mutex_t lock;
+	pthread_cond_t cond_todo;
+	pthread_cond_t cond_done;
+	std::list<thread_job*> todo;
+	unsigned running;
+	bool quit;
+	std::vector<pthread_t> thread;
+
+	static void* worker(void* arg);
+#endif
+
+	thread_pool(const thread_pool&);
+	thread_pool& operator=(const thread_pool&);
+public:
+	thread_pool(unsigned Acount);
+	~thread_pool();
+
+	unsigned count_get() const { return count; }
+
+	void push(thread_job* job);
+	void wait();
+};
+
+#endif
+
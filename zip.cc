@@ -24,6 +24,7 @@
 #include "siglock.h"
 #include "file.h"
 #include "data.h"
+#include "stats.h"
 #include "lib/endianrw.h"
 
 #include <zlib.h>
@@ -33,14 +34,48 @@
 #include <string>
 #include <sstream>
 #include <set>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#if HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#define USE_MMAP 1
+#else
+#define USE_MMAP 0
+#endif
 
 using namespace std;
 
+/**
+ * Size of the buffers used to test the entries.
+ */
+#define ZIP_TEST_BUFFER (64*1024)
+
 /**
  * Enable pendantic checks on the zip integrity.
  */
 bool zip::pedantic = false;
 
+/**
+ * Max unused space in percentage of the file size allowed
+ * to save a zip appending the new entries.
+ */
+unsigned zip::append_waste = 10;
+
+/**
+ * Read the zips mapping them in memory.
+ */
+bool zip::mmap_enable = false;
+
 bool ecd_compare_sig(const unsigned char *buffer)
 {
 	static char ecdsig[] = { 'P', 'K', 0x05, 0x06 };
@@ -65,6 +100,12 @@ bool ecd_find_sig (const unsigned char *buffer, unsigned buflen, unsigned& offse
 
 #define ECD_READ_BUFFER_SIZE 4096
 
+/**
+ * Size of the end of the file searched for the end of central directory.
+ * A bigger file is always searched at least for this size.
+ */
+#define ECD_READ_MAX (8 * ECD_READ_BUFFER_SIZE)
+
 /**
  * Read cent dir and end cent dir data
  * \param f File to read.
@@ -136,7 +177,7 @@ bool cent_read(FILE* f, unsigned length, unsigned char*& data, unsigned& size)
 
 		data_free(buf);
 
-		if (buf_length < 8 * ECD_READ_BUFFER_SIZE && buf_length < length) {
+		if (buf_length < ECD_READ_MAX && buf_length < length) {
 			// grow buffer
 			buf_length += ECD_READ_BUFFER_SIZE;
 		} else {
@@ -146,6 +187,45 @@ bool cent_read(FILE* f, unsigned length, unsigned char*& data, unsigned& size)
 	}
 }
 
+/**
+ * Locate cent dir and end cent dir data in a mapped file.
+ * The same area checked by cent_read() is searched.
+ * \param map Mapped file.
+ * \param length Length of the file.
+ */
+bool cent_map(const unsigned char* map, unsigned length, const unsigned char*& data, unsigned& size)
+{
+	unsigned buf_length;
+
+	if (length <= ECD_READ_BUFFER_SIZE) {
+		buf_length = length;
+	} else {
+		// align the read
+		buf_length = length - ((length - ECD_READ_BUFFER_SIZE) & ~(ECD_READ_BUFFER_SIZE-1));
+	}
+
+	// grow the buffer like cent_read()
+	while (buf_length < ECD_READ_MAX && buf_length < length)
+		buf_length += ECD_READ_BUFFER_SIZE;
+	if (buf_length > length)
+		buf_length = length;
+
+	const unsigned char* buf = map + length - buf_length;
+
+	unsigned offset = 0;
+	if (!ecd_find_sig(buf, buf_length, offset))
+		return false;
+
+	unsigned start_of_cent_dir = le_uint32_read(buf + offset + ZIP_EO_offset_to_start_of_cent_dir);
+	if (start_of_cent_dir >= length)
+		return false;
+
+	data = map + start_of_cent_dir;
+	size = length - start_of_cent_dir;
+
+	return true;
+}
+
 /** Code used for disk entry. */
 #define ZIP_UNIQUE_DISK 0
 
@@ -180,6 +260,360 @@ time_t zip2time(unsigned date, unsigned time)
 	return mktime(&tm);
 }
 
+// --------------------------------------------------------------------------
+// Source
+
+/**
+ * Zip file used as source of entries not loaded in memory.
+ * The file is kept open until the last entry using it is destroyed, in this
+ * way the zip can be overwritten when the entries are still pending,
+ * as the old data remains accessible from the open file.
+ * If the file is mapped, the mapping is used instead of the open file.
+ * The data is read with pread(), so the same source can be read by
+ * different threads.
+ */
+struct zip_source {
+	string path;
+	int f; // -1 if mapped
+	unsigned char* map; // mapping of the file, 0 if not mapped
+	unsigned size; // size of the mapping
+	unsigned count; // number of entries using it
+	bool shared; // if present in the zip_source_set
+	struct stat st; // identity of the file opened
+	list<zip_source*>::iterator idle; // position in zip_source_idle_list, if not used
+};
+
+typedef map<string, zip_source*> zip_source_set;
+
+/**
+ * Sources opened, shared by all the entries.
+ * A zip rewritten is removed, and the next use opens it again.
+ */
+static zip_source_set zip_source_open_set;
+
+/**
+ * Max number of sources kept open when no entry uses them.
+ * Without the support of removing open files, none is kept.
+ */
+#if HAVE_OPEN_UNLINK
+#define ZIP_SOURCE_IDLE_MAX 64
+#else
+#define ZIP_SOURCE_IDLE_MAX 0
+#endif
+
+/**
+ * Sources not used, but kept open for the next use, the most recent first.
+ * The same zips are read many times by different operations, and in this
+ * way they are not opened and closed every time.
+ */
+static list<zip_source*> zip_source_idle_list;
+
+/**
+ * Lock of the sources, as the zips may be changed by different threads.
+ */
+#if HAVE_PTHREAD
+static pthread_mutex_t zip_source_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static inline void zip_source_lock_acquire()
+{
+#if HAVE_PTHREAD
+	pthread_mutex_lock(&zip_source_lock);
+#endif
+}
+
+static inline void zip_source_lock_release()
+{
+#if HAVE_PTHREAD
+	pthread_mutex_unlock(&zip_source_lock);
+#endif
+}
+
+/**
+ * Add a user of a source.
+ */
+static void zip_source_ref(zip_source* s)
+{
+	zip_source_lock_acquire();
+	++s->count;
+	zip_source_lock_release();
+}
+
+/**
+ * Map the file of a source.
+ * On success the file is closed, as the mapping remains valid.
+ * On failure the file remains open and it's read normally.
+ */
+static void zip_source_map(zip_source* s)
+{
+#if USE_MMAP
+	// skip empty files, and files not addressable with the zip offsets
+	if (s->st.st_size == 0 || static_cast<unsigned long long>(s->st.st_size) > 0xFFFFFFFFULL)
+		return;
+
+	void* map = mmap(0, s->st.st_size, PROT_READ, MAP_SHARED, s->f, 0);
+	if (map == MAP_FAILED)
+		return;
+
+	close(s->f);
+
+	s->f = -1;
+	s->map = static_cast<unsigned char*>(map);
+	s->size = s->st.st_size;
+#endif
+}
+
+/**
+ * Close a source. The lock must be held.
+ */
+static void zip_source_close(zip_source* s)
+{
+#if USE_MMAP
+	if (s->map)
+		munmap(s->map, s->size);
+#endif
+	if (s->f != -1)
+		close(s->f);
+
+	delete s;
+}
+
+/**
+ * Close a source not used. The lock must be held.
+ */
+static void zip_source_close_idle(zip_source* s)
+{
+	zip_source_idle_list.erase(s->idle);
+	zip_source_open_set.erase(s->path);
+	zip_source_close(s);
+}
+
+/**
+ * Open a source.
+ * \param map If the file has to be mapped in memory. The request is
+ * ignored if the source is already open.
+ */
+static zip_source* zip_source_open(const string& path, bool map)
+{
+	zip_source_lock_acquire();
+
+	zip_source_set::iterator i = zip_source_open_set.find(path);
+	if (i != zip_source_open_set.end()) {
+		zip_source* s = i->second;
+
+		if (s->count != 0) {
+			++s->count;
+			zip_source_lock_release();
+			return s;
+		}
+
+		// a source not used is reused only if the file is still the same
+		struct stat st;
+		if (stat(path.c_str(), &st) == 0
+			&& st.st_dev == s->st.st_dev
+			&& st.st_ino == s->st.st_ino
+			&& st.st_size == s->st.st_size
+			&& st.st_mtime == s->st.st_mtime
+		) {
+			zip_source_idle_list.erase(s->idle);
+			s->count = 1;
+			zip_source_lock_release();
+			return s;
+		}
+
+		zip_source_close_idle(s);
+	}
+
+	int f = open(path.c_str(), O_RDONLY);
+	if (f == -1) {
+		zip_source_lock_release();
+		throw error() << "Failed open for reading " << path;
+	}
+
+	zip_source* s = new zip_source;
+	s->path = path;
+	s->f = f;
+	s->map = 0;
+	s->size = 0;
+	s->count = 1;
+	s->shared = true;
+
+	if (fstat(f, &s->st) != 0) {
+		close(f);
+		delete s;
+		zip_source_lock_release();
+		throw error() << "Failed stat " << path;
+	}
+
+	if (map)
+		zip_source_map(s);
+
+	zip_source_open_set[path] = s;
+
+	zip_source_lock_release();
+
+	return s;
+}
+
+static void zip_source_release(zip_source* s)
+{
+	zip_source_lock_acquire();
+
+	if (--s->count != 0) {
+		zip_source_lock_release();
+		return;
+	}
+
+	// the mappings are not kept, as they use memory
+	if (!s->shared || s->map) {
+		if (s->shared)
+			zip_source_open_set.erase(s->path);
+		zip_source_close(s);
+		zip_source_lock_release();
+		return;
+	}
+
+	// keep it open for the next use
+	s->idle = zip_source_idle_list.insert(zip_source_idle_list.begin(), s);
+
+	if (zip_source_idle_list.size() > ZIP_SOURCE_IDLE_MAX)
+		zip_source_close_idle(zip_source_idle_list.back());
+
+	zip_source_lock_release();
+}
+
+/**
+ * Don't share anymore the opened source of a zip.
+ * It must be called before rewriting the zip.
+ */
+static void zip_source_forget(const string& path)
+{
+	zip_source_lock_acquire();
+
+	zip_source_set::iterator i = zip_source_open_set.find(path);
+	if (i != zip_source_open_set.end()) {
+		zip_source* s = i->second;
+		if (s->count == 0) {
+			zip_source_close_idle(s);
+		} else {
+			s->shared = false;
+			zip_source_open_set.erase(i);
+		}
+	}
+
+	zip_source_lock_release();
+}
+
+static void zip_source_read(zip_source* s, unsigned char* data, unsigned size, unsigned offset)
+{
+	if (s->map) {
+		if (offset > s->size || size > s->size - offset)
+			throw error() << "Failed read " << s->path;
+		memcpy(data, s->map + offset, size);
+		return;
+	}
+
+	while (size > 0) {
+#if HAVE_PREAD
+		ssize_t run = pread(s->f, data, size, offset);
+#else
+		ssize_t run = -1;
+		if (lseek(s->f, offset, SEEK_SET) == static_cast<off_t>(offset))
+			run = read(s->f, data, size);
+#endif
+		if (run <= 0)
+			throw error() << "Failed read " << s->path;
+
+		data += run;
+		size -= run;
+		offset += run;
+	}
+}
+
+#define ZIP_SOURCE_BUFFER_SIZE (256*1024)
+
+/**
+ * Copy data from the source at the current position of a file.
+ * The data is copied by the kernel if possible.
+ */
+static void zip_source_copy(zip_source* s, unsigned offset, unsigned size, FILE* f)
+{
+	if (s->map) {
+		if (offset > s->size || size > s->size - offset)
+			throw error() << "Failed read " << s->path;
+		if (size > 0 && fwrite(s->map + offset, size, 1, f) != 1)
+			throw error() << "Failed write";
+		return;
+	}
+
+	if (fflush(f) != 0)
+		throw error() << "Failed write";
+
+	int out = fileno(f);
+
+#if HAVE_COPY_FILE_RANGE
+	while (size > 0) {
+		off_t in_offset = offset;
+		ssize_t run = copy_file_range(s->f, &in_offset, out, 0, size, 0);
+		if (run <= 0)
+			break;
+		offset += run;
+		size -= run;
+	}
+#endif
+
+#if HAVE_SENDFILE && HAVE_SYS_SENDFILE_H
+	while (size > 0) {
+		off_t in_offset = offset;
+		ssize_t run = sendfile(out, s->f, &in_offset, size);
+		if (run <= 0)
+			break;
+		offset += run;
+		size -= run;
+	}
+#endif
+
+	if (size > 0) {
+		unsigned char* buf = data_alloc(ZIP_SOURCE_BUFFER_SIZE);
+
+		try {
+			while (size > 0) {
+				unsigned run = size;
+				if (run > ZIP_SOURCE_BUFFER_SIZE)
+					run = ZIP_SOURCE_BUFFER_SIZE;
+
+				zip_source_read(s, buf, run, offset);
+
+				unsigned char* p = buf;
+				unsigned left = run;
+				while (left > 0) {
+					ssize_t done = write(out, p, left);
+					if (done <= 0)
+						throw error() << "Failed write";
+					p += done;
+					left -= done;
+				}
+
+				offset += run;
+				size -= run;
+			}
+		} catch (...) {
+			data_free(buf);
+			throw;
+		}
+
+		data_free(buf);
+	}
+
+	// the file was written directly, resync the stream
+	off_t pos = lseek(out, 0, SEEK_CUR);
+	if (pos < 0 || fseek(f, pos, SEEK_SET) != 0)
+		throw error() << "Failed seek";
+}
+
+// --------------------------------------------------------------------------
+// Entry
+
 zip_entry::zip_entry(const zip& Aparent)
 {
 	memset(&info, 0xFF, sizeof(info));
@@ -200,6 +634,12 @@ zip_entry::zip_entry(const zip& Aparent)
 
 	info.compressed_size = 0;
 	data = 0;
+
+	source = 0;
+	source_offset = 0;
+
+	cent_mapped = false;
+	damaged = false;
 }
 
 zip_entry::zip_entry(const zip_entry& A)
@@ -211,15 +651,25 @@ zip_entry::zip_entry(const zip_entry& A)
 	central_extra_field = data_dup(A.central_extra_field, info.central_extra_field_length);
 	file_comment = data_dup(A.file_comment, info.file_comment_length);
 	data = data_dup(A.data, A.info.compressed_size);
+	source = A.source;
+	source_offset = A.source_offset;
+	if (source)
+		zip_source_ref(source);
+	cent_mapped = false;
+	damaged = A.damaged;
 }
 
 zip_entry::~zip_entry()
 {
-	data_free(file_name);
+	if (!cent_mapped) {
+		data_free(file_name);
+		data_free(central_extra_field);
+		data_free(file_comment);
+	}
 	data_free(local_extra_field);
-	data_free(central_extra_field);
-	data_free(file_comment);
 	data_free(data);
+	if (source)
+		zip_source_release(source);
 }
 
 zip_entry::method_t zip_entry::method_get() const
@@ -302,118 +752,393 @@ void zip_entry::compressed_seek(FILE* f) const
 
 void zip_entry::compressed_read(unsigned char* outdata) const
 {
+	stats_add(stats_compressed_read);
+	stats_add(stats_compressed_read_byte, compressed_size_get());
+
 	if (data) {
 		memcpy(outdata, data, compressed_size_get());
+	} else if (source) {
+		zip_source_read(source, outdata, compressed_size_get(), source_offset);
 	} else {
-		FILE* f = fopen(parentname_get().c_str(), "rb");
-		if (!f) {
-			throw error() << "Failed open for reading " << parentname_get();
-		}
+		zip_source* s = zip_source_open(parentname_get(), zip::mmap_enable);
 
 		try {
-			compressed_seek(f);
-
-			if (compressed_size_get() > 0) {
-				if (fread(outdata, compressed_size_get(), 1, f) != 1) {
-					throw error() << "Failed read " << parentname_get();
-				}
-			}
+			unsigned offset = compressed_offset(s);
 
+			if (compressed_size_get() > 0)
+				zip_source_read(s, outdata, compressed_size_get(), offset);
 		} catch (...) {
-			fclose(f);
+			zip_source_release(s);
 			throw;
 		}
 
-		fclose(f);
+		zip_source_release(s);
 	}
 }
 
-time_t zip_entry::time_get() const
+/**
+ * Get the position of the data in the zip file, reading the local header.
+ */
+unsigned zip_entry::compressed_offset(zip_source* s) const
 {
-	return zip2time(info.last_mod_file_date, info.last_mod_file_time);
-}
+	unsigned char buf[ZIP_LO_FIXED];
+	zip_source_read(s, buf, ZIP_LO_FIXED, offset_get());
 
-void zip_entry::time_set(time_t tod)
-{
-	time2zip(tod, info.last_mod_file_date, info.last_mod_file_time);
+	check_local(buf);
+
+	// use the local extra_field_length. It may be different than the
+	// central directory version in some zips.
+	unsigned local_extra_field_length = le_uint16_read(buf+ZIP_LO_extra_field_length);
+
+	return offset_get() + ZIP_LO_FIXED + info.filename_length + local_extra_field_length;
 }
 
-void zip_entry::set(method_t method, const string& Aname, const unsigned char* compdata, unsigned compsize, unsigned size, unsigned crc, unsigned date, unsigned time, bool is_text)
+/**
+ * Test the entry decompressing the data and checking the crc.
+ * The data is read in chunks, without loading it all in memory.
+ * \param s Source of the zip, used if the data isn't in memory.
+ */
+void zip_entry::test(zip_source* s) const
 {
-	info.version_needed_to_extract = 20; // version 2.0
-	info.os_needed_to_extract = 0;
-	info.version_made_by = 20; // version 2.0
-	info.host_os = 0;
-	info.general_purpose_bit_flag = 0; // default
-	info.last_mod_file_date = date;
-	info.last_mod_file_time = time;
-	info.crc32 = crc;
-	info.compressed_size = compsize;
-	info.uncompressed_size = size;
-	info.internal_file_attrib = is_text ? ZIP_INT_ATTR_TEXT : 0;
-	info.external_file_attrib = 0;
+	bool deflate;
 
-	switch (method) {
+	switch (method_get()) {
 		case store :
-			if (size != compsize) {
-				throw error_invalid() << "Zip entry size mismatch";
-			}
-			info.compression_method = ZIP_METHOD_STORE;
-			info.version_needed_to_extract = 10; // Version 1.0
-		break;
-		case shrunk :
-			info.compression_method = ZIP_METHOD_SHRUNK;
-		break;
-		case reduce1 :
-			info.compression_method = ZIP_METHOD_REDUCE1;
-		break;
-		case reduce2 :
-			info.compression_method = ZIP_METHOD_REDUCE2;
-		break;
-		case reduce3 :
-			info.compression_method = ZIP_METHOD_REDUCE3;
-		break;
-		case reduce4 :
-			info.compression_method = ZIP_METHOD_REDUCE4;
-		break;
+			deflate = false;
+			break;
+		case deflate0 :
 		case deflate1 :
 		case deflate2 :
-			info.compression_method = ZIP_METHOD_DEFLATE;
-			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_DEFLATE_SUPERFAST;
-		break;
 		case deflate3 :
 		case deflate4 :
 		case deflate5 :
-			info.compression_method = ZIP_METHOD_DEFLATE;
-			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_DEFLATE_FAST;
-		break;
 		case deflate6 :
 		case deflate7 :
 		case deflate8 :
-			info.compression_method = ZIP_METHOD_DEFLATE;
-			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_DEFLATE_NORMAL;
-		break;
 		case deflate9 :
-			info.compression_method = ZIP_METHOD_DEFLATE;
-			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_DEFLATE_MAXIMUM;
-		break;
-		case implode_4kdict_2tree :
-			info.compression_method = ZIP_METHOD_IMPLODE;
-			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_IMPLODE_4KD2T;
-		break;
-		case implode_8kdict_2tree :
-			info.compression_method = ZIP_METHOD_IMPLODE;
-			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_IMPLODE_8KD2T;
-		break;
-		case implode_4kdict_3tree :
-			info.compression_method = ZIP_METHOD_IMPLODE;
-			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_IMPLODE_4KD3T;
-		break;
-		case implode_8kdict_3tree :
-			info.compression_method = ZIP_METHOD_IMPLODE;
-			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_IMPLODE_8KD3T;
-		break;
-		case bzip2 :
+			deflate = true;
+			break;
+		default:
+			throw error_unsupported() << "Unsupported compression method";
+	}
+
+	if (!deflate && info.compressed_size != info.uncompressed_size) {
+		throw error_invalid() << "Invalid size of stored data";
+	}
+
+	unsigned char* in = data_alloc(ZIP_TEST_BUFFER);
+	unsigned char* out = data_alloc(ZIP_TEST_BUFFER);
+
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (deflate && inflateInit2(&z, -MAX_WBITS) != Z_OK) {
+		data_free(in);
+		data_free(out);
+		throw error() << "Failed initialization of the decompressor";
+	}
+
+	try {
+		// the data not in memory is read from the zip, or from the zip it's copied from
+		zip_source* from = 0;
+		unsigned offset = 0;
+		if (!data) {
+			if (source) {
+				from = source;
+				offset = source_offset;
+			} else {
+				from = s;
+				offset = compressed_offset(s);
+			}
+		}
+		unsigned from_size = from ? from->st.st_size : 0;
+
+		unsigned remain = info.compressed_size;
+		unsigned done = 0;
+		crc_t crc = 0;
+
+		while (true) {
+			// get the next chunk of the compressed data
+			if (z.avail_in == 0 && remain != 0) {
+				unsigned run = remain < ZIP_TEST_BUFFER ? remain : ZIP_TEST_BUFFER;
+				unsigned pos = info.compressed_size - remain;
+				if (from) {
+					if (offset > from_size || pos + run > from_size - offset)
+						throw error_invalid() << "Truncated data";
+					zip_source_read(from, in, run, offset + pos);
+					z.next_in = in;
+				} else {
+					z.next_in = data + pos;
+				}
+				z.avail_in = run;
+				remain -= run;
+			}
+
+			if (!deflate) {
+				crc = crc_compute(crc, reinterpret_cast<const char*>(z.next_in), z.avail_in);
+				done += z.avail_in;
+				z.avail_in = 0;
+				if (remain == 0)
+					break;
+				continue;
+			}
+
+			z.next_out = out;
+			z.avail_out = ZIP_TEST_BUFFER;
+
+			int r = inflate(&z, Z_NO_FLUSH);
+
+			unsigned run = ZIP_TEST_BUFFER - z.avail_out;
+			crc = crc_compute(crc, reinterpret_cast<const char*>(out), run);
+			done += run;
+
+			if (r == Z_STREAM_END)
+				break;
+			if (r != Z_OK && r != Z_BUF_ERROR) {
+				throw error_invalid() << "Corrupted compressed data";
+			}
+			if (z.avail_in == 0 && remain == 0 && run == 0) {
+				throw error_invalid() << "Truncated compressed data";
+			}
+			if (done > info.uncompressed_size) {
+				throw error_invalid() << "Invalid uncompressed size";
+			}
+		}
+
+		if (z.avail_in != 0 || remain != 0) {
+			throw error_invalid() << "Invalid compressed size";
+		}
+		if (done != info.uncompressed_size) {
+			throw error_invalid() << "Invalid uncompressed size " << info.uncompressed_size << "/" << done;
+		}
+		if (crc != info.crc32) {
+			throw error_invalid() << "Invalid crc " << info.crc32 << "/" << crc;
+		}
+
+		// check the data descriptor following the data
+		if (from == s && has_descriptor()) {
+			unsigned char desc[ZIP_DO_FIXED];
+			unsigned pos = offset + info.compressed_size;
+
+			if (pos > from_size || ZIP_DO_FIXED - 4 > from_size - pos) {
+				throw error_invalid() << "Truncated data descriptor";
+			}
+			zip_source_read(s, desc, ZIP_DO_FIXED - 4, pos);
+
+			if (le_uint32_read(desc+ZIP_DO_header_signature) == 0x08074b50) {
+				if (ZIP_DO_FIXED > from_size - pos) {
+					throw error_invalid() << "Truncated data descriptor";
+				}
+				zip_source_read(s, desc + ZIP_DO_FIXED - 4, 4, pos + ZIP_DO_FIXED - 4);
+			} else {
+				// handle the case of the ZIP_DO_header_signature missing
+				memmove(desc + ZIP_DO_crc32, desc, ZIP_DO_FIXED - 4);
+				le_uint32_write(desc+ZIP_DO_header_signature, 0x08074b50);
+			}
+
+			check_descriptor(desc);
+		}
+	} catch (...) {
+		if (deflate)
+			inflateEnd(&z);
+		data_free(in);
+		data_free(out);
+		throw;
+	}
+
+	if (deflate)
+		inflateEnd(&z);
+	data_free(in);
+	data_free(out);
+}
+
+/**
+ * Test the entry decompressing the data and checking the crc.
+ * The local header is also checked against the central directory.
+ */
+void zip_entry::test() const
+{
+	zip_source* s = 0;
+
+	if (!data && !source)
+		s = zip_source_open(parentname_get(), zip::mmap_enable);
+
+	try {
+		test(s);
+	} catch (...) {
+		if (s)
+			zip_source_release(s);
+		throw;
+	}
+
+	if (s)
+		zip_source_release(s);
+}
+
+/**
+ * Set the compressed data from the zip file of another entry.
+ */
+void zip_entry::compressed_source(const zip_entry& A)
+{
+#if HAVE_OPEN_UNLINK
+	zip_source* s = zip_source_open(A.parentname_get(), zip::mmap_enable);
+
+	unsigned offset;
+	try {
+		offset = A.compressed_offset(s);
+	} catch (...) {
+		zip_source_release(s);
+		throw;
+	}
+
+	source = s;
+	source_offset = offset;
+#else
+	// the source zip may be overwritten before saving, read it now
+	unsigned char* buf = data_alloc(A.compressed_size_get());
+	try {
+		A.compressed_read(buf);
+	} catch (...) {
+		data_free(buf);
+		throw;
+	}
+
+	data = buf;
+#endif
+}
+
+/**
+ * Copy the compressed data of another entry.
+ * If the data isn't in memory, only a reference at the source zip is kept,
+ * and the data is copied directly from the source when saving.
+ */
+void zip_entry::compressed_copy(const zip_entry& A)
+{
+	unload();
+
+	if (A.compressed_size_get() == 0)
+		return;
+
+	if (A.data) {
+		data = data_dup(A.data, A.compressed_size_get());
+	} else if (A.source) {
+		source = A.source;
+		source_offset = A.source_offset;
+		zip_source_ref(source);
+	} else {
+		compressed_source(A);
+	}
+}
+
+/**
+ * Make the compressed data independent of the zip file.
+ * After that, the zip file can be overwritten.
+ */
+void zip_entry::compressed_detach()
+{
+	if (data || source || compressed_size_get() == 0)
+		return;
+
+	compressed_source(*this);
+}
+
+/**
+ * Size of the local header and data.
+ * It's an estimation, because the local extra field may be different than
+ * the central one, and the data descriptor is not considered.
+ */
+unsigned zip_entry::local_size_get() const
+{
+	return ZIP_LO_FIXED + info.filename_length + info.central_extra_field_length + info.compressed_size;
+}
+
+time_t zip_entry::time_get() const
+{
+	return zip2time(info.last_mod_file_date, info.last_mod_file_time);
+}
+
+void zip_entry::time_set(time_t tod)
+{
+	time2zip(tod, info.last_mod_file_date, info.last_mod_file_time);
+}
+
+void zip_entry::set(method_t method, const string& Aname, const unsigned char* compdata, unsigned compsize, unsigned size, unsigned crc, unsigned date, unsigned time, bool is_text)
+{
+	cent_detach();
+
+	info.version_needed_to_extract = 20; // version 2.0
+	info.os_needed_to_extract = 0;
+	info.version_made_by = 20; // version 2.0
+	info.host_os = 0;
+	info.general_purpose_bit_flag = 0; // default
+	info.last_mod_file_date = date;
+	info.last_mod_file_time = time;
+	info.crc32 = crc;
+	info.compressed_size = compsize;
+	info.uncompressed_size = size;
+	info.internal_file_attrib = is_text ? ZIP_INT_ATTR_TEXT : 0;
+	info.external_file_attrib = 0;
+
+	switch (method) {
+		case store :
+			if (size != compsize) {
+				throw error_invalid() << "Zip entry size mismatch";
+			}
+			info.compression_method = ZIP_METHOD_STORE;
+			info.version_needed_to_extract = 10; // Version 1.0
+		break;
+		case shrunk :
+			info.compression_method = ZIP_METHOD_SHRUNK;
+		break;
+		case reduce1 :
+			info.compression_method = ZIP_METHOD_REDUCE1;
+		break;
+		case reduce2 :
+			info.compression_method = ZIP_METHOD_REDUCE2;
+		break;
+		case reduce3 :
+			info.compression_method = ZIP_METHOD_REDUCE3;
+		break;
+		case reduce4 :
+			info.compression_method = ZIP_METHOD_REDUCE4;
+		break;
+		case deflate1 :
+		case deflate2 :
+			info.compression_method = ZIP_METHOD_DEFLATE;
+			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_DEFLATE_SUPERFAST;
+		break;
+		case deflate3 :
+		case deflate4 :
+		case deflate5 :
+			info.compression_method = ZIP_METHOD_DEFLATE;
+			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_DEFLATE_FAST;
+		break;
+		case deflate6 :
+		case deflate7 :
+		case deflate8 :
+			info.compression_method = ZIP_METHOD_DEFLATE;
+			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_DEFLATE_NORMAL;
+		break;
+		case deflate9 :
+			info.compression_method = ZIP_METHOD_DEFLATE;
+			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_DEFLATE_MAXIMUM;
+		break;
+		case implode_4kdict_2tree :
+			info.compression_method = ZIP_METHOD_IMPLODE;
+			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_IMPLODE_4KD2T;
+		break;
+		case implode_8kdict_2tree :
+			info.compression_method = ZIP_METHOD_IMPLODE;
+			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_IMPLODE_8KD2T;
+		break;
+		case implode_4kdict_3tree :
+			info.compression_method = ZIP_METHOD_IMPLODE;
+			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_IMPLODE_4KD3T;
+		break;
+		case implode_8kdict_3tree :
+			info.compression_method = ZIP_METHOD_IMPLODE;
+			info.general_purpose_bit_flag |= ZIP_GEN_FLAGS_IMPLODE_8KD3T;
+		break;
+		case bzip2 :
 			info.compression_method = ZIP_METHOD_BZIP2;
 		break;
 		case lzma :
@@ -444,6 +1169,8 @@ void zip_entry::set(method_t method, const string& Aname, const unsigned char* c
 
 void zip_entry::name_set(const string& Aname)
 {
+	cent_detach();
+
 	data_free(file_name);
 	info.filename_length = Aname.length();
 	file_name = data_alloc(info.filename_length);
@@ -550,6 +1277,37 @@ void zip_entry::unload()
 {
 	data_free(data);
 	data = 0;
+	if (source) {
+		zip_source_release(source);
+		source = 0;
+	}
+}
+
+/**
+ * Copy the name, extra field and comment pointing into the zip mapping.
+ * After that, the mapping can be released.
+ */
+void zip_entry::cent_detach()
+{
+	if (!cent_mapped)
+		return;
+
+	unsigned char* name = data_dup(file_name, info.filename_length);
+	unsigned char* extra = 0;
+	unsigned char* comment = 0;
+	try {
+		extra = data_dup(central_extra_field, info.central_extra_field_length);
+		comment = data_dup(file_comment, info.file_comment_length);
+	} catch (...) {
+		data_free(name);
+		data_free(extra);
+		throw;
+	}
+
+	file_name = name;
+	central_extra_field = extra;
+	file_comment = comment;
+	cent_mapped = false;
 }
 
 /**
@@ -621,6 +1379,75 @@ void zip_entry::load_local(const unsigned char* buf, FILE* f, unsigned size)
 	}
 }
 
+/**
+ * Load local file header from a mapped zip.
+ * The data isn't copied, the entry refers at the mapping.
+ * \param s Mapped source.
+ * \param offset Offset of the local header in the mapping.
+ * \param size Available size, at least ZIP_LO_FIXED.
+ * \return Size of the local header, data and data descriptor.
+ */
+unsigned zip_entry::load_local(zip_source* s, unsigned offset, unsigned size)
+{
+	assert(s->map && offset <= s->size && size <= s->size - offset && size >= ZIP_LO_FIXED);
+
+	const unsigned char* buf = s->map + offset;
+
+	check_local(buf);
+
+	// use the local extra_field_length. It may be different than the
+	// central directory version in some zips.
+	unsigned local_extra_field_length = le_uint16_read(buf+ZIP_LO_extra_field_length);
+
+	unsigned pos = ZIP_LO_FIXED;
+	size -= ZIP_LO_FIXED;
+
+	if (size < info.filename_length + local_extra_field_length) {
+		throw error_invalid() << "Overflow of filename";
+	}
+	size -= info.filename_length + local_extra_field_length;
+	pos += info.filename_length + local_extra_field_length;
+
+	if (size < info.compressed_size) {
+		throw error_invalid() << "Overflow of compressed data";
+	}
+	size -= info.compressed_size;
+
+	unsigned data_pos = pos;
+	pos += info.compressed_size;
+
+	// check the data descriptor
+	if ((le_uint16_read(buf+ZIP_LO_general_purpose_bit_flag) & ZIP_GEN_FLAGS_DEFLATE_ZERO) != 0) {
+		unsigned char data_desc[ZIP_DO_FIXED];
+		unsigned desc_offset;
+
+		// handle the case of the ZIP_DO_header_signature missing
+		if (size == ZIP_DO_FIXED - 4) {
+			le_uint32_write(data_desc+ZIP_DO_header_signature, 0x08074b50);
+			desc_offset = ZIP_DO_crc32;
+		} else {
+			desc_offset = 0;
+		}
+
+		if (size < ZIP_DO_FIXED - desc_offset) {
+			throw error_invalid() << "Overflow of data descriptor";
+		}
+
+		memcpy(data_desc + desc_offset, buf + pos, ZIP_DO_FIXED - desc_offset);
+		pos += ZIP_DO_FIXED - desc_offset;
+
+		check_descriptor(data_desc);
+	}
+
+	unload();
+
+	zip_source_ref(s);
+	source = s;
+	source_offset = offset + data_pos;
+
+	return pos;
+}
+
 /**
  * Save local file header.
  * \param f File seeked at correct position.
@@ -666,10 +1493,15 @@ void zip_entry::save_local(FILE* f)
 
 	// write data, directories don't have data
 	if (info.compressed_size) {
-		assert(data);
+		if (source) {
+			zip_source_copy(source, source_offset, info.compressed_size, f);
+			stats_add(stats_save_read, info.compressed_size);
+		} else {
+			assert(data);
 
-		if (fwrite(data, info.compressed_size, 1, f) != 1) {
-			throw error() << "Failed write";
+			if (fwrite(data, info.compressed_size, 1, f) != 1) {
+				throw error() << "Failed write";
+			}
 		}
 	}
 }
@@ -677,9 +1509,11 @@ void zip_entry::save_local(FILE* f)
 /**
  * Load cent dir.
  * \param buf Fixed size cent dir.
- * \param f File seeked after the fixed size cent dir.
+ * \param skip Size of the cent dir entry read.
+ * \param borrow If the name, extra field and comment have to point
+ * into buf instead of being copied. Used with the zip mapping.
  */
-void zip_entry::load_cent(const unsigned char* buf, unsigned& skip)
+void zip_entry::load_cent(const unsigned char* buf, unsigned& skip, bool borrow)
 {
 	const unsigned char* o_buf = buf;
 
@@ -705,21 +1539,39 @@ void zip_entry::load_cent(const unsigned char* buf, unsigned& skip)
 	info.relative_offset_of_local_header = le_uint32_read(buf+ZIP_CO_relative_offset_of_local_header);
 	buf += ZIP_CO_FIXED;
 
-	// read filename
-	data_free(file_name);
-	file_name = data_alloc(info.filename_length);
-	memcpy(file_name, buf, info.filename_length);
-	buf += info.filename_length;
+	if (!cent_mapped) {
+		data_free(file_name);
+		data_free(central_extra_field);
+		data_free(file_comment);
+	}
+	file_name = 0;
+	central_extra_field = 0;
+	file_comment = 0;
+	cent_mapped = false;
 
-	// read extra field
-	data_free(central_extra_field);
-	central_extra_field = data_dup(buf, info.central_extra_field_length);
-	buf += info.central_extra_field_length;
+	if (borrow) {
+		unsigned char* p = const_cast<unsigned char*>(buf);
 
-	// read comment
-	data_free(file_comment);
-	file_comment = data_dup(buf, info.file_comment_length);
-	buf += info.file_comment_length;
+		file_name = p;
+		central_extra_field = p + info.filename_length;
+		file_comment = p + info.filename_length + info.central_extra_field_length;
+		cent_mapped = true;
+
+		buf += info.filename_length + info.central_extra_field_length + info.file_comment_length;
+	} else {
+		// read filename
+		file_name = data_alloc(info.filename_length);
+		memcpy(file_name, buf, info.filename_length);
+		buf += info.filename_length;
+
+		// read extra field
+		central_extra_field = data_dup(buf, info.central_extra_field_length);
+		buf += info.central_extra_field_length;
+
+		// read comment
+		file_comment = data_dup(buf, info.file_comment_length);
+		buf += info.file_comment_length;
+	}
 
 	skip = buf - o_buf;
 }
@@ -778,14 +1630,22 @@ zip::zip(const std::string& Apath) : path(Apath)
 	flag.open = false;
 	flag.read = false;
 	flag.modify = false;
+	flag.rewrite = false;
+	disk.size = 0;
+	disk.mtime = 0;
+	disk.count = 0;
 	zipfile_comment = 0;
+	mapping = 0;
 }
 
 zip::zip(const zip& A) : map(A.map), path(A.path)
 {
 	flag = A.flag;
 	info = A.info;
+	disk = A.disk;
 	zipfile_comment = data_dup(A.zipfile_comment, A.info.zipfile_comment_length);
+	// the copied entries don't use the mapping
+	mapping = 0;
 }
 
 zip::~zip()
@@ -803,57 +1663,57 @@ void zip::create()
 	data_free(zipfile_comment);
 	zipfile_comment = 0;
 
+	disk.size = 0;
+	disk.mtime = 0;
+	disk.count = 0;
+
 	flag.read = true;
 	flag.open = true;
 	flag.modify = false;
+	flag.rewrite = true;
 }
 
 void zip::open()
 {
-	assert(!flag.open);
-
-	struct stat s;
-	if (stat(path.c_str(), &s) != 0) {
-		if (errno != ENOENT)
-			throw error() << "Failed stat";
-
-		// create the file if it's missing
-		create();
-		return;
-	}
-
-	unsigned length = s.st_size;
-
-	// open file
-	FILE* f = fopen(path.c_str(), "rb");
-	if (!f)
-		throw error() << "Failed open for reading";
-
-	unsigned char* data = 0;
-	unsigned data_size = 0;
-
-	try {
-		if (!cent_read(f, length, data, data_size))
-			throw error_invalid() << "Failed read end of central directory";
-	} catch (...) {
-		fclose(f);
-		throw;
-	}
+	open_cent(0);
+}
 
-	fclose(f);
+/**
+ * Open a zip using a copy of its central directory.
+ * If the copy doesn't match the file, the central directory is read
+ * from the file, and the copy is updated.
+ * \return If the copy was updated.
+ */
+bool zip::open(zip_cent& cent)
+{
+	return open_cent(&cent);
+}
 
+/**
+ * Parse the central directory.
+ * \param data Central directory and end of central directory.
+ * \param data_size Size of the data.
+ * \param length Size of the file.
+ * \param borrow If the entries can point into the data. Used with the zip mapping.
+ */
+void zip::cent_parse(const unsigned char* data, unsigned data_size, unsigned length, bool borrow)
+{
 	// position in data
 	unsigned data_pos = 0;
 
 	try {
 		// central dir
-		while (le_uint32_read(data+data_pos) == ZIP_C_signature) {
+		while (data_size - data_pos >= 4 && le_uint32_read(data+data_pos) == ZIP_C_signature) {
+
+			if (data_size - data_pos < ZIP_CO_FIXED
+				|| data_size - data_pos < ZIP_CO_FIXED + le_uint16_read(data+data_pos+ZIP_CO_filename_length) + le_uint16_read(data+data_pos+ZIP_CO_extra_field_length) + le_uint16_read(data+data_pos+ZIP_CO_file_comment_length))
+				throw error_invalid() << "Overflow of central directory";
 
 			iterator i = map.insert(map.end(), zip_entry(path));
 
 			unsigned skip = 0;
 			try {
-				i->load_cent(data + data_pos, skip);
+				i->load_cent(data + data_pos, skip, borrow);
 			} catch (...) {
 				map.erase(i);
 				throw;
@@ -863,7 +1723,7 @@ void zip::open()
 		}
 
 		// end of central dir
-		if (le_uint32_read(data+data_pos) != ZIP_E_signature)
+		if (data_size - data_pos < ZIP_EO_FIXED || le_uint32_read(data+data_pos) != ZIP_E_signature)
 			throw error_invalid() << "Invalid end of central dir signature";
 
 		info.offset_to_start_of_cent_dir = le_uint32_read(data+data_pos+ZIP_EO_offset_to_start_of_cent_dir);
@@ -874,27 +1734,138 @@ void zip::open()
 			throw error_invalid() << "Invalid end of central directory start address";
 
 		// comment
+		if (data_size - data_pos < info.zipfile_comment_length)
+			throw error_invalid() << "Overflow of zipfile comment";
 		data_free(zipfile_comment);
 		zipfile_comment = data_dup(data+data_pos, info.zipfile_comment_length);
 		data_pos += info.zipfile_comment_length;
 
+		if (pedantic) {
+			// don't accept garbage at the end of file
+			if (data_pos != data_size)
+				throw error_invalid() << data_size - data_pos << " unused bytes at the end of the central directory";
+		}
 	} catch (...) {
-		data_free(data);
+		// the entries may point into the data
+		map.erase(map.begin(), map.end());
 		throw;
 	}
+}
 
-	// delete cent data
-	data_free(data);
+/**
+ * Open a zip reading the central directory.
+ * \param cent Copy of the central directory to use, if it matches the file.
+ * Otherwise, it's updated with the one read. It may be 0.
+ * \return If the copy was updated.
+ */
+bool zip::open_cent(zip_cent* cent)
+{
+	assert(!flag.open);
+
+	struct stat s;
+	if (stat(path.c_str(), &s) != 0) {
+		if (errno != ENOENT)
+			throw error() << "Failed stat";
 
-	if (pedantic) {
-		// don't accept garbage at the end of file
-		if (data_pos != data_size)
-			throw error_invalid() << data_size - data_pos << " unused bytes at the end of the central directory";
+		// create the file if it's missing
+		create();
+
+		if (cent && !cent->data.empty()) {
+			cent->data.clear();
+			return true;
+		}
+
+		return false;
 	}
 
+	unsigned length = s.st_size;
+	bool updated = false;
+
+	if (cent
+		&& !cent->data.empty()
+		&& cent->size == length
+		&& cent->mtime == s.st_mtime
+		&& cent->inode == static_cast<unsigned long long>(s.st_ino)
+	) {
+		// the file is not changed, use the copy
+		cent_parse(reinterpret_cast<const unsigned char*>(cent->data.data()), cent->data.size(), length, false);
+	} else {
+		if (mmap_enable) {
+			zip_source* m = zip_source_open(path, true);
+
+			// use the mapping only if it's of the file just checked
+			if (m->map && m->size == length)
+				mapping = m;
+			else
+				zip_source_release(m);
+		}
+
+		// cent data, allocated if not mapped
+		const unsigned char* data = 0;
+		unsigned char* data_alloced = 0;
+		unsigned data_size = 0;
+
+		if (mapping) {
+			if (!cent_map(mapping->map, length, data, data_size)) {
+				zip_source_release(mapping);
+				mapping = 0;
+				throw error_invalid() << "Failed read end of central directory";
+			}
+		} else {
+			// open file
+			FILE* f = fopen(path.c_str(), "rb");
+			if (!f)
+				throw error() << "Failed open for reading";
+
+			try {
+				if (!cent_read(f, length, data_alloced, data_size))
+					throw error_invalid() << "Failed read end of central directory";
+			} catch (...) {
+				fclose(f);
+				throw;
+			}
+
+			fclose(f);
+
+			data = data_alloced;
+		}
+
+		try {
+			cent_parse(data, data_size, length, mapping != 0);
+
+			if (cent) {
+				cent->data.assign(reinterpret_cast<const char*>(data), data_size);
+				cent->size = length;
+				cent->mtime = s.st_mtime;
+				cent->inode = s.st_ino;
+				updated = true;
+			}
+		} catch (...) {
+			map.erase(map.begin(), map.end());
+			if (mapping) {
+				zip_source_release(mapping);
+				mapping = 0;
+			}
+			data_free(data_alloced);
+			throw;
+		}
+
+		// delete cent data
+		data_free(data_alloced);
+	}
+
+	disk.size = length;
+	disk.mtime = s.st_mtime;
+	disk.count = map.size();
+
 	flag.open = true;
 	flag.read = false;
 	flag.modify = false;
+	flag.rewrite = false;
+
+	stats_add(stats_zip_open);
+
+	return updated;
 }
 
 /**
@@ -910,6 +1881,27 @@ void zip::close()
 	zipfile_comment = 0;
 	path = "";
 	map.erase(map.begin(), map.end());
+	// after the entries, as they may point into the mapping
+	if (mapping) {
+		zip_source_release(mapping);
+		mapping = 0;
+	}
+}
+
+/**
+ * Stop using the mapping for the central directory.
+ * It must be called before writing the file.
+ */
+void zip::mapping_release()
+{
+	if (!mapping)
+		return;
+
+	for(iterator i=map.begin();i!=map.end();++i)
+		i->cent_detach();
+
+	zip_source_release(mapping);
+	mapping = 0;
 }
 
 /**
@@ -938,78 +1930,100 @@ void zip::reopen()
 	open();
 }
 
+/**
+ * Compare the entries by offset of the local header.
+ */
+struct zip_entry_offset_less {
+	bool operator()(const zip::iterator& A, const zip::iterator& B) const {
+		return A->offset_get() < B->offset_get();
+	}
+};
+
+#define ZIP_LOAD_BUFFER_SIZE (256*1024)
+
 /**
  * Load a zip file.
+ * If the zip is mapped, the entries refer at the mapping without copying the data.
  */
 void zip::load()
 {
-	assert(flag.open && !flag.read);
+	assert(flag.open && !flag.read && !flag.modify);
 
 	flag.modify = false;
 
-	FILE* f = fopen(path.c_str(), "rb");
-	if (!f)
-		throw error() << "Failed open for reading";
+	// entries in the file order, the ones with the same offset in the zip order
+	vector<iterator> order;
+	order.reserve(size());
+	for(iterator i=begin();i!=end();++i)
+		order.insert(order.end(), i);
+	stable_sort(order.begin(), order.end(), zip_entry_offset_less());
+
+	FILE* f = 0;
+	unsigned char* f_buffer = 0;
+	if (!mapping) {
+		f = fopen(path.c_str(), "rb");
+		if (!f)
+			throw error() << "Failed open for reading";
+
+		// the file is read sequentially, with a few seeks for holes
+		f_buffer = (unsigned char*)malloc(ZIP_LOAD_BUFFER_SIZE);
+		if (f_buffer)
+			setvbuf(f, (char*)f_buffer, _IOFBF, ZIP_LOAD_BUFFER_SIZE);
+
+#if HAVE_POSIX_FADVISE && defined(POSIX_FADV_SEQUENTIAL)
+		posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	}
 
 	try {
-		long offset = 0;
+		unsigned long offset = 0;
 		unsigned count = 0;
+		unsigned j = 0;
 
-		while (static_cast<unsigned long>(offset) < info.offset_to_start_of_cent_dir) {
+		while (offset < info.offset_to_start_of_cent_dir) {
 			unsigned char buf[ZIP_LO_FIXED];
 
-			// search the next item, assume entries in random order
-			iterator next;
-			bool next_set = false;
-			for(iterator i=begin();i!=end();++i) {
-				if (i->offset_get() >= static_cast<unsigned long>(offset)) {
-					if (!next_set || i->offset_get() < next->offset_get()) {
-						next_set = true;
-						next = i;
-					}
-				}
-			}
+			// skip the entries overlapping the previous one, they are
+			// never loaded and reported as missing local headers
+			while (j < order.size() && order[j]->offset_get() < offset)
+				++j;
 
 			// if not found exit
-			if (!next_set) {
+			if (j == order.size()) {
 				if (pedantic)
-					throw error_invalid() << info.offset_to_start_of_cent_dir - static_cast<unsigned long>(offset) << " unused bytes after the last local header at offset " << offset;
+					throw error_invalid() << info.offset_to_start_of_cent_dir - offset << " unused bytes after the last local header at offset " << offset;
 				else
 					break;
 			}
 
+			iterator next = order[j];
+			++j;
+
 			// check for invalid start
 			if (next->offset_get() >= info.offset_to_start_of_cent_dir) {
 				throw error_invalid() << "Overflow in central directory";
 			}
 
 			// check for a data hole
-			if (next->offset_get() > static_cast<unsigned long>(offset)) {
+			if (next->offset_get() > offset) {
 				if (pedantic)
-					throw error_invalid() << next->offset_get() - static_cast<unsigned long>(offset) << " unused bytes at offset " << offset;
+					throw error_invalid() << next->offset_get() - offset << " unused bytes at offset " << offset;
 				else {
 					// set the correct position
-					if (fseek(f, next->offset_get(), SEEK_SET) != 0)
+					if (f && fseek(f, next->offset_get(), SEEK_SET) != 0)
 						throw error() << "Failed fseek";
 					offset = next->offset_get();
 				}
 			}
 
-			// search the next item, assume entries in random order
-			iterator next_next;
-			bool next_next_set = false;
-			for(iterator i=begin();i!=end();++i) {
-				if (i->offset_get() > static_cast<unsigned long>(offset)) {
-					if (!next_next_set || i->offset_get() < next_next->offset_get()) {
-						next_next_set = true;
-						next_next = i;
-					}
-				}
-			}
+			// the next item with a greater offset
+			unsigned k = j;
+			while (k < order.size() && order[k]->offset_get() <= offset)
+				++k;
 
 			unsigned long end_offset;
-			if (next_next_set)
-				end_offset = next_next->offset_get();
+			if (k < order.size())
+				end_offset = order[k]->offset_get();
 			else
 				end_offset = info.offset_to_start_of_cent_dir;
 
@@ -1017,19 +2031,24 @@ void zip::load()
 				throw error_invalid() << "Invalid local header size at offset " << offset;
 			}
 
-			if (fread(buf, ZIP_LO_FIXED, 1, f) != 1)
-				throw error() << "Failed read";
+			if (mapping) {
+				offset = next->offset_get() + next->load_local(mapping, next->offset_get(), end_offset - next->offset_get());
+			} else {
+				if (fread(buf, ZIP_LO_FIXED, 1, f) != 1)
+					throw error() << "Failed read";
 
-			next->load_local(buf, f, end_offset - next->offset_get() - ZIP_LO_FIXED);
+				next->load_local(buf, f, end_offset - next->offset_get() - ZIP_LO_FIXED);
 
-			++count;
+				long pos = ftell(f);
+				if (pos < 0)
+					throw error() << "Failed tell";
+				offset = pos;
+			}
 
-			offset = ftell(f);
-			if (offset < 0)
-				throw error() << "Failed tell";
+			++count;
 		}
 
-		if (static_cast<unsigned long>(offset) != info.offset_to_start_of_cent_dir) {
+		if (offset != info.offset_to_start_of_cent_dir) {
 			if (pedantic)
 				throw error_invalid() << "Invalid central directory start";
 		}
@@ -1038,11 +2057,18 @@ void zip::load()
 			throw error_invalid() << "Invalid central directory, expected " << size() << " local headers, got " << count;
 
 	} catch (...) {
-		fclose(f);
+		if (f)
+			fclose(f);
+		free(f_buffer);
 		throw;
 	}
 
-	fclose(f);
+	if (f)
+		fclose(f);
+	free(f_buffer);
+
+	stats_add(stats_zip_load);
+	stats_add(stats_load_read, info.offset_to_start_of_cent_dir);
 
 	flag.read = true;
 }
@@ -1062,93 +2088,286 @@ unsigned zip::size_not_zero() const
 }
 
 /**
- * Save a zip file.
+ * Store the file information used to detect external changes.
  */
-void zip::save()
+void zip::disk_set()
 {
-	assert(flag.open && flag.read);
+	struct stat s;
+	if (stat(path.c_str(), &s) != 0)
+		throw error() << "Failed stat of " << path;
 
-	flag.modify = false;
+	disk.size = s.st_size;
+	disk.mtime = s.st_mtime;
+	disk.count = map.size();
 
-	if (!empty()) {
-		// prevent external signal
-		sig_auto_lock sal;
+	flag.rewrite = false;
+}
 
-		// temp name of the saved file
-		string save_path = file_temp(path);
+/**
+ * Write the central directory and the end of central directory.
+ * \param f File seeked after the last local header.
+ */
+void zip::save_cent(FILE* f)
+{
+	long cent_offset = ftell(f);
+	if (cent_offset<0)
+		throw error() << "Failed tell";
 
-		FILE* f = fopen(save_path.c_str(), "wb");
-		if (!f)
-			throw error() << "Failed open for writing of " << save_path;
+	// new cent start
+	info.offset_to_start_of_cent_dir = cent_offset;
 
-		try {
-			// write local header
-			for(iterator i=begin();i!=end();++i)
-				i->save_local(f);
-
-			long cent_offset = ftell(f);
-			if (cent_offset<0)
-				throw error() << "Failed tell";
-
-			// new cent start
-			info.offset_to_start_of_cent_dir = cent_offset;
-
-			// write cent dir
-			for(iterator i=begin();i!=end();++i)
-				i->save_cent(f);
-
-			long end_cent_offset = ftell(f);
-			if (end_cent_offset<0)
-				throw error() << "Failed tell";
-
-			// write end of cent dir
-			unsigned char buf[ZIP_EO_FIXED];
-			le_uint32_write(buf+ZIP_EO_end_of_central_dir_signature, ZIP_E_signature);
-			le_uint16_write(buf+ZIP_EO_number_of_this_disk, ZIP_UNIQUE_DISK);
-			le_uint16_write(buf+ZIP_EO_number_of_disk_start_cent_dir, ZIP_UNIQUE_DISK);
-			le_uint16_write(buf+ZIP_EO_total_entries_cent_dir_this_disk, size());
-			le_uint16_write(buf+ZIP_EO_total_entries_cent_dir, size());
-			le_uint32_write(buf+ZIP_EO_size_of_cent_dir, end_cent_offset - cent_offset);
-			le_uint32_write(buf+ZIP_EO_offset_to_start_of_cent_dir, cent_offset);
-			le_uint16_write(buf+ZIP_EO_zipfile_comment_length, info.zipfile_comment_length);
-
-			if (fwrite(buf, ZIP_EO_FIXED, 1, f) != 1)
-				throw error() << "Failed write";
+	// write cent dir
+	for(iterator i=begin();i!=end();++i)
+		i->save_cent(f);
 
-			// write comment
-			if (info.zipfile_comment_length && fwrite(zipfile_comment, info.zipfile_comment_length, 1, f) != 1)
-				throw error() << "Failed write";
+	long end_cent_offset = ftell(f);
+	if (end_cent_offset<0)
+		throw error() << "Failed tell";
 
-		} catch (...) {
-			fclose(f);
-			remove(save_path.c_str());
-			throw;
-		}
+	// write end of cent dir
+	unsigned char buf[ZIP_EO_FIXED];
+	le_uint32_write(buf+ZIP_EO_end_of_central_dir_signature, ZIP_E_signature);
+	le_uint16_write(buf+ZIP_EO_number_of_this_disk, ZIP_UNIQUE_DISK);
+	le_uint16_write(buf+ZIP_EO_number_of_disk_start_cent_dir, ZIP_UNIQUE_DISK);
+	le_uint16_write(buf+ZIP_EO_total_entries_cent_dir_this_disk, size());
+	le_uint16_write(buf+ZIP_EO_total_entries_cent_dir, size());
+	le_uint32_write(buf+ZIP_EO_size_of_cent_dir, end_cent_offset - cent_offset);
+	le_uint32_write(buf+ZIP_EO_offset_to_start_of_cent_dir, cent_offset);
+	le_uint16_write(buf+ZIP_EO_zipfile_comment_length, info.zipfile_comment_length);
+
+	if (fwrite(buf, ZIP_EO_FIXED, 1, f) != 1)
+		throw error() << "Failed write";
+
+	// write comment
+	if (info.zipfile_comment_length && fwrite(zipfile_comment, info.zipfile_comment_length, 1, f) != 1)
+		throw error() << "Failed write";
+}
 
+/**
+ * Check if the zip can be saved appending the new entries.
+ */
+bool zip::save_append_check()
+{
+#if HAVE_FTRUNCATE
+	// removed or renamed entries require a rewrite
+	if (flag.rewrite)
+		return false;
+
+	if (disk.count == 0 || disk.count > map.size())
+		return false;
+
+	// the file must be the same read
+	struct stat s;
+	if (stat(path.c_str(), &s) != 0)
+		return false;
+	if (static_cast<unsigned>(s.st_size) != disk.size || s.st_mtime != disk.mtime)
+		return false;
+
+	double used = 0;
+	const_iterator i = begin();
+	for(unsigned n=0;n<disk.count;++n,++i) {
+		// the data descriptor bit is cleared when writing the central
+		// directory, and it must match the one in the local header
+		if (i->has_descriptor())
+			return false;
+
+		used += i->local_size_get();
+	}
+
+	// don't preserve too much unused space, including the old central
+	// directory that is left in the file
+	double waste = disk.size - used;
+	if (waste * 100 > static_cast<double>(append_waste) * disk.size)
+		return false;
+
+	// the old end of central directory must remain in the area searched
+	// by cent_read() until the new one is written
+	double append = ZIP_EO_FIXED + info.zipfile_comment_length;
+	for(;i!=end();++i)
+		append += ZIP_LO_FIXED + i->info.filename_length + i->info.local_extra_field_length + i->info.compressed_size;
+	for(i=begin();i!=end();++i)
+		append += ZIP_CO_FIXED + i->info.filename_length + i->info.central_extra_field_length + i->info.file_comment_length;
+	append += ZIP_EO_FIXED + info.zipfile_comment_length;
+	if (append > ECD_READ_MAX)
+		return false;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/**
+ * Save the zip appending the new entries and the new central directory
+ * after the old end of central directory, that is never overwritten.
+ * Until the new end of central directory is written, the old one is still
+ * the last in the file, and the zip is read as before, because
+ * save_append_check() allows to append only data that keeps it in the
+ * area searched by cent_read(). The old central directory is left as
+ * unused space, counted by save_append_check().
+ */
+void zip::save_append()
+{
+#if HAVE_FTRUNCATE
+	FILE* f = fopen(path.c_str(), "r+b");
+	if (!f)
+		throw error() << "Failed open for writing of " << path;
+
+	unsigned tail_offset = info.offset_to_start_of_cent_dir;
+
+	// the shared source of the file doesn't have the new entries
+	zip_source_forget(path);
+
+	try {
+		if (fseek(f, disk.size, SEEK_SET) != 0)
+			throw error() << "Failed seek";
+
+		// write the new local headers
+		iterator i = begin();
+		for(unsigned n=0;n<disk.count;++n)
+			++i;
+		for(;i!=end();++i)
+			i->save_local(f);
+
+		save_cent(f);
+
+		long end_offset = ftell(f);
+		if (end_offset<0)
+			throw error() << "Failed tell";
+
+		if (fflush(f) != 0)
+			throw error() << "Failed write";
+
+#if HAVE_FSYNC
+		// the new data must be on disk before the file is considered saved
+		if (fsync(fileno(f)) != 0)
+			throw error() << "Failed sync";
+#endif
+
+		stats_add(stats_save_write, end_offset - disk.size);
+	} catch (...) {
+		// remove the partial data, the old zip is untouched
+		fflush(f);
+		ftruncate(fileno(f), disk.size);
 		fclose(f);
+		info.offset_to_start_of_cent_dir = tail_offset;
+		throw;
+	}
 
-		// delete the file if exists
-		if (access(path.c_str(), F_OK) == 0) {
-			if (remove(path.c_str()) != 0) {
-				remove(save_path.c_str());
-				throw error() << "Failed delete of " << path;
-			}
-		}
+	if (fclose(f) != 0)
+		throw error() << "Failed close of " << path;
+
+	disk_set();
+#else
+	save_rewrite();
+#endif
+}
+
+/**
+ * Save the zip writing a new file.
+ */
+void zip::save_rewrite()
+{
+	// get the data not loaded, before overwriting the file
+	for(iterator i=begin();i!=end();++i)
+		i->compressed_detach();
 
-		// rename the new version with the correct name
-		if (::rename(save_path.c_str(), path.c_str()) != 0) {
-			throw error() << "Failed rename of " << save_path << " to " << path;
+	// temp name of the saved file
+	string save_path = file_temp(path);
+
+	FILE* f = fopen(save_path.c_str(), "wb");
+	if (!f)
+		throw error() << "Failed open for writing of " << save_path;
+
+	try {
+		// write local header
+		for(iterator i=begin();i!=end();++i)
+			i->save_local(f);
+
+		save_cent(f);
+
+		long end_offset = ftell(f);
+		if (end_offset<0)
+			throw error() << "Failed tell";
+
+		stats_add(stats_save_write, end_offset);
+	} catch (...) {
+		fclose(f);
+		remove(save_path.c_str());
+		throw;
+	}
+
+	fclose(f);
+
+	// the file is going to be replaced
+	zip_source_forget(path);
+
+	// delete the file if exists
+	if (access(path.c_str(), F_OK) == 0) {
+		if (remove(path.c_str()) != 0) {
+			remove(save_path.c_str());
+			throw error() << "Failed delete of " << path;
 		}
+	}
 
+	// rename the new version with the correct name
+	if (::rename(save_path.c_str(), path.c_str()) != 0) {
+		throw error() << "Failed rename of " << save_path << " to " << path;
+	}
+
+	disk_set();
+}
+
+/**
+ * Save a zip file.
+ * If possible, only the new entries and the central directory are written.
+ */
+void zip::save()
+{
+	assert(flag.open);
+
+	stats_phase sp(stats_phase_save);
+
+	// the old central directory is going to be overwritten
+	mapping_release();
+
+	flag.modify = false;
+
+	if (!empty()) {
+		// prevent external signal
+		sig_auto_lock sal;
+
+		if (save_append_check())
+			save_append();
+		else
+			save_rewrite();
+
+		stats_add(stats_zip_save);
 	} else {
 		// reset the cent start
 		info.offset_to_start_of_cent_dir = 0;
 
+		// the file is going to be deleted
+		zip_source_forget(path);
+
 		// delete the file if exists
 		if (access(path.c_str(), F_OK) == 0) {
 			if (remove(path.c_str()) != 0)
 				throw error() << "Failed delete of " << path;
+
+			stats_add(stats_zip_delete);
 		}
+
+		disk.size = 0;
+		disk.mtime = 0;
+		disk.count = 0;
+		flag.rewrite = true;
+	}
+
+	// if not loaded, drop the data now saved in the file
+	if (!flag.read) {
+		for(iterator i=begin();i!=end();++i)
+			i->unload();
 	}
 }
 
@@ -1157,9 +2376,10 @@ void zip::save()
  */
 void zip::erase(iterator i)
 {
-	assert(flag.read);
+	assert(flag.open);
 
 	flag.modify = true;
+	flag.rewrite = true;
 
 	map.erase(i);
 }
@@ -1170,9 +2390,10 @@ void zip::erase(iterator i)
  */
 void zip::rename(iterator i, const string& Aname)
 {
-	assert(flag.read);
+	assert(flag.open);
 
 	flag.modify = true;
+	flag.rewrite = true;
 
 	i->name_set(Aname);
 }
@@ -1184,31 +2405,23 @@ zip::iterator zip::insert(const zip_entry& A, const string& Aname)
 {
 	iterator i;
 
-	assert(flag.read);
+	assert(flag.open);
 
-	unsigned char* data = data_alloc(A.compressed_size_get());
-	assert(data);
+	i = map.insert(map.end(), zip_entry(path));
 
 	try {
-		A.compressed_read(data);
-
-		i = map.insert(map.end(), zip_entry(path));
-
-		try {
-			i->set(A.method_get(), Aname, data, A.compressed_size_get(), A.uncompressed_size_get(), A.crc_get(), A.zipdate_get(), A.ziptime_get(), A.is_text());
-		} catch (...) {
-			map.erase(i);
-			throw;
-		}
+		i->set(A.method_get(), Aname, 0, A.compressed_size_get(), A.uncompressed_size_get(), A.crc_get(), A.zipdate_get(), A.ziptime_get(), A.is_text());
 
-		flag.modify = true;
+		i->compressed_copy(A);
 
+		// the copy has the same data
+		i->damaged = A.damaged;
 	} catch (...) {
-		data_free(data);
+		map.erase(i);
 		throw;
 	}
 
-	data_free(data);
+	flag.modify = true;
 
 	return i;
 }
@@ -1221,7 +2434,7 @@ zip::iterator zip::insert_uncompressed(const string& Aname, const unsigned char*
 {
 	iterator i;
 
-	assert(flag.read);
+	assert(flag.open);
 	assert(crc == crc32(0, (const unsigned char*)data, size));
 
 	unsigned date = 0;
@@ -1242,3 +2455,60 @@ zip::iterator zip::insert_uncompressed(const string& Aname, const unsigned char*
 	return i;
 }
 
+/**
+ * Test all the entries decompressing the data and checking the crc.
+ * It stops at the first error.
+ */
+void zip::test() const
+{
+	assert(flag.open);
+
+	zip_source* s = zip_source_open(path, mmap_enable);
+
+	try {
+		for(const_iterator i=begin();i!=end();++i) {
+			try {
+				i->test(s);
+			} catch (error_invalid& e) {
+				throw e << " on file " << i->name_get();
+			}
+		}
+	} catch (...) {
+		zip_source_release(s);
+		throw;
+	}
+
+	zip_source_release(s);
+}
+
+/**
+ * Verify all the entries decompressing the data and checking the crc.
+ * The entries with errors are marked as damaged, and the test continues.
+ * It's safe to call it concurrently on different zips.
+ * \param report Where the errors found are appended.
+ */
+void zip::verify(list<string>& report)
+{
+	assert(flag.open);
+
+	// the data is read with pread() from the shared source, as by compressed_read()
+	zip_source* s = zip_source_open(path, mmap_enable);
+
+	for(iterator i=begin();i!=end();++i) {
+		try {
+			i->test(s);
+			i->damaged = false;
+		} catch (error_invalid& e) {
+			i->damaged = true;
+			report.insert(report.end(), e.desc_get() + " on file " + i->name_get());
+		} catch (error_unsupported& e) {
+			// not damaged, only not verified
+			report.insert(report.end(), e.desc_get() + " on file " + i->name_get());
+		} catch (...) {
+			zip_source_release(s);
+			throw;
+		}
+	}
+
+	zip_source_release(s);
+}
@@ -154,6 +154,8 @@ time_t zip2time(unsigned date, unsigned time);
 
 class zip;
 
+struct zip_source;
+
 class zip_entry {
 public:
 	enum method_t {
@@ -191,25 +193,36 @@ private:
 	unsigned char* local_extra_field;
 	unsigned char* central_extra_field;
 	unsigned char* data;
+	zip_source* source; // source file of the data, if not in memory
+	unsigned source_offset; // offset of the data in the source file
+	bool cent_mapped; // name, extra field and comment point into the zip mapping
+	bool damaged; // data not matching the headers, detected by zip::verify()
 
 	void check_cent(const unsigned char* buf) const;
 	void check_local(const unsigned char* buf) const;
 	void check_descriptor(const unsigned char* buf) const;
 
+	void compressed_source(const zip_entry& A);
+	unsigned compressed_offset(zip_source* s) const;
+	void test(zip_source* s) const;
+
 	zip_entry();
 	zip_entry& operator=(const zip_entry&);
 	bool operator==(const zip_entry&) const;
 	bool operator!=(const zip_entry&) const;
 
+	friend class zip;
 public:
 	zip_entry(const zip& Aparent);
 	zip_entry(const zip_entry& A);
 	~zip_entry();
 
 	void load_local(const unsigned char* buf, FILE* f, unsigned size);
+	unsigned load_local(zip_source* s, unsigned offset, unsigned size);
 	void save_local(FILE* f);
-	void load_cent(const unsigned char* buf, unsigned& skip);
+	void load_cent(const unsigned char* buf, unsigned& skip, bool borrow);
 	void save_cent(FILE* f);
+	void cent_detach();
 	void unload();
 
 	method_t method_get() const;
@@ -222,12 +235,17 @@ public:
 
 	void compressed_seek(FILE* f) const;
 	void compressed_read(unsigned char* outdata) const;
+	void compressed_copy(const zip_entry& A);
+	void compressed_detach();
 	void uncompressed_read(unsigned char* outdata) const;
 
 	const std::string& parentname_get() const { return parent_name; }
 	void name_set(const std::string& Aname);
 	std::string name_get() const;
 	unsigned offset_get() const { return info.relative_offset_of_local_header; }
+	unsigned local_size_get() const;
+	bool has_descriptor() const { return (info.general_purpose_bit_flag & ZIP_GEN_FLAGS_DEFLATE_ZERO) != 0; }
+	bool is_damaged() const { return damaged; }
 
 	unsigned zipdate_get() const { return info.last_mod_file_date; }
 	unsigned ziptime_get() const { return info.last_mod_file_time; }
@@ -243,11 +261,23 @@ public:
 
 typedef std::list<zip_entry> zip_entry_list;
 
+/**
+ * Copy of the central directory of a zip file.
+ * The file information is used to detect if the copy is still valid.
+ */
+struct zip_cent {
+	unsigned size; // size of the file
+	time_t mtime; // modification time of the file
+	unsigned long long inode; // inode of the file
+	std::string data; // central directory and end of central directory
+};
+
 class zip {
 	struct {
 		bool open; // zip is opened
 		bool read; // zip is loaded (valid only if flag_open==true)
-		bool modify; // zip is modified (valid only if flag_read==true)
+		bool modify; // zip is modified
+		bool rewrite; // zip has removed or renamed entries, or it's new
 	} flag;
 
 	struct {
@@ -255,19 +285,39 @@ class zip {
 		unsigned zipfile_comment_length;
 	} info;
 
+	struct {
+		unsigned size; // size of the file
+		time_t mtime; // modification time of the file
+		unsigned count; // number of entries in the file
+	} disk;
+
 	unsigned char* zipfile_comment;
 	zip_entry_list map;
 	std::string path;
+	zip_source* mapping; // mapping of the file used by the central directory, 0 if none
 
 	zip& operator=(const zip&);
 	bool operator==(const zip&) const;
 	bool operator!=(const zip&) const;
 
 	static bool pedantic;
+	static unsigned append_waste;
+	static bool mmap_enable;
+
+	void save_cent(FILE* f);
+	bool save_append_check();
+	void save_append();
+	void save_rewrite();
+	void disk_set();
+	void mapping_release();
+	bool open_cent(zip_cent* cent);
+	void cent_parse(const unsigned char* data, unsigned data_size, unsigned length, bool borrow);
 
 	friend class zip_entry;
 public:
 	static void pedantic_set(bool Apedantic) { pedantic = Apedantic; }
+	static void append_waste_set(unsigned Apercent) { append_waste = Apercent; }
+	static void mmap_set(bool Aenable) { mmap_enable = Aenable; }
 
 	zip(const std::string& Apath);
 	zip(const zip& A);
@@ -288,6 +338,7 @@ public:
 	std::string file_get() const { return path; }
 
 	void open();
+	bool open(zip_cent& cent);
 	void create();
 	void close();
 	void reopen();
@@ -297,7 +348,7 @@ public:
 
 	bool is_open() const { return flag.open; }
 	bool is_load() const { assert(flag.open); return flag.read; }
-	bool is_modify() const { assert(flag.open && flag.read); return flag.modify; }
+	bool is_modify() const { assert(flag.open); return flag.modify; }
 
 	void erase(iterator i);
 	void rename(iterator i, const std::string& Aname);
@@ -310,6 +361,7 @@ public:
 #endif
 
 	void test() const;
+	void verify(std::list<std::string>& report);
 };
 
 #endif
@@ -21,15 +21,31 @@
 #include "portable.h"
 
 #include "ziprom.h"
+#include "stats.h"
+
+#include <algorithm>
 
 using namespace std;
 
-ziprom::ziprom(const string& Apath, zip_type Atype, bool Areadonly) : zip(Apath), type(Atype), readonly(Areadonly)
+/**
+ * Write the changes on the disk.
+ * If disabled the changes are kept only in memory, like for a plan.
+ */
+bool ziprom::save_enable = true;
+
+/**
+ * Stream of the log of the changes of the new zips.
+ */
+ostream* ziprom::log_default = &cerr;
+
+ziprom::ziprom(const string& Apath, zip_type Atype, bool Areadonly) : zip(Apath), type(Atype), readonly(Areadonly), log_os(log_default), archive(0), archive_order(0), entry_order(0)
 {
 }
 
-ziprom::ziprom(const ziprom& A) : zip(A), type(A.type), readonly(A.readonly)
+ziprom::ziprom(const ziprom& A) : zip(A), type(A.type), readonly(A.readonly), log_os(log_default), archive(0), archive_order(0), entry_order(0)
 {
+	// the copied entries are new objects
+	index_build();
 }
 
 ziprom::~ziprom()
@@ -45,6 +61,36 @@ void ziprom::open()
 		throw;
 	}
 
+	open_set();
+}
+
+/**
+ * Open using a copy of the central directory.
+ * \return If the copy was updated.
+ */
+bool ziprom::open(zip_cent& cent)
+{
+	bool updated;
+
+	try {
+		updated = zip::open(cent);
+	} catch (error& e) {
+		readonly = true;
+		throw;
+	}
+
+	open_set();
+
+	return updated;
+}
+
+/**
+ * Set the state after opening.
+ */
+void ziprom::open_set()
+{
+	index_build();
+
 	if (is_load()) {
 		// if it's loaded means that the file is just created
 		readonly = false;
@@ -54,12 +100,125 @@ void ziprom::open()
 	}
 }
 
+void ziprom::close()
+{
+	name_index.clear();
+	crc_index.clear();
+
+	zip::close();
+}
+
+/**
+ * Rebuild the entry indexes from the zip.
+ */
+void ziprom::index_build()
+{
+	entry_order = 0;
+	name_index.clear();
+	crc_index.clear();
+
+	if (!is_open())
+		return;
+
+	for(ziprom::iterator i=begin();i!=end();++i)
+		index_insert(i);
+}
+
+/**
+ * Insert an entry in the indexes.
+ * \return The order assigned at the entry.
+ */
+unsigned ziprom::index_insert(ziprom::iterator i)
+{
+	unsigned order = ++entry_order;
+
+	name_index.insert(ziprom_name_index::value_type(ziprom_name_key(i->name_get(), order), i));
+	crc_index.insert(ziprom_crc_index::value_type(ziprom_crc_key(i->uncompressed_size_get(), i->crc_get(), order), i));
+
+	return order;
+}
+
+/**
+ * Remove an entry from the indexes.
+ * \return The order of the removed entry.
+ */
+unsigned ziprom::index_erase(ziprom::iterator i)
+{
+	ziprom_crc_index::iterator j = crc_index.lower_bound(ziprom_crc_key(i->uncompressed_size_get(), i->crc_get(), 0));
+	while (j != crc_index.end() && j->second != i)
+		++j;
+
+	if (j == crc_index.end())
+		throw error() << "Failed internal check on the index of zip " << file_get();
+
+	unsigned order = j->first.order_get();
+
+	crc_index.erase(j);
+	name_index.erase(ziprom_name_key(i->name_get(), order));
+
+	return order;
+}
+
+ziprom::iterator ziprom::insert(const zip_entry& A, const string& Aname)
+{
+	ziprom::iterator i = zip::insert(A, Aname);
+
+	unsigned order = index_insert(i);
+
+	if (archive)
+		archive->index_insert(*this, i, order);
+
+	return i;
+}
+
+void ziprom::erase(ziprom::iterator i)
+{
+	unsigned order = index_erase(i);
+
+	if (archive)
+		archive->index_erase(*this, i, order);
+
+	zip::erase(i);
+}
+
+void ziprom::rename(ziprom::iterator i, const string& Aname)
+{
+	ziprom_crc_index::iterator j = crc_index.lower_bound(ziprom_crc_key(i->uncompressed_size_get(), i->crc_get(), 0));
+	while (j != crc_index.end() && j->second != i)
+		++j;
+
+	if (j == crc_index.end())
+		throw error() << "Failed internal check on the index of zip " << file_get();
+
+	unsigned order = j->first.order_get();
+
+	name_index.erase(ziprom_name_key(i->name_get(), order));
+
+	zip::rename(i, Aname);
+
+	name_index.insert(ziprom_name_index::value_type(ziprom_name_key(i->name_get(), order), i));
+}
+
 ziprom::iterator ziprom::find(const string& name)
 {
-	for(ziprom::iterator i=begin();i!=end();++i) {
-		if (file_compare(i->name_get(), name)==0) {
-			return i;
-		}
+	ziprom_name_index::iterator i = name_index.lower_bound(ziprom_name_key(name, 0));
+	if (i == name_index.end() || file_compare(i->first.name_get(), name) != 0)
+		return end();
+
+	return i->second;
+}
+
+/**
+ * Find the first entry with the specified crc and size.
+ * The damaged entries are skipped.
+ */
+ziprom::iterator ziprom::find(unsigned size, crc_t crc)
+{
+	ziprom_crc_index::iterator i = crc_index.lower_bound(ziprom_crc_key(size, crc, 0));
+	while (i != crc_index.end() && i->first.crc_get() == crc && i->first.size_get() == size) {
+		if (!i->second->is_damaged())
+			return i->second;
+		++i;
 	}
 
 	return end();
@@ -68,7 +227,7 @@ ziprom::iterator ziprom::find(const string& name)
 void ziprom::load()
 {
 	if (!is_load()) {
-		cerr << "log: " << "load " << file_get() << endl;
+		log() << "log: " << "load " << file_get() << endl;
 		try {
 			zip::load();
 		} catch (error& e) {
@@ -79,10 +238,29 @@ void ziprom::load()
 
 void ziprom::unload()
 {
-	if (is_load()) {
+	// the changes not saved on the disk are kept
+	if (!save_enable && is_modify())
+		return;
+
+	if (is_load() || is_modify()) {
 		try {
 			if (is_modify()) {
-				zip::reopen();
+				// the entries are read again from the disk
+				if (archive)
+					archive->index_erase(*this);
+
+				try {
+					zip::reopen();
+				} catch (...) {
+					index_build();
+					if (archive)
+						archive->index_insert(*this);
+					throw;
+				}
+
+				index_build();
+				if (archive)
+					archive->index_insert(*this);
 			} else {
 				zip::unload();
 			}
@@ -94,16 +272,19 @@ void ziprom::unload()
 
 void ziprom::save()
 {
-	if (is_load() && is_modify()) {
+	if (!save_enable)
+		return;
+
+	if (is_modify()) {
 		if (size_not_zero() > 0) {
-			cerr << "log: " << "save " << file_get() << endl;
+			log() << "log: " << "save " << file_get() << endl;
 			try {
 				zip::save();
 			} catch (error& e) {
 				throw e << " saving " << file_get();
 			}
 		} else {
-			cerr << "log: " << "delete " << file_get() << endl;
+			log() << "log: " << "delete " << file_get() << endl;
 			try {
 				zip::save();
 			} catch (error& e) {
@@ -115,11 +296,9 @@ void ziprom::save()
 
 void ziprom::remove(const string& zipintname)
 {
-	load();
-
 	ziprom::iterator i = find(zipintname);
 	if (i!=end()) {
-		cerr << "log: " << "remove " << file_get() << "/" << zipintname << endl;
+		log() << "log: " << "remove " << file_get() << "/" << zipintname << endl;
 
 		erase(i);
 	}
@@ -127,8 +306,6 @@ void ziprom::remove(const string& zipintname)
 
 void ziprom::remove(const string& zipintname, ziprom& reject)
 {
-	load();
-
 	ziprom::iterator i = find(zipintname);
 	if (i!=end()) {
 		move(zipintname, reject, zipintname);
@@ -137,12 +314,9 @@ void ziprom::remove(const string& zipintname, ziprom& reject)
 
 void ziprom::move(const string& zipintname_src, ziprom& reject, const string& zipintname_dst)
 {
-	load();
-	reject.load();
-
 	reject.remove(zipintname_dst);
 
-	cerr << "log: " << "move " << file_get() << "/" << zipintname_src << " to " << reject.file_get() << "/" << zipintname_dst << endl;
+	log() << "log: " << "move " << file_get() << "/" << zipintname_src << " to " << reject.file_get() << "/" << zipintname_dst << endl;
 
 	ziprom::iterator i = find(zipintname_src);
 	if (i==end())
@@ -157,11 +331,9 @@ void ziprom::move(const string& zipintname_src, ziprom& reject, const string& zi
 
 void ziprom::add(const ziprom::const_iterator& entry_src, const string& zipintname_dst, ziprom& reject)
 {
-	load();
-
 	remove(zipintname_dst, reject);
 
-	cerr << "log: " << "add " << entry_src->parentname_get() << "/" << entry_src->name_get() << " to " << file_get() << "/" << zipintname_dst << endl;
+	log() << "log: " << "add " << entry_src->parentname_get() << "/" << entry_src->name_get() << " to " << file_get() << "/" << zipintname_dst << endl;
 
 	// insert
 	ziprom::iterator k = insert(*entry_src, zipintname_dst);
@@ -171,11 +343,9 @@ void ziprom::add(const ziprom::const_iterator& entry_src, const string& zipintna
 
 void ziprom::add(const ziprom::const_iterator& entry_src, const string& zipintname_dst)
 {
-	load();
-
 	remove(zipintname_dst);
 
-	cerr << "log: " << "add " << entry_src->parentname_get() << "/" << entry_src->name_get() << " to " << file_get() << "/" << zipintname_dst << endl;
+	log() << "log: " << "add " << entry_src->parentname_get() << "/" << entry_src->name_get() << " to " << file_get() << "/" << zipintname_dst << endl;
 
 	// insert
 	ziprom::iterator k = insert(*entry_src, zipintname_dst);
@@ -183,10 +353,36 @@ void ziprom::add(const ziprom::const_iterator& entry_src, const string& zipintna
 		throw error() << "Failed add of " << zipintname_dst << " in zip " << file_get();
 }
 
-void ziprom::add(const string& zipintname_src, const string& zipintname_dst, ziprom& reject)
+/**
+ * Order of the adds, by source zip and by position in the source.
+ */
+struct ziprom_add_less {
+	bool operator()(const ziprom_add& A, const ziprom_add& B) const
+	{
+		if (A.entry->parentname_get() != B.entry->parentname_get())
+			return A.entry->parentname_get() < B.entry->parentname_get();
+		return A.entry->offset_get() < B.entry->offset_get();
+	}
+};
+
+/**
+ * Add a group of entries of other zips.
+ * The entries are added grouped by source zip, and in the order of their
+ * position in it. In this way each source is read sequentially, both now
+ * for the local headers, and later when the data is copied by save().
+ */
+void ziprom::add(const ziprom_add_container& plan)
 {
-	load();
+	ziprom_add_container order = plan;
+
+	stable_sort(order.begin(), order.end(), ziprom_add_less());
 
+	for(ziprom_add_container::const_iterator i=order.begin();i!=order.end();++i)
+		add(i->entry, i->name);
+}
+
+void ziprom::add(const string& zipintname_src, const string& zipintname_dst, ziprom& reject)
+{
 	ziprom::iterator i = find(zipintname_src);
 	if (i==end())
 		throw error() << "File " << zipintname_src << " not found in zip " << file_get();
@@ -196,8 +392,6 @@ void ziprom::add(const string& zipintname_src, const string& zipintname_dst, zip
 
 void ziprom::add(const string& zipintname_src, const string& zipintname_dst)
 {
-	load();
-
 	ziprom::iterator i = find(zipintname_src);
 	if (i==end())
 		throw error() << "File " << zipintname_src << " not found in zip " << file_get();
@@ -207,33 +401,28 @@ void ziprom::add(const string& zipintname_src, const string& zipintname_dst)
 
 void ziprom::rename(const string& zipintname_src, const string& zipintname_dst, ziprom& reject)
 {
-	load();
-
 	remove(zipintname_dst, reject);
 
-	cerr << "log: " << "rename " << file_get() << "/" << zipintname_src << " to " << zipintname_dst << endl;
+	log() << "log: " << "rename " << file_get() << "/" << zipintname_src << " to " << zipintname_dst << endl;
 
 	ziprom::iterator i = find(zipintname_src);
 	if (i==end())
 		throw error() << "File " << zipintname_src << " not found in zip " << file_get();
 
-	zip::rename(i, zipintname_dst.c_str());
+	rename(i, zipintname_dst);
 }
 
 void ziprom::swap(const string& zipintname, ziprom& reject, ziprom::iterator& reject_entry)
 {
-	load();
-	reject.load();
-
 	ziprom::iterator i = find(zipintname);
 	if (i==end()) {
 		// not present in the zip, it isn't a swap
-		cerr << "log: " << "move " << reject.file_get() << "/" << reject_entry->name_get() << " to " << file_get() << "/" << zipintname << endl;
+		log() << "log: " << "move " << reject.file_get() << "/" << reject_entry->name_get() << " to " << file_get() << "/" << zipintname << endl;
 
 		insert(*reject_entry, reject_entry->name_get());
 		reject.erase(reject_entry);
 	} else {
-		cerr << "log: " << "swap " << reject.file_get() << reject_entry->name_get() << " and " << file_get() << "/" << zipintname << endl;
+		log() << "log: " << "swap " << reject.file_get() << reject_entry->name_get() << " and " << file_get() << "/" << zipintname << endl;
 
 		insert(*reject_entry, reject_entry->name_get());
 		reject.insert(*i, i->name_get());
@@ -243,52 +432,132 @@ void ziprom::swap(const string& zipintname, ziprom& reject, ziprom::iterator& re
 	}
 }
 
-ziparchive_crcsize::ziparchive_crcsize()
+ziparchive_key::ziparchive_key(unsigned Asize, crc_t Acrc, unsigned Azip_order, unsigned Aentry_order) : crc(Acrc), size(Asize), zip_order(Azip_order), entry_order(Aentry_order)
 {
 }
 
-ziparchive_crcsize::ziparchive_crcsize(const ziparchive_crcsize& A) : crc(A.crc), size(A.size)
+ziparchive::ziparchive() : order(0)
 {
+#if HAVE_PTHREAD
+	pthread_mutex_init(&lock, 0);
+#endif
 }
 
-ziparchive_crcsize::ziparchive_crcsize(unsigned Asize, crc_t Acrc) : crc(Acrc), size(Asize)
+ziparchive::~ziparchive()
 {
+	for(iterator i=begin();i!=end();++i) {
+		i->close();
+	}
+
+#if HAVE_PTHREAD
+	pthread_mutex_destroy(&lock);
+#endif
 }
 
-ziparchive_crcsize::~ziparchive_crcsize()
+/**
+ * Insert an entry in the index.
+ * Different zips can be changed concurrently, but not while the index is searched.
+ */
+void ziparchive::index_insert(const ziprom& A, ziprom::const_iterator j, unsigned entry_order)
 {
+	// the damaged entries are never used as source
+	if (j->is_damaged())
+		return;
+
+	ziparchive_position::const_iterator i = position.find(&A);
+	assert(i != position.end());
+
+	ziparchive_pos pos;
+	pos.zip = i->second;
+	pos.entry = j;
+
+#if HAVE_PTHREAD
+	pthread_mutex_lock(&lock);
+#endif
+	index.insert(ziparchive_index::value_type(ziparchive_key(j->uncompressed_size_get(), j->crc_get(), A.archive_order, entry_order), pos));
+#if HAVE_PTHREAD
+	pthread_mutex_unlock(&lock);
+#endif
 }
 
-ziparchive::ziparchive()
+void ziparchive::index_erase(const ziprom& A, ziprom::const_iterator j, unsigned entry_order)
 {
+#if HAVE_PTHREAD
+	pthread_mutex_lock(&lock);
+#endif
+	index.erase(ziparchive_key(j->uncompressed_size_get(), j->crc_get(), A.archive_order, entry_order));
+#if HAVE_PTHREAD
+	pthread_mutex_unlock(&lock);
+#endif
 }
 
-ziparchive::~ziparchive()
+void ziparchive::index_insert(const ziprom& A)
 {
-	for(iterator i=begin();i!=end();++i) {
-		i->close();
+	for(ziprom_crc_index::const_iterator i=A.crc_index.begin();i!=A.crc_index.end();++i) {
+		index_insert(A, i->second, i->first.order_get());
 	}
 }
 
-ziparchive::const_iterator ziparchive::find(const string& zipfile) const {
-	for(const_iterator i=begin();i!=end();++i) {
-		if (zipfile == i->file_get()) {
-			return i;
-		}
+void ziparchive::index_erase(const ziprom& A)
+{
+	for(ziprom_crc_index::const_iterator i=A.crc_index.begin();i!=A.crc_index.end();++i) {
+		index_erase(A, i->second, i->first.order_get());
 	}
+}
 
-	return end();
+/**
+ * Insert a zip of data in the indexes.
+ */
+void ziparchive::link(iterator A)
+{
+	A->archive = this;
+	A->archive_order = ++order;
+
+	position[&*A] = A;
+	path.insert(ziparchive_path::value_type(A->file_get(), A));
+
+	index_insert(*A);
 }
 
-ziparchive::iterator ziparchive::find(const string& zipfile)
+/**
+ * Remove a zip of data from the indexes.
+ */
+void ziparchive::unlink(iterator A)
 {
-	for(iterator i=begin();i!=end();++i) {
-		if (zipfile == i->file_get()) {
-			return i;
+	index_erase(*A);
+
+	position.erase(&*A);
+
+	pair<ziparchive_path::iterator, ziparchive_path::iterator> range = path.equal_range(A->file_get());
+	for(ziparchive_path::iterator i=range.first;i!=range.second;++i) {
+		if (i->second == A) {
+			path.erase(i);
+			break;
 		}
 	}
 
-	return end();
+	A->archive = 0;
+}
+
+ziparchive::const_iterator ziparchive::find(const string& zipfile) const {
+	stats_add(stats_find);
+
+	ziparchive_path::const_iterator i = path.lower_bound(zipfile);
+	if (i == path.end() || i->first != zipfile)
+		return end();
+
+	return i->second;
+}
+
+ziparchive::iterator ziparchive::find(const string& zipfile)
+{
+	stats_add(stats_find);
+
+	ziparchive_path::iterator i = path.lower_bound(zipfile);
+	if (i == path.end() || i->first != zipfile)
+		return end();
+
+	return i->second;
 }
 
 ziparchive::iterator ziparchive::open_and_insert(const ziprom& A)
@@ -306,14 +575,26 @@ ziparchive::iterator ziparchive::open_and_insert(const ziprom& A)
 
 	assert(i->is_open());
 
-	// update the index
-	for(ziprom::const_iterator j=i->begin();j!=i->end();++j) {
-		index.insert(ziparchive_crcsize(j->uncompressed_size_get(), j->crc_get()));
-	}
+	link(i);
 
 	return i;
 }
 
+/**
+ * Move an already opened zip from another container.
+ * The zip is removed from the original container.
+ */
+ziparchive::iterator ziparchive::insert(zipromcontainer& from, iterator A)
+{
+	assert(A->is_open());
+
+	data.splice(data.end(), from, A);
+
+	link(A);
+
+	return A;
+}
+
 void ziparchive::update(const ziprom& A)
 {
 	assert(A.is_open());
@@ -321,7 +602,6 @@ void ziparchive::update(const ziprom& A)
 	// remove if already present
 	ziparchive::iterator i = find(A.file_get());
 	if (i != end()) {
-		i->close();
 		erase(i);
 	}
 
@@ -331,79 +611,57 @@ void ziparchive::update(const ziprom& A)
 
 		assert(i->is_open());
 
-		// update the index
-		for(ziprom::const_iterator j=A.begin();j!=A.end();++j) {
-			index.insert(ziparchive_crcsize(j->uncompressed_size_get(), j->crc_get()));
-		}
+		link(i);
 	}
 }
 
 void ziparchive::erase(ziparchive::iterator A)
 {
+	unlink(A);
+
 	data.erase(A);
 }
 
-ziparchive::const_iterator ziparchive::find_iter(unsigned size, crc_t crc, ziprom::const_iterator& k) const
+ziparchive::const_iterator ziparchive::find(unsigned size, crc_t crc, ziprom::const_iterator& k) const
 {
-	for(const_iterator i=begin();i!=end();++i) {
-		for(ziprom::const_iterator j=i->begin();j!=i->end();++j) {
-			if (crc==j->crc_get() && size==j->uncompressed_size_get()) {
-				k = j;
-				return i;
-			}
-		}
-	}
-	return end();
-}
+	stats_add(stats_find);
 
-ziparchive::const_iterator ziparchive::find_iter(unsigned size, crc_t crc, zip_type type, ziprom::const_iterator& k) const
-{
-	for(const_iterator i=begin();i!=end();++i) {
-		if (type==i->type_get()) {
-			for(ziprom::const_iterator j=i->begin();j!=i->end();++j) {
-				if (crc==j->crc_get() && size==j->uncompressed_size_get()) {
-					k = j;
-					return i;
-				}
-			}
-		}
-	}
-	return end();
-}
+	ziparchive_index::const_iterator i = index.lower_bound(ziparchive_key(size, crc, 0, 0));
+	if (i == index.end() || i->first.crc_get() != crc || i->first.size_get() != size)
+		return end();
 
-ziparchive::const_iterator ziparchive::find(unsigned size, crc_t crc, ziprom::const_iterator& k) const
-{
-	ziparchive_crcsizeset::const_iterator i = index.find(ziparchive_crcsize(size, crc));
-	if (i!=index.end())
-		return find_iter(size, crc, k);
-	return end();
+	k = i->second.entry;
+	return i->second.zip;
 }
 
 ziparchive::const_iterator ziparchive::find(unsigned size, crc_t crc, zip_type type, ziprom::const_iterator& k) const
 {
-	return find_iter(size, crc, type, k);
-}
+	stats_add(stats_find);
 
-ziparchive::const_iterator ziparchive::find_exclude_iter(const ziprom& exclude, unsigned size, crc_t crc, ziprom::const_iterator& k) const
-{
-	for(const_iterator i=begin();i!=end();++i) {
-		if (&*i != &exclude) {
-			for(ziprom::const_iterator j=i->begin();j!=i->end();++j) {
-				if (crc==j->crc_get() && size==j->uncompressed_size_get()) {
-					k = j;
-					return i;
-				}
-			}
+	ziparchive_index::const_iterator i = index.lower_bound(ziparchive_key(size, crc, 0, 0));
+	while (i != index.end() && i->first.crc_get() == crc && i->first.size_get() == size) {
+		if (i->second.zip->type_get() == type) {
+			k = i->second.entry;
+			return i->second.zip;
 		}
+		++i;
 	}
+
 	return end();
 }
 
 ziparchive::const_iterator ziparchive::find_exclude(const ziprom& exclude, unsigned size, crc_t crc, ziprom::const_iterator& k) const
 {
-	ziparchive_crcsizeset::const_iterator i = index.find(ziparchive_crcsize(size, crc));
-	if (i!=index.end())
-		return find_exclude_iter(exclude, size, crc, k);
+	stats_add(stats_find);
+
+	ziparchive_index::const_iterator i = index.lower_bound(ziparchive_key(size, crc, 0, 0));
+	while (i != index.end() && i->first.crc_get() == crc && i->first.size_get() == size) {
+		if (&*i->second.zip != &exclude) {
+			k = i->second.entry;
+			return i->second.zip;
+		}
+		++i;
+	}
+
 	return end();
 }
-
@@ -24,30 +24,127 @@
 #include "zip.h"
 #include "rom.h"
 
+#include <map>
+#include <vector>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 enum zip_type {
 	zip_own, // roms part of the set
 	zip_import, // roms of other sets used for importing
 	zip_unknown // roms unknown
 };
 
+/**
+ * Key of the entry index by name.
+ * The name is compared case insensitive, like file_compare().
+ * The order keeps the entries with the same name sorted like in the zip.
+ */
+class ziprom_name_key {
+	std::string name;
+	unsigned order;
+public:
+	ziprom_name_key(const std::string& Aname, unsigned Aorder) : name(Aname), order(Aorder) { }
+
+	const std::string& name_get() const { return name; }
+	unsigned order_get() const { return order; }
+
+	bool operator<(const ziprom_name_key& A) const {
+		int r = file_compare(name, A.name);
+		if (r != 0) return r < 0;
+		return order < A.order;
+	}
+};
+
+/**
+ * Key of the entry index by crc and size.
+ * The order keeps the entries with the same crc and size sorted like in the zip.
+ */
+class ziprom_crc_key {
+	crc_t crc;
+	unsigned size;
+	unsigned order;
+public:
+	ziprom_crc_key(unsigned Asize, crc_t Acrc, unsigned Aorder) : crc(Acrc), size(Asize), order(Aorder) { }
+
+	crc_t crc_get() const { return crc; }
+	unsigned size_get() const { return size; }
+	unsigned order_get() const { return order; }
+
+	bool operator<(const ziprom_crc_key& A) const {
+		if (crc != A.crc) return crc < A.crc;
+		if (size != A.size) return size < A.size;
+		return order < A.order;
+	}
+};
+
+typedef std::map<ziprom_name_key, zip_entry_list::iterator> ziprom_name_index;
+typedef std::map<ziprom_crc_key, zip_entry_list::iterator> ziprom_crc_index;
+
+/**
+ * Entry of another zip to add.
+ */
+struct ziprom_add {
+	zip_entry_list::const_iterator entry; // entry to copy
+	std::string name; // name in the zip
+};
+
+typedef std::vector<ziprom_add> ziprom_add_container;
+
+class ziparchive;
+
 class ziprom : public zip {
 	zip_type type;
 	bool readonly;
+	std::ostream* log_os; // stream of the log of the changes
+
+	static bool save_enable;
+	static std::ostream* log_default;
+
+	ziparchive* archive; // archive containing the zip, 0 if none
+	unsigned archive_order; // position of the zip in the archive
+
+	unsigned entry_order; // counter of the entries inserted
+	ziprom_name_index name_index; // entries by name
+	ziprom_crc_index crc_index; // entries by crc and size
+
+	friend class ziparchive;
 
 	void move(const std::string& zipintname_src, ziprom& dst, const std::string& zipintname_dst);
 
+	void open_set();
+	void index_build();
+	unsigned index_insert(ziprom::iterator i);
+	unsigned index_erase(ziprom::iterator i);
+
+	// keep the indexes updated
+	ziprom::iterator insert(const zip_entry& A, const std::string& Aname);
+	void erase(ziprom::iterator i);
+	void rename(ziprom::iterator i, const std::string& Aname);
+
 	ziprom();
 public:
 	ziprom(const std::string& Apath, zip_type Atype, bool Areadonly);
 	ziprom(const ziprom& A);
 	~ziprom();
 
+	static void save_set(bool Aenable) { save_enable = Aenable; }
+	static bool save_get() { return save_enable; }
+	static void log_default_set(std::ostream& os) { log_default = &os; }
+
 	bool is_readonly() const { return readonly; }
+	void log_set(std::ostream& os) { log_os = &os; }
+	std::ostream& log() const { return *log_os; }
 	zip_type type_get() const { return type; }
 
 	void open();
+	bool open(zip_cent& cent);
+	void close();
 
 	ziprom::iterator find(const std::string& name);
+	ziprom::iterator find(unsigned size, crc_t crc);
 	void load();
 	void unload();
 	void save();
@@ -60,6 +157,7 @@ public:
 	void add(const ziprom::const_iterator& entry_src, const std::string& zipintname_dst, ziprom& reject);
 	void add(const std::string& zipintname_src, const std::string& zipintname_dst);
 	void add(const std::string& zipintname_src, const std::string& zipintname_dst, ziprom& reject);
+	void add(const ziprom_add_container& plan);
 	void rename(const std::string& zipintname_src, const std::string& zipintname_dst, ziprom& reject);
 	void swap(const std::string& zipintname, ziprom& reject, ziprom::iterator& reject_entry);
 };
@@ -73,20 +171,39 @@ struct ziprom_by_file_less {
 
 typedef std::list<ziprom> zipromcontainer;
 
-class ziparchive_crcsize {
+/**
+ * Key of the archive index.
+ * The zip and entry order keep the elements with the same crc and size
+ * sorted like in the archive.
+ */
+class ziparchive_key {
 	crc_t crc;
 	unsigned size;
+	unsigned zip_order;
+	unsigned entry_order;
 public:
-	ziparchive_crcsize();
-	ziparchive_crcsize(const ziparchive_crcsize& A);
-	ziparchive_crcsize(unsigned size, crc_t crc);
-	~ziparchive_crcsize();
+	ziparchive_key(unsigned Asize, crc_t Acrc, unsigned Azip_order, unsigned Aentry_order);
 
-	bool operator==(const ziparchive_crcsize& A) const { return crc==A.crc && size==A.size; }
-	bool operator<(const ziparchive_crcsize& A) const { return crc<A.crc || (crc==A.crc && size<A.size); }
+	crc_t crc_get() const { return crc; }
+	unsigned size_get() const { return size; }
+	unsigned zip_order_get() const { return zip_order; }
+
+	bool operator<(const ziparchive_key& A) const {
+		if (crc != A.crc) return crc < A.crc;
+		if (size != A.size) return size < A.size;
+		if (zip_order != A.zip_order) return zip_order < A.zip_order;
+		return entry_order < A.entry_order;
+	}
 };
 
-typedef std::set<ziparchive_crcsize> ziparchive_crcsizeset;
+struct ziparchive_pos {
+	zipromcontainer::const_iterator zip;
+	ziprom::const_iterator entry;
+};
+
+typedef std::map<ziparchive_key, ziparchive_pos> ziparchive_index;
+typedef std::map<const ziprom*, zipromcontainer::iterator> ziparchive_position;
+typedef std::multimap<std::string, zipromcontainer::iterator> ziparchive_path;
 
 class ziparchive {
 public:
@@ -95,13 +212,24 @@ public:
 
 private:
 	zipromcontainer data; // list of zip
-	mutable ziparchive_crcsizeset index; // fast exist test in data
+	ziparchive_index index; // crc and size index of all the entries in data
+	ziparchive_position position; // position of the zips in data
+	ziparchive_path path; // path index of the zips in data
+	unsigned order; // counter of the zips inserted
+#if HAVE_PTHREAD
+	pthread_mutex_t lock; // lock of the index, as the zips may be changed by different threads
+#endif
+
+	friend class ziprom;
 
 	ziparchive(const ziparchive&);
 
-	const_iterator find_iter(unsigned size, crc_t crc, ziprom::const_iterator& k) const;
-	const_iterator find_iter(unsigned size, crc_t crc, zip_type type, ziprom::const_iterator& k) const;
-	const_iterator find_exclude_iter(const ziprom& exclude, unsigned size, crc_t crc, ziprom::const_iterator& k) const;
+	void link(iterator A);
+	void unlink(iterator A);
+	void index_insert(const ziprom& A, ziprom::const_iterator j, unsigned entry_order);
+	void index_erase(const ziprom& A, ziprom::const_iterator j, unsigned entry_order);
+	void index_insert(const ziprom& A);
+	void index_erase(const ziprom& A);
 
 public:
 	ziparchive();
@@ -109,6 +237,7 @@ public:
 
 	unsigned size() const { return data.size(); }
 	iterator open_and_insert(const ziprom& A);
+	iterator insert(zipromcontainer& from, iterator A);
 	void update(const ziprom& A);
 	void erase(iterator A);
 